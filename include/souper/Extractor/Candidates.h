@@ -15,6 +15,7 @@
 #ifndef SOUPER_EXTRACTOR_CANDIDATES_H
 #define SOUPER_EXTRACTOR_CANDIDATES_H
 
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Analysis/DemandedBits.h"
 #include "llvm/Analysis/LazyValueInfo.h"
@@ -80,7 +81,11 @@ struct ExprBuilderOptions {
   /// controlled IR input (i.e. the unit tests).
   bool NamedArrays;
 
-  ExprBuilderOptions() : NamedArrays(false) {}
+  /// If set, candidates are only harvested from these blocks. Path
+  /// conditions may still come from anywhere in the function.
+  const llvm::SmallPtrSetImpl<llvm::BasicBlock *> *HarvestBlocks;
+
+  ExprBuilderOptions() : NamedArrays(false), HarvestBlocks(nullptr) {}
 };
 
 struct BlockInfo {
@@ -16,6 +16,7 @@
 #define SOUPER_EXTRACTOR_EXPRBUILDER_H
 
 #include "souper/Inst/Inst.h"
+#include "souper/SMTLIB2/Solver.h"
 #include "souper/Util/UniqueNameSet.h"
 #include <unordered_map>
 
@@ -40,7 +41,8 @@ class ExprBuilder {
   const unsigned MAX_PHI_DEPTH = 25;
 public:
   enum Builder {
-    KLEE
+    KLEE,
+    Z3
   };
 
   ExprBuilder(InstContext &IC) : LIC(&IC) {}
@@ -59,6 +61,10 @@ public:
   Inst *getDataflowConditions(Inst *I);
   Inst *getUBInstCondition(Inst *Root);
 
+  Inst *GetCandidateExprForReplacement(
+         const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+         InstMapping Mapping, Inst *Precondition, bool Negate, bool DropUB);
+
 protected:
   InstContext *LIC;
 
@@ -101,10 +107,6 @@ protected:
   Inst *shlnuwUB(Inst *I);
   Inst *lshrExactUB(Inst *I);
   Inst *ashrExactUB(Inst *I);
-
-  Inst *GetCandidateExprForReplacement(
-         const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
-         InstMapping Mapping, Inst *Precondition, bool Negate, bool DropUB);
 };
 
 std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
@@ -112,7 +114,36 @@ std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
        std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate=false,
        bool DropUB=false);
 
+// Build the query for Mapping and check it with SMTSolver; IsSat is set if
+// the replacement is not valid. Solvers that translate souper expressions
+// themselves are handed the candidate expression, the others get the
+// SMT-LIB query printed by the selected ExprBuilder.
+std::error_code SolveQuery(SMTLIBSolver *SMTSolver, InstContext &IC,
+       const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+       InstMapping Mapping, bool &IsSat, std::vector<Inst *> *ModelVars,
+       std::vector<llvm::APInt> *Models, Inst *Precondition, unsigned Timeout,
+       bool Negate=false, bool DropUB=false);
+
+// Returns the query that SolveQuery() checks for the same arguments, as an
+// i1 expression that can be true iff SolveQuery() would set IsSat, or null
+// if there is no such query. This is what goes into an
+// SMTLIBSolver::IncrementalContext.
+Inst *getQueryFormula(InstContext &IC, const BlockPCs &BPCs,
+       const std::vector<InstMapping> &PCs, InstMapping Mapping,
+       Inst *Precondition, bool Negate=false, bool DropUB=false);
+
+// Check LHS => RHS for each of RHSs as one batch, see
+// SMTLIBSolver::isSatisfiableBatch(). IsSat[I] is left empty for the
+// candidates that were not solved.
+std::error_code SolveQueryBatch(SMTLIBSolver *SMTSolver, InstContext &IC,
+       const BlockPCs &BPCs, const std::vector<InstMapping> &PCs, Inst *LHS,
+       const std::vector<Inst *> &RHSs,
+       std::vector<llvm::Optional<bool>> &IsSat, bool StopAtFirstUnsat,
+       unsigned Timeout);
+
 std::unique_ptr<ExprBuilder> createKLEEBuilder(InstContext &IC);
+std::unique_ptr<ExprBuilder> createZ3Builder(InstContext &IC);
+std::unique_ptr<SMTLIBSolver> createZ3LibrarySolver();
 Inst *getUBInstCondition(InstContext &IC, Inst *Root);
 }
 
@@ -86,10 +86,16 @@ public:
                                    Inst *LHS,
                                    std::map<std::string, llvm::APInt> &DBitsVect,
                                    InstContext &IC) = 0;
+
+  // Tells the solver that infer() is about to be called on each of these
+  // candidates, so that a caching layer can fetch their answers at once.
+  virtual void prefetch(const std::vector<CandidateReplacement> &Cands) {}
 };
 
 std::unique_ptr<Solver> createBaseSolver(
     std::unique_ptr<SMTLIBSolver> SMTSolver, unsigned Timeout);
+std::unique_ptr<Solver> createDataflowShortcutSolver(
+    std::unique_ptr<Solver> UnderlyingSolver);
 std::unique_ptr<Solver> createMemCachingSolver(
     std::unique_ptr<Solver> UnderlyingSolver);
 std::unique_ptr<Solver> createExternalCachingSolver(
@@ -63,6 +63,13 @@ namespace souper {
     // Checks the cache or instruction metadata for knonwbits information
     bool cacheHasValue(Inst *I);
 
+    // Known bits of node ID of DAG. The values and known bits found on the
+    // way are kept in Vals and KBs, indexed by node ID.
+    llvm::KnownBits findKnownBits(const LinearDAG &DAG, unsigned ID,
+                                  ConcreteInterpreter &CI, bool UsePartialEval,
+                                  std::vector<llvm::Optional<EvalValue>> &Vals,
+                                  std::vector<llvm::Optional<llvm::KnownBits>> &KBs);
+
   public:
     KnownBitsAnalysis() {}
     KnownBitsAnalysis(std::unordered_map<Inst*, llvm::KnownBits> &Assumptions) {
@@ -82,6 +89,10 @@ namespace souper {
 
     llvm::KnownBits findKnownBits(Inst *I,
                                   ConcreteInterpreter &CI, bool UsePartialEval = true);
+    // Known bits of the last node of DAG. Callers that analyze the same DAG
+    // with many interpreters can build it once.
+    llvm::KnownBits findKnownBits(const LinearDAG &DAG,
+                                  ConcreteInterpreter &CI, bool UsePartialEval = true);
 
     static llvm::KnownBits findKnownBitsUsingSolver(Inst *I,
                                                     Solver *S,
@@ -102,6 +113,11 @@ namespace souper {
     // checks the cache or instruction metadata for cr information
     bool cacheHasValue(Inst *I);
 
+    llvm::ConstantRange findConstantRange(const LinearDAG &DAG, unsigned ID,
+                                          ConcreteInterpreter &CI, bool UsePartialEval,
+                                          std::vector<llvm::Optional<EvalValue>> &Vals,
+                                          std::vector<llvm::Optional<llvm::ConstantRange>> &CRs);
+
   public:
     ConstantRangeAnalysis() {}
     ConstantRangeAnalysis(std::unordered_map<Inst*, llvm::ConstantRange> &Assumptions) {
@@ -118,6 +134,9 @@ namespace souper {
     }
     llvm::ConstantRange findConstantRange(souper::Inst *I,
                                           ConcreteInterpreter &CI, bool UsePartialEval = true);
+    // Constant range of the last node of DAG
+    llvm::ConstantRange findConstantRange(const LinearDAG &DAG,
+                                          ConcreteInterpreter &CI, bool UsePartialEval = true);
 
     static llvm::ConstantRange findConstantRangeUsingSolver(souper::Inst *I,
                                                             Solver *S,
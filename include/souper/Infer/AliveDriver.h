@@ -20,6 +20,7 @@
 #include "alive2/ir/function.h"
 #include "alive2/smt/smt.h"
 
+#include <memory>
 #include <unordered_map>
 #include <optional>
 
@@ -66,9 +67,18 @@ private:
   bool IsLHS;
 
   InstContext &IC;
-  smt::smt_initializer smt_init;
+  std::shared_ptr<smt::smt_initializer> SMTInit;
 };
 
+// Returns a driver for LHS and PreCondition that is kept for later calls
+// with the same arguments, so that the LHS is translated to Alive2 once and
+// each RHS verified against it only costs the translation of the RHS.
+// ExtraInputs are the inputs of the RHSs that the LHS and PreCondition do
+// not have.
+std::shared_ptr<AliveDriver> getAliveSession(Inst *LHS, Inst *PreCondition,
+                                             InstContext &IC,
+                                             std::vector<Inst *> ExtraInputs = {});
+
 bool isTransformationValid(Inst* LHS, Inst* RHS, const std::vector<InstMapping> &PCs,
                            const souper::BlockPCs &BPCs, InstContext &IC);
 
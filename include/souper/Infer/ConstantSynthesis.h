@@ -25,11 +25,17 @@
 
 namespace souper {
 
+class CounterexampleStore;
 class PruningManager;
 
 class ConstantSynthesis {
 public:
-  ConstantSynthesis(PruningManager *P = nullptr) : Pruner(P) {}
+  // The inputs of P and the counterexamples in C constrain the first
+  // query. A guess that C refutes is not verified by the solver, and the
+  // counterexamples that verification comes up with are added to C.
+  ConstantSynthesis(PruningManager *P = nullptr,
+                    CounterexampleStore *C = nullptr)
+    : Pruner(P), Counterexamples(C) {}
 
   // Synthesize a set of constants from the specification in LHS
   std::error_code synthesize(SMTLIBSolver *SMTSolver,
@@ -42,6 +48,7 @@ public:
 
 private:
   PruningManager *Pruner = nullptr;
+  CounterexampleStore *Counterexamples = nullptr;
 };
 }
 
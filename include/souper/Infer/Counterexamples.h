@@ -0,0 +1,80 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_COUNTEREXAMPLES_H
+#define SOUPER_COUNTEREXAMPLES_H
+
+#include "llvm/ADT/APInt.h"
+#include "souper/Infer/Interpreter.h"
+#include "souper/Inst/Inst.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace souper {
+
+// Inputs on which the solver has shown some guess to differ from an LHS.
+// A guess that differs from the LHS on one of them can't be valid either,
+// which the concrete interpreter finds out without asking the solver.
+//
+// The inputs outlive the store: they are kept for the rest of the process
+// under the structural hash of the LHS and its path conditions, and a new
+// store for a structurally equal LHS starts out with them.
+class CounterexampleStore {
+public:
+  CounterexampleStore(Inst *LHS, const BlockPCs &BPCs,
+                      const std::vector<InstMapping> &PCs);
+
+  // The store stays empty if it is disabled, or if the LHS has phis or
+  // freezes, on which the concrete interpreter does not follow the solver.
+  bool isEnabled() const { return Enabled; }
+
+  // Takes the values of the inputs of the LHS from a solver model. Returns
+  // true if that gives an input that is new to the store, on which the
+  // path conditions hold and the LHS has a value.
+  bool add(const std::vector<Inst *> &ModelVars,
+           const std::vector<llvm::APInt> &ModelVals);
+
+  // Returns an input on which RHS has a value that differs from that of the
+  // LHS in a demanded bit, or null if there is none. Guesses with holes, symbolic constants or
+  // freezes are never refuted.
+  const ValueCache *findRefutation(Inst *RHS);
+
+  const std::vector<ValueCache> &getInputs() const { return Inputs; }
+
+  unsigned Refuted = 0;
+
+private:
+  Inst *LHS;
+  const std::vector<InstMapping> &PCs;
+  bool Enabled;
+  // the inputs of the LHS and the PCs; an input gives a value to each
+  std::vector<Inst *> Vars;
+  std::set<Inst *> VarSet;
+  std::string Key;
+
+  std::vector<ValueCache> Inputs;
+  // the same inputs, as values of Vars
+  std::vector<std::vector<llvm::APInt>> Rows;
+  std::vector<ConcreteInterpreter> Interpreters;
+  std::vector<llvm::APInt> LHSVals;
+
+  bool addRow(const std::vector<llvm::APInt> &Row);
+  bool canEvaluate(Inst *RHS);
+};
+
+}
+
+#endif  // SOUPER_COUNTEREXAMPLES_H
@@ -16,10 +16,13 @@
 #define SOUPER_INTERPRTER_H
 
 #include "souper/Extractor/Solver.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/KnownBits.h"
 #include "llvm/IR/ConstantRange.h"
 
 #include "souper/Inst/Inst.h"
+#include "souper/Inst/LinearDAG.h"
 
 #include <unordered_map>
 
@@ -109,10 +112,12 @@ EvalValue evaluateLShr(llvm::APInt A, llvm::APInt B);
 EvalValue evaluateAShr(llvm::APInt A, llvm::APInt B);
 
   class ConcreteInterpreter {
+    friend class BatchInterpreter;
     ValueCache Cache;
     bool CacheWritable = false;
     bool EvalPhiFirstBranch = false;
-    EvalValue evaluateSingleInst(Inst *I, std::vector<EvalValue> &Args);
+    bool APIntOnly = false;
+    EvalValue evaluateSingleInst(Inst *I, llvm::SmallVectorImpl<EvalValue> &Args);
 
   public:
     ConcreteInterpreter() {}
@@ -123,7 +128,59 @@ EvalValue evaluateAShr(llvm::APInt A, llvm::APInt B);
       CacheWritable = false;
     }
     void setEvalPhiFirstBranch() {EvalPhiFirstBranch = true;};
+    // Do all arithmetic on APInts, even for values that fit in 64 bits
+    void setAPIntOnly() {APIntOnly = true;};
     EvalValue evaluateInst(Inst *Root);
+    // Evaluates node ID of DAG like evaluateInst does. Vals is indexed by
+    // node ID; nodes that have a value there are not evaluated again, and
+    // the nodes that get evaluated leave their values there.
+    EvalValue evaluateNode(const LinearDAG &DAG, unsigned ID,
+                           std::vector<llvm::Optional<EvalValue>> &Vals);
+  };
+
+  // Evaluates an Inst DAG on many inputs at once. The values of a node on
+  // all inputs are kept together, one lane per input, and the common
+  // operations on values of at most 64 bits are done for all lanes in one
+  // loop. Lanes that such a loop can't handle, and all other operations,
+  // are evaluated one input at a time like ConcreteInterpreter does.
+  class BatchInterpreter {
+    struct Column {
+      unsigned Width = 0;
+      // EvalValue::ValueKind of each lane
+      std::vector<uint8_t> Kinds;
+      // lane values, if Width is at most 64
+      std::vector<uint64_t> Vals;
+      // lane values, otherwise
+      std::vector<llvm::APInt> Wide;
+    };
+    using ColumnCache = std::unordered_map<souper::Inst *, Column>;
+
+    std::vector<ValueCache> Inputs;
+    // insts that have a value in at least one of the inputs
+    std::unordered_set<souper::Inst *> Given;
+    ColumnCache Columns;
+    bool CacheWritable = false;
+    ConcreteInterpreter Scalar;
+
+    bool allGiven(Inst *I);
+    void evaluate(Inst *I, std::vector<const Column *> &Ops, Column &C);
+    bool evaluateLanes(Inst *I, std::vector<const Column *> &Ops, Column &C);
+    EvalValue getLane(const Column &C, size_t L);
+    void setLane(Column &C, size_t L, const EvalValue &V);
+
+  public:
+    BatchInterpreter() {}
+    BatchInterpreter(std::vector<ValueCache> &Inputs);
+    BatchInterpreter(Inst *I, std::vector<ValueCache> &Inputs)
+      : BatchInterpreter(Inputs) {
+      CacheWritable = true;
+      evaluateInst(I);
+      CacheWritable = false;
+    }
+    void setEvalPhiFirstBranch() {Scalar.setEvalPhiFirstBranch();};
+    size_t getNumInputs() {return Inputs.size();}
+    // Returns the value of Root on each input, in the order of the inputs
+    std::vector<EvalValue> evaluateInst(Inst *Root);
   };
 
 }
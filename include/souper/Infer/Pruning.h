@@ -51,10 +51,23 @@ public:
   // double init antipattern, required because init should
   // not be called when pruning is disabled
 
+  // Like init(), but reuses the input sets of Other, an initialized
+  // PruningManager for the same LHS. Unlike init(), this leaves the LHS
+  // alone, so several threads can do it at once.
+  void initFrom(const PruningManager &Other);
+
+  // Puts Input, e.g. a counterexample from the solver, in front of the
+  // generated inputs if it is valid for the LHS. Only the first few inputs
+  // are tried on every guess, and solver counterexamples tend to refute
+  // more guesses than generated inputs do.
+  bool addInput(const ValueCache &Input);
+
   auto &getInputVals() {return InputVals;}
 private:
   SynthesisContext &SC;
   std::vector<ConcreteInterpreter> ConcreteInterpreters;
+  // the same inputs, for evaluating concrete guesses on all of them at once
+  BatchInterpreter Batch;
   std::vector<llvm::KnownBits> LHSKnownBits;
   std::vector<llvm::ConstantRange> LHSConstantRange;
   HoleAnalysis HA;
@@ -71,6 +84,7 @@ private:
   std::vector<ValueCache> InputVals;
   std::vector<Inst *> &InputVars;
   std::vector<ValueCache> generateInputSets(std::vector<Inst *> &Inputs);
+  void init(const std::vector<ValueCache> *GivenInputVals);
   void setPhiConcretePreds(Inst *Root);
   // For the LHS contained in @SC, check if the given input in @Cache is valid.
   bool isInputValid(ValueCache &Cache);
@@ -40,6 +40,7 @@ extern const std::string ReservedInstPrefix;
 extern const std::string BlockPred;
 
 struct Inst;
+struct StructuralHashMemo;
 
 struct Block {
   std::string Name;
@@ -185,6 +186,9 @@ struct Inst : llvm::FoldingSetNode {
   std::vector<llvm::ConstantRange> RangeRefinement;
   int nReservedConsts = -1;
   int nHoles = -1;
+  // Memoized by GetReplacementLHSHash(), which takes a lock to read or
+  // replace it, since insts are shared by threads
+  std::shared_ptr<StructuralHashMemo> HashMemo;
 };
 
 /// A mapping from an Inst to a replacement. This may either represent a
@@ -242,8 +246,32 @@ class InstContext {
   std::vector<std::unique_ptr<Inst>> Insts;
   llvm::FoldingSet<Inst> InstSet;
   unsigned ReservedConstCounter = 0;
+  unsigned ID;
+
+  InstContext *SharedFrom = nullptr;
+  std::set<Inst *> SharedInsts;
+
+  // Finds the inst with this profile among the shared insts, or else among
+  // those of this context. IP is set to where a new one would go.
+  Inst *findInst(llvm::FoldingSetNodeID &ID, void *&IP);
 
 public:
+  InstContext();
+  ~InstContext();
+
+  // Differs between all the contexts a process creates, even if one of them
+  // takes the place in memory of another. Caches that outlive a context key
+  // on it to never mistake the insts of one context for those of another.
+  unsigned getID() const { return ID; }
+  // Whether the context with this ID still exists, so that such caches can
+  // drop what they keep for one that is gone.
+  static bool isLive(unsigned ID);
+
+  // Makes this context hand out the given insts of Other, rather than
+  // equal ones of its own, so that a scratch context builds on them just
+  // like Other would. Other must not change while this context is in use.
+  void share(InstContext &Other, const std::vector<Inst *> &Insts);
+
   Inst *getConst(const llvm::APInt &I);
   Inst *getUntypedConst(const llvm::APInt &I);
   Inst *getReservedConst();
@@ -302,6 +330,37 @@ std::string GetReplacementLHSString(const BlockPCs &BPCs,
                                     const std::vector<InstMapping> &PCs,
                                     Inst *LHS, ReplacementContext &Context,
                                     bool printNames = false);
+
+/// A 128-bit hash of everything GetReplacementLHSString() prints. Insts are
+/// numbered in the order the printer would number them and variables are
+/// hashed without their names, so left-hand sides that print the same hash
+/// the same without printing anything.
+struct StructuralHash {
+  uint64_t High = 0, Low = 0;
+
+  bool operator==(const StructuralHash &Other) const {
+    return High == Other.High && Low == Other.Low;
+  }
+  bool operator!=(const StructuralHash &Other) const {
+    return !(*this == Other);
+  }
+  /// The hash as 16 raw bytes, for use as a map key.
+  std::string bytes() const;
+};
+
+/// Words, if given, gets the sequence that is hashed. Replacements with
+/// equal words print the same, so comparing them tells a hash collision
+/// apart without printing. The result is memoized in LHS for the same path
+/// conditions, as long as the fields of LHS that it depends on don't change.
+StructuralHash GetReplacementLHSHash(const BlockPCs &BPCs,
+                                     const std::vector<InstMapping> &PCs,
+                                     Inst *LHS, bool HashNames = false,
+                                     std::vector<uint64_t> *Words = nullptr);
+/// The same for GetReplacementString(), without memoization.
+StructuralHash GetReplacementHash(const BlockPCs &BPCs,
+                                  const std::vector<InstMapping> &PCs,
+                                  InstMapping Mapping,
+                                  std::vector<uint64_t> *Words = nullptr);
 void PrintReplacementRHS(llvm::raw_ostream &Out, Inst *RHS,
                          ReplacementContext &Context,
                          bool printNames = false);
@@ -317,6 +376,16 @@ Inst *getInstCopy(Inst *I, InstContext &IC,
                   std::map<Inst *, llvm::APInt> *ConstMap,
                   bool CloneVars);
 
+/// Like getInstCopy(), but every value of width FromWidth gets width ToWidth
+/// instead; i1 values keep their width. Constants are sign-extended or
+/// truncated, and vars that InstCache does not map get new vars of the new
+/// width. Returns null if I has a value of some other width, an inst whose
+/// meaning is tied to its width, a constant that does not fit, or a var
+/// with facts that only hold at the old width.
+Inst *getInstCopyWithWidth(Inst *I, InstContext &IC, unsigned FromWidth,
+                           unsigned ToWidth,
+                           std::map<Inst *, Inst *> &InstCache);
+
 Inst *instJoin(Inst *I, Inst *Reserved, Inst *NewInst,
                std::map<Inst *, Inst *> &InstCache, InstContext &IC);
 
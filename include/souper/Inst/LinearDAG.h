@@ -0,0 +1,65 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_LINEARDAG_H
+#define SOUPER_LINEARDAG_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "souper/Inst/Inst.h"
+
+#include <vector>
+
+namespace souper {
+
+// An Inst DAG laid out as an array. Every node gets an ID, in topological
+// order, so that the operands of a node come before it; the operands of a
+// node are kept as IDs too. Code that walks a DAG can then keep its results
+// in vectors indexed by ID, instead of in maps keyed by Inst pointers.
+class LinearDAG {
+  std::vector<Inst *> Nodes;
+  // the operands of node ID are OpIDs[OpBegin[ID]] up to OpIDs[OpBegin[ID + 1]]
+  std::vector<unsigned> OpBegin{0};
+  std::vector<unsigned> OpIDs;
+  llvm::DenseMap<Inst *, unsigned> IDs;
+
+public:
+  LinearDAG() {}
+  explicit LinearDAG(Inst *Root) {
+    add(Root);
+  }
+
+  // Adds Root and the insts it depends on, those that are not nodes yet,
+  // and returns the ID of Root. A DAG built from a single root has that
+  // root as its last node.
+  unsigned add(Inst *Root);
+
+  size_t size() const {
+    return Nodes.size();
+  }
+  Inst *getNode(unsigned ID) const {
+    return Nodes[ID];
+  }
+  llvm::ArrayRef<unsigned> getOps(unsigned ID) const {
+    return llvm::makeArrayRef(OpIDs).slice(OpBegin[ID],
+                                           OpBegin[ID + 1] - OpBegin[ID]);
+  }
+  // Returns false if I is not a node
+  bool lookup(Inst *I, unsigned &ID) const;
+};
+
+}
+
+#endif  // SOUPER_LINEARDAG_H
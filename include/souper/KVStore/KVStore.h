@@ -15,20 +15,50 @@
 #ifndef SOUPER_KVSTORE_KVSTORE_H
 #define SOUPER_KVSTORE_KVSTORE_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/StringRef.h"
 #include <memory>
+#include <string>
+#include <vector>
 
 namespace souper {
 
+// Storage behind a KVStore. Keys map to hashes of fields, as in Redis.
+class KVBackend {
+public:
+  virtual ~KVBackend();
+  virtual void hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+                       int Incr) = 0;
+  virtual bool hGet(llvm::StringRef Key, llvm::StringRef Field,
+                    std::string &Value) = 0;
+  // Looks up Field of each of Keys, in as few round trips as the backend
+  // allows.
+  virtual void hMGet(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                     std::vector<llvm::Optional<std::string>> &Values);
+  virtual void hSet(llvm::StringRef Key, llvm::StringRef Field,
+                    llvm::StringRef Value) = 0;
+  // Increments may be buffered until the next flush.
+  virtual void flush();
+};
+
+std::unique_ptr<KVBackend> createRedisKVBackend(unsigned Port);
+// An append-only log in a local file that several processes can share.
+std::unique_ptr<KVBackend> createFileKVBackend(llvm::StringRef Path);
+
 class KVStore {
-  class KVImpl;
-  std::unique_ptr<KVImpl> Impl;
+  std::unique_ptr<KVBackend> Impl;
 public:
+  // Uses the backend selected by -souper-kv-backend.
   KVStore();
+  KVStore(std::unique_ptr<KVBackend> Backend);
   ~KVStore();
   void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr);
   bool hGet(llvm::StringRef Key, llvm::StringRef Field, std::string &Value);
+  void hMGet(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+             std::vector<llvm::Optional<std::string>> &Values);
   void hSet(llvm::StringRef Key, llvm::StringRef Field, llvm::StringRef Value);
+  void flush();
 };
 
 }
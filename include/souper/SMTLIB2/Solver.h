@@ -16,6 +16,8 @@
 #define SOUPER_SMTLIB2_SOLVER_H
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ADT/StringRef.h"
 #include <functional>
 #include <memory>
@@ -24,6 +26,8 @@
 
 namespace souper {
 
+struct Inst;
+
 typedef std::function<
     int(const std::vector<std::string> &Args, llvm::StringRef RedirectIn,
         llvm::StringRef RedirectOut, llvm::StringRef RedirectErr,
@@ -31,18 +35,71 @@ typedef std::function<
 
 class SMTLIBSolver {
 public:
+  // A formula that stays loaded in the solver across checks. Constraints
+  // are added to it as they come, so a series of checks that only differ
+  // by a few constraints does not translate the whole formula each time.
+  // A context belongs to the thread that created it.
+  class IncrementalContext {
+  public:
+    virtual ~IncrementalContext();
+    // Constraint is an i1 expression that has to hold from now on
+    virtual void add(Inst *Constraint) = 0;
+    // Result is set if the constraints, and the i1 expressions in
+    // Assumptions, which only hold for this check, can be true together.
+    // Models then holds a satisfying assignment, one value for each
+    // variable appended to ModelVars.
+    virtual std::error_code check(llvm::ArrayRef<Inst *> Assumptions,
+                                  bool &Result,
+                                  std::vector<Inst *> *ModelVars,
+                                  std::vector<llvm::APInt> *Models,
+                                  unsigned Timeout = 0) = 0;
+  };
+
   virtual ~SMTLIBSolver();
   virtual std::string getName() const = 0;
   virtual std::error_code isSatisfiable(llvm::StringRef Query, bool &Result,
                                         unsigned NumModels,
                                         std::vector<llvm::APInt> *Models,
                                         unsigned Timeout = 0) = 0;
+
+  // Check a batch of independent queries; no models are produced. IsSat[I]
+  // receives the answer for Queries[I], or stays empty if that query was not
+  // solved: with StopAtFirstUnsat the batch ends as soon as one query is
+  // found unsatisfiable, and it also ends at the first error, which is
+  // returned.
+  virtual std::error_code
+  isSatisfiableBatch(llvm::ArrayRef<std::string> Queries,
+                     std::vector<llvm::Optional<bool>> &IsSat,
+                     bool StopAtFirstUnsat, unsigned Timeout = 0);
+
+  // Solvers that translate souper expressions themselves, instead of
+  // reading SMT-LIB text, return true here and implement isSatisfiableExpr();
+  // SolveQuery() in ExprBuilder.h picks the right entry point.
+  virtual bool translatesInsts() const { return false; }
+  // Query is an i1 expression that must hold for all inputs. Result is set if
+  // it can be false; Models then holds a counterexample, one value for each
+  // variable appended to ModelVars.
+  virtual std::error_code isSatisfiableExpr(Inst *Query, bool &Result,
+                                            std::vector<Inst *> *ModelVars,
+                                            std::vector<llvm::APInt> *Models,
+                                            unsigned Timeout = 0);
+  // Solvers that can't keep a formula loaded return nullptr
+  virtual std::unique_ptr<IncrementalContext> createIncrementalContext();
 };
 
+// Interpret a solver's textual answer to one query: "sat" followed by the
+// get-value response, or "unsat".
+std::error_code parseSolverResponse(llvm::StringRef Out, bool &Result,
+                                    unsigned NumModels,
+                                    std::vector<llvm::APInt> *Models);
+
 SolverProgram makeExternalSolverProgram(llvm::StringRef Path);
 SolverProgram makeInternalSolverProgram(int MainPtr(int argc, char **argv));
 
 std::unique_ptr<SMTLIBSolver> createZ3Solver(SolverProgram Prog, bool Keep);
+std::unique_ptr<SMTLIBSolver> createPersistentZ3Solver(llvm::StringRef Path,
+                                                       bool Keep,
+                                                       unsigned Jobs = 1);
 
 }
 
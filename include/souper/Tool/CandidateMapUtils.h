@@ -33,11 +33,20 @@ class Solver;
 
 typedef std::vector<CandidateReplacement> CandidateMap;
 
+// Number of candidates to solve concurrently, from -souper-jobs.
+extern unsigned SolverJobs;
+
 void AddToCandidateMap(CandidateMap &M, const CandidateReplacement &CR);
 
 void AddModuleToCandidateMap(InstContext &IC, ExprBuilderContext &EBC,
                              CandidateMap &CandMap, llvm::Module *M);
 
+// Copy a candidate, including its variables and blocks, into IC so that it
+// can be solved on another thread without touching the Insts it shares with
+// other candidates.
+CandidateReplacement CloneCandidate(const CandidateReplacement &Cand,
+                                    InstContext &IC);
+
 bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
                        Solver *Solver, InstContext &IC,
                        KVStore *KVForStaticProfile);
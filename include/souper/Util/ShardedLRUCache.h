@@ -0,0 +1,123 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SOUPER_UTIL_SHARDEDLRUCACHE_H
+#define SOUPER_UTIL_SHARDEDLRUCACHE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringRef.h"
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace souper {
+
+// A string-keyed cache that threads can share. Keys are spread over a fixed
+// number of shards, each with its own lock and LRU list, so that concurrent
+// lookups rarely contend. Every shard gets an equal part of the byte budget;
+// an insertion that takes a shard over its part evicts the least recently
+// used entries of that shard. A budget of zero means no limit.
+template <typename ValueT> class ShardedLRUCache {
+public:
+  // Rough cost of an entry beyond its key and value: list node, hash table
+  // slot and string headers.
+  static constexpr size_t EntryOverhead = 96;
+
+  ShardedLRUCache(size_t Budget, unsigned NumShards = 16)
+      : NumShards(NumShards), ShardBudget(Budget / NumShards),
+        Shards(new Shard[NumShards]) {}
+
+  bool lookup(llvm::StringRef Key, ValueT &Value) {
+    Shard &S = getShard(Key);
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    auto It = S.Index.find(Key);
+    if (It == S.Index.end()) {
+      ++Misses;
+      return false;
+    }
+    ++Hits;
+    S.LRU.splice(S.LRU.begin(), S.LRU, It->second);
+    Value = It->second->Value;
+    return true;
+  }
+
+  // Size is the number of bytes owned by Value, on top of sizeof(ValueT).
+  // If Key is already present, e.g. because another thread answered the
+  // same query in the meantime, the existing entry is kept. Returns the
+  // number of entries evicted to make room.
+  unsigned insert(llvm::StringRef Key, const ValueT &Value, size_t Size) {
+    Size += Key.size() + sizeof(ValueT) + EntryOverhead;
+    Shard &S = getShard(Key);
+    std::lock_guard<std::mutex> Guard(S.Lock);
+    if (S.Index.count(Key))
+      return 0;
+    if (ShardBudget && Size > ShardBudget)
+      return 0;
+
+    unsigned Evicted = 0;
+    while (ShardBudget && S.Bytes + Size > ShardBudget) {
+      Entry &Victim = S.LRU.back();
+      S.Index.erase(Victim.Key);
+      S.Bytes -= Victim.Size;
+      Bytes -= Victim.Size;
+      S.LRU.pop_back();
+      ++Evicted;
+    }
+    Evictions += Evicted;
+
+    S.LRU.push_front(Entry{Key.str(), Value, Size});
+    S.Index[S.LRU.front().Key] = S.LRU.begin();
+    S.Bytes += Size;
+    Bytes += Size;
+    return Evicted;
+  }
+
+  uint64_t hits() const { return Hits; }
+  uint64_t misses() const { return Misses; }
+  uint64_t evictions() const { return Evictions; }
+  uint64_t bytes() const { return Bytes; }
+
+private:
+  struct Entry {
+    std::string Key;
+    ValueT Value;
+    size_t Size;
+  };
+
+  struct Shard {
+    std::mutex Lock;
+    // most recently used first
+    std::list<Entry> LRU;
+    // the keys point into the list entries
+    llvm::DenseMap<llvm::StringRef, typename std::list<Entry>::iterator> Index;
+    size_t Bytes = 0;
+  };
+
+  unsigned NumShards;
+  size_t ShardBudget;
+  std::unique_ptr<Shard[]> Shards;
+  std::atomic<uint64_t> Hits{0}, Misses{0}, Evictions{0}, Bytes{0};
+
+  Shard &getShard(llvm::StringRef Key) {
+    return Shards[llvm::hash_value(Key) % NumShards];
+  }
+};
+
+}
+
+#endif  // SOUPER_UTIL_SHARDEDLRUCACHE_H
@@ -954,6 +954,8 @@ void ExtractExprCandidates(Function &F, const LoopInfo *LI, DemandedBits *DB,
   ExprBuilder EB(Opts, F.getParent(), LI, DB, LVI, SE, TLI, IC, EBC);
 
   for (auto &BB : F) {
+    if (Opts.HarvestBlocks && !Opts.HarvestBlocks->count(&BB))
+      continue;
     std::unique_ptr<BlockCandidateSet> BCS(new BlockCandidateSet);
     for (auto &I : BB) {
       if (isa<ReturnInst>(I))
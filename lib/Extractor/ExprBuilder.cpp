@@ -24,7 +24,9 @@ static llvm::cl::opt<souper::ExprBuilder::Builder> SMTExprBuilder(
     llvm::cl::Hidden,
     llvm::cl::desc("SMT-LIBv2 expression builder (default=klee)"),
     llvm::cl::values(clEnumValN(souper::ExprBuilder::KLEE, "klee",
-                                "Use KLEE's Expr library")),
+                                "Use KLEE's Expr library"),
+                     clEnumValN(souper::ExprBuilder::Z3, "z3",
+                                "Use the Z3 C API")),
     llvm::cl::init(souper::ExprBuilder::KLEE));
 
 bool ExprBuilder::getUBPaths(Inst *I, UBPath *Current,
@@ -978,33 +980,93 @@ Inst *ExprBuilder::GetCandidateExprForReplacement(
   return Result;
 }
 
-std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
-    const std::vector<InstMapping> &PCs, InstMapping Mapping,
-    std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate, bool DropUB) {
-  std::unique_ptr<ExprBuilder> EB;
+static std::unique_ptr<ExprBuilder> createBuilder(InstContext &IC) {
   switch (SMTExprBuilder) {
   case ExprBuilder::KLEE:
-    EB = createKLEEBuilder(IC);
-    break;
+    return createKLEEBuilder(IC);
+  case ExprBuilder::Z3:
+    return createZ3Builder(IC);
   default:
     llvm::report_fatal_error("cannot reach here");
-    break;
   }
+}
 
+std::string BuildQuery(InstContext &IC, const BlockPCs &BPCs,
+    const std::vector<InstMapping> &PCs, InstMapping Mapping,
+    std::vector<Inst *> *ModelVars, Inst *Precondition, bool Negate, bool DropUB) {
+  std::unique_ptr<ExprBuilder> EB = createBuilder(IC);
   return EB->BuildQuery(BPCs, PCs, Mapping, ModelVars, Precondition, Negate, DropUB);
 }
 
-Inst *getUBInstCondition(InstContext &IC, Inst *Root) {
-  std::unique_ptr<ExprBuilder> EB;
-  switch (SMTExprBuilder) {
-  case ExprBuilder::KLEE:
-    EB = createKLEEBuilder(IC);
-    break;
-  default:
-    llvm::report_fatal_error("cannot reach here");
-    break;
+std::error_code SolveQuery(SMTLIBSolver *SMTSolver, InstContext &IC,
+    const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+    InstMapping Mapping, bool &IsSat, std::vector<Inst *> *ModelVars,
+    std::vector<llvm::APInt> *Models, Inst *Precondition, unsigned Timeout,
+    bool Negate, bool DropUB) {
+  if (SMTSolver->translatesInsts()) {
+    std::unique_ptr<ExprBuilder> EB = createBuilder(IC);
+    Inst *Cand = EB->GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                    Precondition, Negate,
+                                                    DropUB);
+    if (!Cand)
+      return std::make_error_code(std::errc::value_too_large);
+    return SMTSolver->isSatisfiableExpr(Cand, IsSat, ModelVars, Models,
+                                        Timeout);
   }
 
+  std::string Query = BuildQuery(IC, BPCs, PCs, Mapping, ModelVars,
+                                 Precondition, Negate, DropUB);
+  if (Query.empty())
+    return std::make_error_code(std::errc::value_too_large);
+  return SMTSolver->isSatisfiable(Query, IsSat,
+                                  ModelVars ? ModelVars->size() : 0, Models,
+                                  Timeout);
+}
+
+Inst *getQueryFormula(InstContext &IC, const BlockPCs &BPCs,
+    const std::vector<InstMapping> &PCs, InstMapping Mapping,
+    Inst *Precondition, bool Negate, bool DropUB) {
+  std::unique_ptr<ExprBuilder> EB = createBuilder(IC);
+  Inst *Cand = EB->GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                  Precondition, Negate,
+                                                  DropUB);
+  if (!Cand)
+    return nullptr;
+  // the solvers look for a way to make the candidate false
+  return IC.getInst(Inst::Eq, 1, {Cand, IC.getConst(llvm::APInt(1, false))});
+}
+
+std::error_code SolveQueryBatch(SMTLIBSolver *SMTSolver, InstContext &IC,
+    const BlockPCs &BPCs, const std::vector<InstMapping> &PCs, Inst *LHS,
+    const std::vector<Inst *> &RHSs, std::vector<llvm::Optional<bool>> &IsSat,
+    bool StopAtFirstUnsat, unsigned Timeout) {
+  IsSat.assign(RHSs.size(), llvm::None);
+  if (SMTSolver->translatesInsts()) {
+    for (unsigned I = 0; I != RHSs.size(); ++I) {
+      bool Result;
+      if (std::error_code EC = SolveQuery(SMTSolver, IC, BPCs, PCs,
+                                          InstMapping(LHS, RHSs[I]), Result,
+                                          0, 0, 0, Timeout))
+        return EC;
+      IsSat[I] = Result;
+      if (!Result && StopAtFirstUnsat)
+        break;
+    }
+    return std::error_code();
+  }
+
+  std::vector<std::string> Queries;
+  for (auto RHS : RHSs) {
+    Queries.push_back(BuildQuery(IC, BPCs, PCs, InstMapping(LHS, RHS), 0, 0));
+    if (Queries.back().empty())
+      return std::make_error_code(std::errc::value_too_large);
+  }
+  return SMTSolver->isSatisfiableBatch(Queries, IsSat, StopAtFirstUnsat,
+                                      Timeout);
+}
+
+Inst *getUBInstCondition(InstContext &IC, Inst *Root) {
+  std::unique_ptr<ExprBuilder> EB = createBuilder(IC);
   return EB->getUBInstCondition(Root);
 }
 
@@ -17,27 +17,50 @@
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/KnownBits.h"
 #include "souper/Extractor/Solver.h"
+#include "souper/Infer/AbstractInterpreter.h"
 #include "souper/Infer/AliveDriver.h"
 #include "souper/Infer/ConstantSynthesis.h"
+#include "souper/Infer/Counterexamples.h"
 #include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/Infer/InstSynthesis.h"
+#include "souper/Infer/Interpreter.h"
 #include "souper/Infer/Pruning.h"
 #include "souper/KVStore/KVStore.h"
 #include "souper/Parser/Parser.h"
-
-#include <unordered_map>
+#include "souper/Util/ShardedLRUCache.h"
+#include <functional>
+#include <mutex>
 
 STATISTIC(MemHitsInfer, "Number of internal cache hits for infer()");
 STATISTIC(MemMissesInfer, "Number of internal cache misses for infer()");
 STATISTIC(MemHitsIsValid, "Number of internal cache hits for isValid()");
 STATISTIC(MemMissesIsValid, "Number of internal cache misses for isValid()");
+STATISTIC(MemHitsDataflow,
+          "Number of internal cache hits for dataflow queries");
+STATISTIC(MemMissesDataflow,
+          "Number of internal cache misses for dataflow queries");
+STATISTIC(MemKeyCollisions,
+          "Number of internal cache hits rejected because of a hash collision");
+STATISTIC(MemEvictions, "Number of entries evicted from the internal cache");
+STATISTIC(MemBytes, "Number of bytes held by the internal cache");
 STATISTIC(ExternalHits, "Number of external cache hits");
 STATISTIC(ExternalMisses, "Number of external cache misses");
+STATISTIC(ExternalPrefetched,
+          "Number of external cache lookups answered by a prefetch");
+STATISTIC(KnownBitsQueries, "Number of solver queries issued by knownBits()");
+STATISTIC(DataflowShortcuts,
+          "Number of dataflow queries answered without the solver");
+STATISTIC(RangesInferred, "Number of ranges inferred by constantRange()");
+STATISTIC(RangeQueries, "Number of solver queries issued by constantRange()");
+STATISTIC(SignBitsQueries, "Number of solver queries issued by signBits()");
+STATISTIC(DemandedBitsQueries,
+          "Number of solver queries issued by testDemandedBits()");
 
 using namespace souper;
 using namespace llvm;
@@ -53,6 +76,14 @@ static cl::opt<bool> InferInsts("souper-infer-inst",
 static cl::opt<int> MaxLHSSize("souper-max-lhs-size",
     cl::desc("Max size of LHS (in bytes) to put in external cache (default=1024)"),
     cl::init(1024));
+static cl::opt<unsigned> MemCacheBudget("souper-internal-cache-budget",
+    cl::desc("Memory budget of the internal cache in MB, 0 for no limit "
+             "(default=1024)"),
+    cl::init(1024));
+static cl::opt<unsigned> RangeSamples("souper-range-samples",
+    cl::desc("Number of values of the LHS that range inference collects "
+             "before searching for its bounds, at least 1 (default=4)"),
+    cl::init(4));
 static cl::opt<int> MaxConstantSynthesisTries("souper-max-constant-synthesis-tries",
     cl::desc("Max number of constant synthesis tries. (default=30)"),
     cl::init(30));
@@ -93,42 +124,20 @@ public:
     }
   }
 
-  llvm::APInt getClearedBit(unsigned Pos, unsigned W) {
-    APInt AllOnes = APInt::getAllOnesValue(W);
-    AllOnes.clearBit(Pos);
-    return AllOnes;
-  }
-
-  Inst *traverse(Inst *Node, unsigned BitPos, InstContext &IC,
-                 std::string VarName,
-                 std::map<Inst *, Inst *> &InstCache, bool SetBit) {
+  // Rebuilds Node with every use of Var replaced by Replacement.
+  Inst *replaceVar(Inst *Node, Inst *Var, Inst *Replacement, InstContext &IC,
+                   std::map<Inst *, Inst *> &InstCache) {
+    if (Node == Var)
+      return Replacement;
     if (InstCache.count(Node))
       return InstCache.at(Node);
     std::vector<Inst *> Ops;
-    for (auto const &Op : Node->Ops) {
-      if (SetBit)
-        Ops.push_back(traverse(Op, BitPos, IC, VarName, InstCache, true));
-      else
-        Ops.push_back(traverse(Op, BitPos, IC, VarName, InstCache, false));
-    }
+    for (auto const &Op : Node->Ops)
+      Ops.push_back(replaceVar(Op, Var, Replacement, IC, InstCache));
 
     Inst *Copy = nullptr;
-    if (Node->K == Inst::Var && Node->Name == VarName) {
-      unsigned VarWidth = Node->Width;
-      if (SetBit) {
-        APInt SetBit = APInt::getOneBitSet(VarWidth, BitPos);
-        Inst *SetMask = IC.getInst(Inst::Or, VarWidth,
-                                   {Node, IC.getConst(SetBit)});
-        Copy = SetMask;
-      } else {
-        APInt ClearBit = getClearedBit(BitPos, VarWidth);
-        Inst *ClearMask = IC.getInst(Inst::And, VarWidth,
-                                     {Node, IC.getConst(ClearBit)});
-        Copy = ClearMask;
-      }
-    } else if (Node->K == Inst::Var && Node->Name != VarName) {
-      Copy = Node;
-    } else if (Node->K == Inst::Const || Node->K == Inst::UntypedConst) {
+    if (Node->K == Inst::Var || Node->K == Inst::Const ||
+        Node->K == Inst::UntypedConst) {
       Copy = Node;
     } else if (Node->K == Inst::Phi) {
       Copy = IC.getPhi(Node->B, Ops);
@@ -140,24 +149,95 @@ public:
     return Copy;
   }
 
-  bool testDB(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
-              Inst *LHS, Inst *NewLHS, InstContext &IC) {
-    unsigned W = LHS->Width;
-    Inst *Ne = IC.getInst(Inst::Ne, 1, {LHS, NewLHS});
-    Inst *Ante = IC.getConst(APInt(1, 1));
-    Ante = IC.getInst(Inst::And, 1, {Ante, Ne});
-    APInt TrueGuess(1, 1, false);
-    Inst *True = IC.getConst(TrueGuess);
-    InstMapping Mapping(Ante, True);
+  // Finds the bits of Mask that are demanded bits of Var in LHS and adds
+  // them to Result. A bit is demanded if setting or clearing it changes the
+  // value of LHS in some execution that satisfies the PCs. Rather than
+  // asking about each bit, the query lets the solver pick the bit through a
+  // fresh variable constrained to be a single bit of the group being
+  // tested, so that one query clears a whole group of bits, and the model
+  // of a satisfiable query names a demanded bit. Groups whose model does
+  // not say which bit is demanded are bisected.
+  void findDemandedBits(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        Inst *LHS, Inst *Var, const APInt &Mask,
+                        APInt &Result, InstContext &IC) {
+    unsigned W = Var->Width;
+    Inst *Zero = IC.getConst(APInt::getNullValue(W));
+    Inst *Bit = IC.createVar(W, "demandedbit");
+    // Set the bit if SetBit holds, and clear it otherwise
+    Inst *SetBit = IC.createVar(1, "setbit");
+    Inst *ClearBit = IC.getInst(Inst::Xor, W,
+                                {Bit, IC.getConst(APInt::getAllOnesValue(W))});
+    Inst *NewVar = IC.getInst(Inst::Select, W,
+                              {SetBit, IC.getInst(Inst::Or, W, {Var, Bit}),
+                               IC.getInst(Inst::And, W, {Var, ClearBit})});
+    std::map<Inst *, Inst *> InstCache;
+    Inst *NewLHS = replaceVar(LHS, Var, NewVar, IC, InstCache);
+    Inst *Changed = IC.getInst(Inst::Ne, 1, {LHS, NewLHS});
+    // Bit has exactly one bit set
+    Inst *OneBit = IC.getInst(
+        Inst::And, 1,
+        {IC.getInst(Inst::Ne, 1, {Bit, Zero}),
+         IC.getInst(Inst::Eq, 1,
+                    {IC.getInst(Inst::And, W,
+                                {Bit, IC.getInst(Inst::Sub, W,
+                                                 {Bit, IC.getConst(APInt(W, 1))})}),
+                     Zero})});
+    Inst *True = IC.getConst(APInt(1, 1));
+
+    std::vector<APInt> Worklist{Mask};
+    while (!Worklist.empty()) {
+      APInt Group = Worklist.back();
+      Worklist.pop_back();
+
+      Inst *InGroup = IC.getInst(Inst::Eq, 1,
+                                 {IC.getInst(Inst::And, W,
+                                             {Bit, IC.getConst(~Group)}),
+                                  Zero});
+      Inst *Guess = IC.getInst(Inst::And, 1,
+                               {IC.getInst(Inst::And, 1, {OneBit, InGroup}),
+                                Changed});
+      std::vector<Inst *> ModelInsts;
+      std::vector<llvm::APInt> ModelVals;
+      bool IsSat;
+      ++DemandedBitsQueries;
+      std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs,
+                                      InstMapping(Guess, True), IsSat,
+                                      &ModelInsts, &ModelVals,
+                                      /*Precondition=*/0, Timeout,
+                                      /*Negate=*/true);
+      if (EC)
+        llvm::report_fatal_error("stopping due to error");
+      if (!IsSat)
+        continue;
+      if (Group.countPopulation() == 1) {
+        Result |= Group;
+        continue;
+      }
 
-    bool IsSat;
-    std::string Query = BuildQuery(IC, BPCs, PCs, Mapping, 0,
-                                   /*Precondition=*/0, true);
-    std::error_code EC = SMTSolver->isSatisfiable(Query, IsSat, 0, 0, Timeout);
+      APInt Demanded = APInt::getNullValue(W);
+      for (unsigned I = 0; I != ModelInsts.size(); ++I)
+        if (ModelInsts[I] == Bit && I < ModelVals.size())
+          Demanded = ModelVals[I];
+      if (Demanded.isPowerOf2() && (Demanded & ~Group).isNullValue()) {
+        Result |= Demanded;
+        Group &= ~Demanded;
+        if (!Group.isNullValue())
+          Worklist.push_back(Group);
+        continue;
+      }
 
-    if (EC)
-      llvm::report_fatal_error("stopping due to error");
-    return !IsSat;
+      APInt Low = APInt::getNullValue(W);
+      unsigned Half = Group.countPopulation() / 2;
+      for (unsigned I = 0; Half; ++I) {
+        if (Group[I]) {
+          Low.setBit(I);
+          --Half;
+        }
+      }
+      Worklist.push_back(Group & ~Low);
+      Worklist.push_back(Low);
+    }
   }
 
   std::error_code testDemandedBits(const BlockPCs &BPCs,
@@ -171,9 +251,6 @@ public:
       LHS = IC.getInst(Inst::And, W, {LHS, IC.getConst(LHS->DemandedBits)});
     }
 
-    std::map<Inst *, Inst *> InstCache;
-    std::map<Block *, Block *> BlockCache;
-
     std::map<std::string, unsigned> VarsVect;
     std::set<Inst *> Visited;
     findVarsAndWidth(LHS, VarsVect, Visited);
@@ -185,25 +262,33 @@ public:
       findMoreVarsViaPC(PC.RHS, VarsVect, Visited);
     }
 
-    for (std::map<std::string,unsigned>::iterator it = VarsVect.begin();
-         it != VarsVect.end(); ++it) {
-       std::string VarName = it->first;
-       unsigned VarWidth = VarsVect[VarName];
-       APInt ResultDB = APInt::getNullValue(VarWidth);
-
-      for (unsigned Bit=0; Bit<VarWidth; Bit++) {
-        std::map<Inst *, Inst *> InstCache;
-        Inst *SetLHS = traverse(LHS, Bit, IC, VarName, InstCache, true);
-        InstCache.clear();
-        Inst *ClearLHS = traverse(LHS, Bit, IC, VarName, InstCache, false);
-        if (testDB(BPCs, PCs, LHS, SetLHS, IC) &&
-            testDB(BPCs, PCs, LHS, ClearLHS, IC)) {
-          ResultDB = ResultDB;
-        } else {
-          ResultDB |= APInt::getOneBitSet(VarWidth, Bit);
-        }
+    // Variables that only appear in the PCs demand no bits; of the others,
+    // skip the bits that the abstract analyses already decide. A bit the
+    // LHS alone must demand may be masked out by a path condition, so the
+    // must-demanded seed is only used without any.
+    for (auto const &V : VarsVect)
+      ResDBVect[V.first] = APInt::getNullValue(V.second);
+
+    std::vector<Inst *> Vars;
+    findVars(LHS, Vars);
+    InputVarInfo MustDemanded;
+    if (PCs.empty() && BPCs.empty())
+      MustDemanded = MustDemandedBitsAnalysis().findMustDemandedBits(LHS);
+    auto DontCare = DontCareBitsAnalysis().findDontCareBits(LHS);
+    for (auto Var : Vars) {
+      APInt ResultDB = APInt::getNullValue(Var->Width);
+      APInt Unknown = APInt::getAllOnesValue(Var->Width);
+      auto MD = MustDemanded.find(Var);
+      if (MD != MustDemanded.end()) {
+        ResultDB |= MD->second;
+        Unknown &= ~MD->second;
       }
-      ResDBVect[VarName] = ResultDB;
+      auto DC = DontCare.find(Var);
+      if (DC != DontCare.end())
+        Unknown &= ~DC->second;
+      if (!Unknown.isNullValue())
+        findDemandedBits(BPCs, PCs, LHS, Var, Unknown, ResultDB, IC);
+      ResDBVect[Var->Name] = ResultDB;
     }
     return std::error_code();
   }
@@ -215,9 +300,8 @@ public:
     Inst *Mask = IC.getConst(APInt::getOneBitSet(W, W-1));
     InstMapping Mapping(IC.getInst(Inst::And, W, { LHS, Mask }), IC.getConst(APInt::getNullValue(W)));
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
-                                                  Mapping, 0, /*Precondition=*/0),
-                                                  IsSat, 0, 0, Timeout);
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    IsSat, 0, 0, /*Precondition=*/0, Timeout);
     if (EC) {
       llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing zero MSB");
       return false;
@@ -232,9 +316,8 @@ public:
     Inst *Mask = IC.getConst(APInt::getOneBitSet(W, W-1));
     InstMapping Mapping(IC.getInst(Inst::And, W, { LHS, Mask }), Mask);
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
-                                                  Mapping, 0, /*Precondition=*/0),
-                                                  IsSat, 0, 0, Timeout);
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    IsSat, 0, 0, /*Precondition=*/0, Timeout);
     if (EC) {
       llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing one MSB");
       return false;
@@ -266,19 +349,50 @@ public:
                           const std::vector<InstMapping> &PCs,
                           Inst *LHS, KnownBits &Known,
                           InstContext &IC) override {
-    unsigned W = LHS->Width;
-    Known.One = APInt::getNullValue(W);
-    Known.Zero = APInt::getNullValue(W);
-    for (unsigned I=0; I<W; I++) {
-      APInt ZeroGuess = Known.Zero | APInt::getOneBitSet(W, I);
-      if (testKnown(BPCs, PCs, ZeroGuess, Known.One, LHS, IC)) {
-        Known.Zero = ZeroGuess;
-        continue;
+    // Bits that the abstract interpreter proves need no solver call.
+    ConcreteInterpreter BlankCI;
+    Known = KnownBitsAnalysis().findKnownBits(LHS, BlankCI,
+                                              /*UsePartialEval=*/false);
+    APInt Mask = ~(Known.Zero | Known.One);
+    if (Mask.isNullValue())
+      return std::error_code();
+
+    // Every model of a satisfiable query exhibits a value that LHS can take,
+    // and a bit on which two such values differ can't be known. So rather
+    // than asking about one bit at a time, take one value of LHS, ask for
+    // another that differs from it on a still unresolved bit, drop the bits
+    // they differ on, and stop once no such value exists: the remaining bits
+    // are then confirmed all at once.
+    std::vector<InstMapping> ValPCs;
+    Inst *Val = createValueVar(PCs, LHS, "knownbits", ValPCs, IC);
+
+    bool Found;
+    Optional<APInt> Value;
+    ++KnownBitsQueries;
+    findValue(BPCs, ValPCs, IC.getInst(Inst::Eq, 1, {LHS, Val}), Val, Found,
+              Value, IC);
+    if (!Found) {
+      // the path conditions never hold, so every bit is known to be zero,
+      // as it would be if they were tested one at a time
+      Known.Zero |= Mask;
+      return std::error_code();
+    }
+    while (Value && !Mask.isNullValue()) {
+      APInt Other;
+      if (!testOtherValue(BPCs, ValPCs, LHS, Val, Mask, *Value, Other, Found,
+                          IC))
+        break;
+      if (!Found) {
+        Known.One |= *Value & Mask;
+        Known.Zero |= ~*Value & Mask;
+        return std::error_code();
       }
-      APInt OneGuess = Known.One | APInt::getOneBitSet(W, I);
-      if (testKnown(BPCs, PCs, Known.Zero, OneGuess, LHS, IC))
-        Known.One = OneGuess;
+      // the query only has a model where the two differ on Mask
+      Mask &= ~(Other ^ *Value);
     }
+    // no usable model, resolve the remaining bits one at a time
+    if (!Mask.isNullValue())
+      testKnownBits(BPCs, PCs, LHS, Mask, Known, IC);
     return std::error_code();
   }
 
@@ -297,9 +411,8 @@ public:
                                     IC.getInst(Inst::Eq, 1, {PowerMask, Zero})});
     InstMapping Mapping(PowerTwoInst, True);
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
-                                                  Mapping, 0, /*Precondition=*/0),
-                                                  IsSat, 0, 0, Timeout);
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    IsSat, 0, 0, /*Precondition=*/0, Timeout);
     if (EC)
       llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing powerTwo");
 
@@ -320,9 +433,8 @@ public:
     Inst *NonZeroGuess = IC.getInst(Inst::Ne, 1, {LHS, Zero});
     InstMapping Mapping(NonZeroGuess, True);
     bool IsSat;
-    std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
-                                                  Mapping, 0, /*Precondition=*/0),
-                                                  IsSat, 0, 0, Timeout);
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    IsSat, 0, 0, /*Precondition=*/0, Timeout);
     if (EC)
       llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing nonZero");
 
@@ -333,34 +445,56 @@ public:
     return std::error_code();
   }
 
+  // Tests whether LHS always has at least I sign bits.
+  bool testSignBits(const BlockPCs &BPCs,
+                    const std::vector<InstMapping> &PCs,
+                    Inst *LHS, unsigned I, InstContext &IC) {
+    unsigned W = LHS->Width;
+    Inst *True = IC.getConst(APInt(1, 1, false));
+    Inst *ShiftAmt = IC.getConst(APInt(W, W-I, false));
+    Inst *Res = IC.getInst(Inst::AShr, W, {LHS, ShiftAmt});
+    Inst *Guess1 = IC.getInst(Inst::Eq, 1, {Res, IC.getConst(APInt(W, 0, false))});
+    Inst *Guess2 = IC.getInst(Inst::Eq, 1, {Res, IC.getConst(APInt::getAllOnesValue(W))});
+    Inst *Guess = IC.getInst(Inst::Or, 1, {Guess1, Guess2});
+    InstMapping Mapping(Guess, True);
+    bool IsSat;
+    ++SignBitsQueries;
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    IsSat, 0, 0, /*Precondition=*/0, Timeout);
+    if (EC)
+      llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing sign bits");
+    return !IsSat;
+  }
+
   std::error_code signBits(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, unsigned &SignBits,
                            InstContext &IC) override {
     unsigned W = LHS->Width;
-    SignBits = 1;
-    Inst *True = IC.getConst(APInt(1, 1, false));
 
-    for (unsigned I=2; I<=W; I++) {
-      Inst *ShiftAmt = IC.getConst(APInt(W, W-I, false));
-      Inst *Res = IC.getInst(Inst::AShr, W, {LHS, ShiftAmt});
-      Inst *Guess1 = IC.getInst(Inst::Eq, 1, {Res, IC.getConst(APInt(W, 0, false))});
-      Inst *Guess2 = IC.getInst(Inst::Eq, 1, {Res, IC.getConst(APInt::getAllOnesValue(W))});
-      Inst *Guess = IC.getInst(Inst::Or, 1, {Guess1, Guess2});
-      InstMapping Mapping(Guess, True);
-      bool IsSat;
-      std::error_code EC = SMTSolver->isSatisfiable(BuildQuery(IC, BPCs, PCs,
-                                                    Mapping, 0, /*Precondition=*/0),
-                                                    IsSat, 0, 0, Timeout);
-      if (EC)
-        llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing sign bits");
-
-      if (!IsSat) {
-        SignBits = I;
-      } else {
-        break;
-      }
+    // Start from the number of sign bits the abstract interpreters prove.
+    ConcreteInterpreter BlankCI;
+    KnownBits KB = KnownBitsAnalysis().findKnownBits(LHS, BlankCI,
+                                                     /*UsePartialEval=*/false);
+    llvm::ConstantRange CR = ConstantRangeAnalysis().findConstantRange(
+        LHS, BlankCI, /*UsePartialEval=*/false);
+    unsigned Lo = std::max(1u, KB.countMinSignBits());
+    if (!CR.isEmptySet())
+      Lo = std::max(Lo, std::min(CR.getSignedMin().getNumSignBits(),
+                                 CR.getSignedMax().getNumSignBits()));
+    Lo = std::min(Lo, W);
+
+    // Having I sign bits implies having I-1 of them, so the largest number
+    // the solver proves can be found by bisection.
+    unsigned Hi = W;
+    while (Lo < Hi) {
+      unsigned I = Lo + (Hi - Lo + 1) / 2;
+      if (testSignBits(BPCs, PCs, LHS, I, IC))
+        Lo = I;
+      else
+        Hi = I - 1;
     }
+    SignBits = Lo;
     return std::error_code();
   }
 
@@ -380,8 +514,8 @@ public:
           Ante = IC.getInst(Inst::And, 1, {Ante, Eq});
         }
 
-        AliveDriver Synthesizer(LHS, Ante, IC);
-        auto ConstantMap = Synthesizer.synthesizeConstantsWithCegis(C, IC);
+        auto Synthesizer = getAliveSession(LHS, Ante, IC);
+        auto ConstantMap = Synthesizer->synthesizeConstantsWithCegis(C, IC);
         if (ConstantMap.find(C) != ConstantMap.end()) {
           RHSs.emplace_back(IC.getConst(ConstantMap[C]));
           return std::error_code();
@@ -431,16 +565,13 @@ public:
       IsValid = isTransformationValid(Mapping.LHS, Mapping.RHS, PCs, BPCs, IC);
       return std::error_code();
     }
-    std::string Query;
     if (Model) {
       std::vector<Inst *> ModelInsts;
-      std::string Query = BuildQuery(IC, BPCs, PCs, Mapping, &ModelInsts, /*Precondition=*/0);
-      if (Query.empty())
-        return std::make_error_code(std::errc::value_too_large);
       bool IsSat;
       std::vector<llvm::APInt> ModelVals;
-      std::error_code EC = SMTSolver->isSatisfiable(
-          Query, IsSat, ModelInsts.size(), &ModelVals, Timeout);
+      std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                      IsSat, &ModelInsts, &ModelVals,
+                                      /*Precondition=*/0, Timeout);
       if (!EC) {
         if (IsSat) {
           for (unsigned I = 0; I != ModelInsts.size(); ++I) {
@@ -451,11 +582,9 @@ public:
       }
       return EC;
     } else {
-      std::string Query = BuildQuery(IC, BPCs, PCs, Mapping, 0, /*Precondition=*/0);
-      if (Query.empty())
-        return std::make_error_code(std::errc::value_too_large);
       bool IsSat;
-      std::error_code EC = SMTSolver->isSatisfiable(Query, IsSat, 0, 0, Timeout);
+      std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                      IsSat, 0, 0, /*Precondition=*/0, Timeout);
       IsValid = !IsSat;
       return EC;
     }
@@ -475,7 +604,8 @@ public:
     findVars(LHS, Inputs);
     PruningManager Pruner(SC, Inputs, DebugLevel);
     Pruner.init();
-    ConstantSynthesis CS{&Pruner};
+    CounterexampleStore Counterexamples(LHS, BPCs, PCs);
+    ConstantSynthesis CS{&Pruner, &Counterexamples};
     std::error_code EC = CS.synthesize(SMTSolver.get(), BPCs, PCs, InstMapping(LHS, RHS),
                                        ConstSet, ResultMap, IC, MaxConstantSynthesisTries,
                                        Timeout, /*AvoidNops=*/false);
@@ -489,6 +619,71 @@ public:
     return EC;
   }
 
+  // Solver models only report the values of variables. To read the value
+  // of LHS off a model, this creates a fresh variable and sets ValPCs to PCs
+  // plus the condition that the variable equals LHS. Queries under ValPCs
+  // then report the value of LHS as that of the returned variable.
+  Inst *createValueVar(const std::vector<InstMapping> &PCs, Inst *LHS,
+                       StringRef Name, std::vector<InstMapping> &ValPCs,
+                       InstContext &IC) {
+    Inst *Val = IC.createVar(LHS->Width, Name);
+    ValPCs = PCs;
+    ValPCs.emplace_back(LHS, Val);
+    return Val;
+  }
+
+  // Looks for an execution in which LHS differs from Value on some bit of
+  // Mask. Val must be a variable from createValueVar() for LHS and the PCs;
+  // if an execution is found, its value of LHS is returned in Other. Returns
+  // false if the solver did not report the value of Val.
+  bool testOtherValue(const BlockPCs &BPCs,
+                      const std::vector<InstMapping> &PCs,
+                      Inst *LHS, Inst *Val, const APInt &Mask,
+                      const APInt &Value, APInt &Other, bool &Found,
+                      InstContext &IC) {
+    unsigned W = LHS->Width;
+    InstMapping Mapping(IC.getInst(Inst::And, W, {IC.getConst(Mask), LHS}),
+                        IC.getConst(Value & Mask));
+    std::vector<Inst *> ModelInsts;
+    std::vector<llvm::APInt> ModelVals;
+    ++KnownBitsQueries;
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    Found, &ModelInsts, &ModelVals,
+                                    /*Precondition=*/0, Timeout);
+    if (EC)
+      llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing known bits");
+    if (!Found)
+      return true;
+    for (unsigned I = 0; I != ModelInsts.size(); ++I) {
+      if (ModelInsts[I] == Val && I < ModelVals.size()) {
+        Other = ModelVals[I];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Resolves the bits of Mask one at a time, on top of what Known already
+  // holds.
+  void testKnownBits(const BlockPCs &BPCs,
+                     const std::vector<InstMapping> &PCs,
+                     Inst *LHS, const APInt &Mask, KnownBits &Known,
+                     InstContext &IC) {
+    unsigned W = LHS->Width;
+    for (unsigned I=0; I<W; I++) {
+      if (!Mask[I])
+        continue;
+      APInt ZeroGuess = Known.Zero | APInt::getOneBitSet(W, I);
+      if (testKnown(BPCs, PCs, ZeroGuess, Known.One, LHS, IC)) {
+        Known.Zero = ZeroGuess;
+        continue;
+      }
+      APInt OneGuess = Known.One | APInt::getOneBitSet(W, I);
+      if (testKnown(BPCs, PCs, Known.Zero, OneGuess, LHS, IC))
+        Known.One = OneGuess;
+    }
+  }
+
   bool testKnown(const BlockPCs &BPCs,
                  const std::vector<InstMapping> &PCs,
                  APInt &Zeros, APInt &Ones, Inst *LHS,
@@ -497,8 +692,9 @@ public:
                                    { IC.getConst(Zeros | Ones), LHS }),
                         IC.getConst(Ones));
     bool IsSat;
-    auto Q = BuildQuery(IC, BPCs, PCs, Mapping, 0, /*Precondition=*/0);
-    std::error_code EC = SMTSolver->isSatisfiable(Q, IsSat, 0, 0, Timeout);
+    ++KnownBitsQueries;
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs, Mapping,
+                                    IsSat, 0, 0, /*Precondition=*/0, Timeout);
     if (EC) {
       llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing known bits");
       return false;
@@ -506,6 +702,78 @@ public:
     return !IsSat;
   }
 
+  // Looks for an execution in which Cond holds. Val must be a variable from
+  // createValueVar() for the LHS that Cond is about and the PCs; if an
+  // execution is found and the model reports Val, its value is returned in
+  // Value.
+  void findValue(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+                 Inst *Cond, Inst *Val, bool &Found, Optional<APInt> &Value,
+                 InstContext &IC) {
+    std::vector<Inst *> ModelInsts;
+    std::vector<llvm::APInt> ModelVals;
+    std::error_code EC = SolveQuery(SMTSolver.get(), IC, BPCs, PCs,
+                                    InstMapping(Cond, IC.getConst(APInt(1, 0))),
+                                    Found, &ModelInsts, &ModelVals,
+                                    /*Precondition=*/0, Timeout);
+    if (EC)
+      llvm::report_fatal_error("Error: SMTSolver->isSatisfiable() failed in testing range");
+    Value = None;
+    if (!Found)
+      return;
+    for (unsigned I = 0; I != ModelInsts.size(); ++I)
+      if (ModelInsts[I] == Val && I < ModelVals.size())
+        Value = ModelVals[I];
+  }
+
+  // Finds the least (or, if Max is set, the greatest) value of LHS in the
+  // unsigned or signed order, given that it lies between Lo and Hi. A
+  // satisfiable probe moves the bound to the value in its model, which is
+  // usually well past the middle of the window.
+  APInt findExtreme(const BlockPCs &BPCs, const std::vector<InstMapping> &PCs,
+                    Inst *LHS, Inst *Val, bool Signed, bool Max, APInt Lo,
+                    APInt Hi, InstContext &IC) {
+    unsigned W = LHS->Width;
+    // Flipping the sign bit maps the signed order onto the unsigned one, so
+    // the search itself is always unsigned.
+    APInt Bias = Signed ? APInt::getSignMask(W) : APInt::getNullValue(W);
+    Lo ^= Bias;
+    Hi ^= Bias;
+    // the sample bound is an actual value of LHS, so trust it over the other
+    if (Hi.ult(Lo)) {
+      if (Max)
+        Hi = APInt::getMaxValue(W);
+      else
+        Lo = APInt::getMinValue(W);
+    }
+    Inst::Kind Le = Signed ? Inst::Sle : Inst::Ule;
+    while (Lo.ult(Hi)) {
+      APInt M = Lo + (Hi - Lo).lshr(1);
+      if (Max)
+        M += 1;
+      Inst *C = IC.getConst(M ^ Bias);
+      Inst *Cond = Max ? IC.getInst(Le, 1, {C, LHS})
+                       : IC.getInst(Le, 1, {LHS, C});
+      bool Found;
+      Optional<APInt> Value;
+      ++RangeQueries;
+      findValue(BPCs, PCs, Cond, Val, Found, Value, IC);
+      if (Max) {
+        if (Found)
+          Lo = Value ? (*Value ^ Bias) : M;
+        else
+          Hi = M - 1;
+      } else {
+        if (Found)
+          Hi = Value ? (*Value ^ Bias) : M;
+        else
+          Lo = M + 1;
+      }
+    }
+    return Lo ^ Bias;
+  }
+
+  // Looks for a range [X, X+C) that holds every value of LHS, allowing it
+  // to wrap around. If there is one, X is returned in ResultX.
   void testRange(const BlockPCs &BPCs,
                  const std::vector<InstMapping> &PCs,
                  Inst *LHS, llvm::APInt &C,
@@ -538,11 +806,11 @@ public:
     std::set<Inst *> ConstSet{ReservedX};
     std::map <Inst *, llvm::APInt> ResultMap;
     ConstantSynthesis CS;
-    // Before switching to ConcreteInterpreter for LHS simplification, the query is Guess(ReservedX, LHS) == 1
-    // Note there is a reservedconst (ReservedX) in left side of the query. After the switch, the left side
-    // of the query needs to be reservedconst free, and we still need LHS to stay on the left side of
-    // the query to take care of UB, therefore, the new query is or(trunc(LHS), 1) = Guess(ReservedX, LHS)
-    LHS = IC.getInst(Inst::Or, 1, {IC.getInst(Inst::Trunc, 1, {LHS}), IC.getConst(llvm::APInt(1, true))}),
+    // The left side of the query must be free of reservedconsts and still
+    // hold LHS to take care of UB, so the query is
+    // or(trunc(LHS), 1) = Guess(ReservedX, LHS).
+    LHS = IC.getInst(Inst::Or, 1, {IC.getInst(Inst::Trunc, 1, {LHS}), IC.getConst(llvm::APInt(1, true))});
+    ++RangeQueries;
     CS.synthesize(SMTSolver.get(), BPCs, PCs, InstMapping(LHS, Guess),
                   ConstSet, ResultMap, IC, MaxConstantSynthesisTries, Timeout,
                   /*AvoidNops=*/false);
@@ -554,40 +822,140 @@ public:
     }
   }
 
-  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
-                                    const std::vector<InstMapping> &PCs,
-                                    Inst *LHS,
-                                    InstContext &IC) override {
-    unsigned W = LHS->Width;
-
-    APInt L = APInt(W, 1), R = APInt::getAllOnesValue(W);
-    APInt BinSearchResultX, BinSearchResultC;
-    bool BinSearchHasResult = false;
-
+  // Finds the tightest range at any rotation by a binary search over its
+  // size, which lies between L and R. Each probe is a constant synthesis
+  // of the start of the range, so this is only worth it when the hulls
+  // are known to be loose.
+  Optional<llvm::ConstantRange> findTightestRange(
+      const BlockPCs &BPCs, const std::vector<InstMapping> &PCs, Inst *LHS,
+      APInt L, APInt R, InstContext &IC) {
+    Optional<llvm::ConstantRange> Result;
     while (L.ule(R)) {
       APInt M = L + ((R - L)).lshr(1);
-      APInt BinSearchX;
+      APInt X;
       bool Found = false;
-      testRange(BPCs, PCs, LHS, M, BinSearchX, Found, IC);
+      testRange(BPCs, PCs, LHS, M, X, Found, IC);
       if (Found) {
+        Result = llvm::ConstantRange(X, X + M);
+        if (M == L)
+          break;
         R = M - 1;
-
-        // record result
-        BinSearchResultX = BinSearchX;
-        BinSearchResultC = M;
-        BinSearchHasResult = true;
       } else {
         if (L == R)
           break;
         L = M + 1;
       }
     }
+    return Result;
+  }
 
-    if (BinSearchHasResult) {
-      return llvm::ConstantRange(BinSearchResultX, BinSearchResultX + BinSearchResultC);
-    } else {
-      return llvm::ConstantRange (W, true);
+  // The smallest range that contains all of Values.
+  static llvm::ConstantRange getCoveringRange(std::vector<APInt> Values) {
+    std::sort(Values.begin(), Values.end(),
+              [](const APInt &A, const APInt &B) { return A.ult(B); });
+    // the range starts right after the largest gap between two neighbouring
+    // values, counting the one that wraps around
+    unsigned Start = 0;
+    APInt Gap = Values.front() - Values.back();
+    for (unsigned I = 1; I < Values.size(); ++I) {
+      APInt G = Values[I] - Values[I - 1];
+      if (G.ugt(Gap)) {
+        Gap = G;
+        Start = I;
+      }
+    }
+    unsigned End = Start ? Start - 1 : Values.size() - 1;
+    return llvm::ConstantRange::getNonEmpty(Values[Start], Values[End] + 1);
+  }
+
+  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    Inst *LHS,
+                                    InstContext &IC) override {
+    unsigned W = LHS->Width;
+    ++RangesInferred;
+
+    ConcreteInterpreter BlankCI;
+    llvm::ConstantRange Seed = ConstantRangeAnalysis().findConstantRange(
+        LHS, BlankCI, /*UsePartialEval=*/false);
+    if (Seed.isSingleElement())
+      return Seed;
+
+    std::vector<InstMapping> ValPCs;
+    Inst *Val = createValueVar(PCs, LHS, "range", ValPCs, IC);
+
+    // Collect a few distinct values of LHS. If there are no more than that,
+    // the best range is known without further queries; otherwise they
+    // narrow down where the extremes can be.
+    std::vector<APInt> Samples;
+    unsigned NumSamples = std::max(1u, (unsigned)RangeSamples);
+    while (Samples.size() < NumSamples) {
+      // the query must not be about a bare constant, whose demanded bits
+      // are not set, so start from a condition that the PCs make true
+      Inst *Cond = IC.getInst(Inst::Eq, 1, {LHS, Val});
+      for (auto &S : Samples)
+        Cond = IC.getInst(Inst::And, 1,
+                          {Cond, IC.getInst(Inst::Ne, 1, {LHS, IC.getConst(S)})});
+      bool Found;
+      Optional<APInt> Value;
+      ++RangeQueries;
+      findValue(BPCs, ValPCs, Cond, Val, Found, Value, IC);
+      if (!Found)
+        return Samples.empty() ? Seed : getCoveringRange(Samples);
+      if (!Value)
+        break;
+      Samples.push_back(*Value);
+    }
+    if (Samples.empty())
+      return Seed;
+
+    APInt UMinSample = Samples.front(), UMaxSample = Samples.front();
+    APInt SMinSample = Samples.front(), SMaxSample = Samples.front();
+    for (auto &S : Samples) {
+      UMinSample = APIntOps::umin(UMinSample, S);
+      UMaxSample = APIntOps::umax(UMaxSample, S);
+      SMinSample = APIntOps::smin(SMinSample, S);
+      SMaxSample = APIntOps::smax(SMaxSample, S);
+    }
+
+    APInt UMin = findExtreme(BPCs, ValPCs, LHS, Val, /*Signed=*/false,
+                             /*Max=*/false, Seed.getUnsignedMin(), UMinSample,
+                             IC);
+    APInt UMax = findExtreme(BPCs, ValPCs, LHS, Val, /*Signed=*/false,
+                             /*Max=*/true, UMaxSample, Seed.getUnsignedMax(),
+                             IC);
+    llvm::ConstantRange Result =
+        llvm::ConstantRange::getNonEmpty(UMin, UMax + 1);
+
+    // A range that wraps around through the sign boundary can only be
+    // smaller if the unsigned one crosses it.
+    if (!UMin.isNegative() && UMax.isNegative()) {
+      APInt SMin = findExtreme(BPCs, ValPCs, LHS, Val, /*Signed=*/true,
+                               /*Max=*/false, Seed.getSignedMin(), SMinSample,
+                               IC);
+      APInt SMax = findExtreme(BPCs, ValPCs, LHS, Val, /*Signed=*/true,
+                               /*Max=*/true, SMaxSample, Seed.getSignedMax(),
+                               IC);
+      llvm::ConstantRange Signed =
+          llvm::ConstantRange::getNonEmpty(SMin, SMax + 1);
+      if (Signed.isSizeStrictlySmallerThan(Result))
+        Result = Signed;
     }
+
+    // Both hulls can be much looser than a range that wraps around
+    // elsewhere. When the largest gap between the samples lies inside the
+    // result, a range that leaves out that gap may be tighter, so go back to
+    // searching every rotation for one that holds all the values.
+    llvm::ConstantRange SampleRange = getCoveringRange(Samples);
+    if (SampleRange.isSizeStrictlySmallerThan(Result) &&
+        Result.contains(SampleRange.inverse())) {
+      APInt L = getSetSize(SampleRange).trunc(W);
+      APInt R = Result.isFullSet() ? APInt::getAllOnesValue(W)
+                                   : getSetSize(Result).trunc(W) - 1;
+      if (auto Tightest = findTightestRange(BPCs, PCs, LHS, L, R, IC))
+        Result = *Tightest;
+    }
+    return Result;
   }
 
   std::string getName() override {
@@ -595,47 +963,131 @@ public:
   }
 };
 
+// Everything the internal cache remembers about one query. Only the fields
+// that belong to the kind of query in the key are meaningful.
+struct CachedResult {
+  std::error_code EC;
+  // isValid() and the boolean dataflow facts
+  bool Flag = false;
+  // signBits()
+  unsigned Number = 0;
+  // infer(): the printed RHS, empty if there is none
+  std::string RHS;
+  KnownBits Known;
+  llvm::ConstantRange Range = llvm::ConstantRange(1, true);
+  std::map<std::string, APInt> DemandedBits;
+  // the structural words of the query, compared on every hit
+  std::vector<uint64_t> Words;
+
+  size_t size() const {
+    size_t Size = RHS.size() + Words.size() * sizeof(uint64_t);
+    for (auto &DB : DemandedBits)
+      Size += DB.first.size() + 64;
+    return Size;
+  }
+};
+
+// All queries share one bounded cache, keyed by the kind of query followed
+// by the structural hash of the replacement. Threads using the solver share
+// its hits.
 class MemCachingSolver : public Solver {
   std::unique_ptr<Solver> UnderlyingSolver;
-  std::unordered_map<std::string, std::pair<std::error_code, bool>> IsValidCache;
-  std::unordered_map<std::string, std::pair<std::error_code, std::string>>
-    InferCache;
+  ShardedLRUCache<CachedResult> Cache;
+
+  static std::string getKey(StringRef Kind, const StructuralHash &H) {
+    return (Kind + "\n" + H.bytes()).str();
+  }
+
+  static std::string getLHSKey(StringRef Kind, const BlockPCs &BPCs,
+                               const std::vector<InstMapping> &PCs, Inst *LHS,
+                               std::vector<uint64_t> &Words,
+                               bool HashNames = false) {
+    return getKey(Kind, GetReplacementLHSHash(BPCs, PCs, LHS, HashNames,
+                                              &Words));
+  }
+
+  // A hit only counts if the query it was stored for has the same
+  // structural words, so that a hash collision can't return the answer to
+  // another query.
+  bool lookup(const std::string &Key, CachedResult &R,
+              const std::vector<uint64_t> &Words, bool Dataflow) {
+    bool Hit = Cache.lookup(Key, R);
+    if (Hit && R.Words != Words) {
+      ++MemKeyCollisions;
+      Hit = false;
+    }
+    if (Dataflow) {
+      if (Hit)
+        ++MemHitsDataflow;
+      else
+        ++MemMissesDataflow;
+    }
+    return Hit;
+  }
+
+  void insert(const std::string &Key, CachedResult &R,
+              std::vector<uint64_t> &&Words) {
+    R.Words = std::move(Words);
+    MemEvictions += Cache.insert(Key, R, R.size());
+    MemBytes = Cache.bytes();
+  }
+
+  // Answer a query that produces a single boolean fact, through the cache.
+  template <typename QueryT>
+  std::error_code cachedFlag(StringRef Kind, const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs, Inst *LHS,
+                             bool &Flag, QueryT Query) {
+    std::vector<uint64_t> Words;
+    std::string Key = getLHSKey(Kind, BPCs, PCs, LHS, Words);
+    CachedResult R;
+    if (!lookup(Key, R, Words, /*Dataflow=*/true)) {
+      R.EC = Query(R.Flag);
+      insert(Key, R, std::move(Words));
+    }
+    Flag = R.Flag;
+    return R.EC;
+  }
 
 public:
   MemCachingSolver(std::unique_ptr<Solver> UnderlyingSolver)
-      : UnderlyingSolver(std::move(UnderlyingSolver)) {}
+      : UnderlyingSolver(std::move(UnderlyingSolver)),
+        Cache(size_t(MemCacheBudget) << 20) {}
 
   std::error_code infer(const BlockPCs &BPCs,
                         const std::vector<InstMapping> &PCs,
                         Inst *LHS, std::vector<Inst *> &RHSs,
                         bool AllowMultipleRHSs, InstContext &IC) override {
+    std::vector<uint64_t> Words;
+    std::string Key = getLHSKey("infer", BPCs, PCs, LHS, Words);
+    CachedResult R;
+    // the RHS is printed, and parsed back, in terms of the printed LHS
     ReplacementContext Context;
-    std::string Repl = GetReplacementLHSString(BPCs, PCs, LHS, Context);
-    const auto &ent = InferCache.find(Repl);
-    if (ent == InferCache.end()) {
+    if (!lookup(Key, R, Words, /*Dataflow=*/false)) {
       ++MemMissesInfer;
-      std::error_code EC = UnderlyingSolver->infer(BPCs, PCs, LHS, RHSs,
-                                                   AllowMultipleRHSs, IC);
-      std::string RHSStr;
-      if (!EC && !RHSs.empty()) {
+      R.EC = UnderlyingSolver->infer(BPCs, PCs, LHS, RHSs,
+                                     AllowMultipleRHSs, IC);
+      if (!R.EC && !RHSs.empty()) {
         // TODO: support multi RHSs caching
-        RHSStr = GetReplacementRHSString(RHSs.front(), Context);
+        GetReplacementLHSString(BPCs, PCs, LHS, Context);
+        R.RHS = GetReplacementRHSString(RHSs.front(), Context);
       }
-      InferCache.emplace(Repl, std::make_pair(EC, RHSStr));
-      return EC;
+      insert(Key, R, std::move(Words));
+      return R.EC;
     } else {
       ++MemHitsInfer;
       std::string ES;
-      StringRef S = ent->second.second;
+      StringRef S = R.RHS;
       if (S == "") {
         RHSs.clear();
       } else {
-        ParsedReplacement R = ParseReplacementRHS(IC, "<cache>", S, Context, ES);
+        GetReplacementLHSString(BPCs, PCs, LHS, Context);
+        ParsedReplacement PR = ParseReplacementRHS(IC, "<cache>", S, Context,
+                                                   ES);
         if (ES != "")
           return std::make_error_code(std::errc::protocol_error);
-        RHSs.emplace_back(R.Mapping.RHS);
+        RHSs.emplace_back(PR.Mapping.RHS);
       }
-      return ent->second.first;
+      return R.EC;
     }
   }
   std::error_code inferConst(const BlockPCs &BPCs,
@@ -651,7 +1103,14 @@ public:
                                     const std::vector<InstMapping> &PCs,
                                     Inst *LHS,
                                     InstContext &IC) override {
-    return UnderlyingSolver->constantRange(BPCs, PCs, LHS, IC);
+    std::vector<uint64_t> Words;
+    std::string Key = getLHSKey("range", BPCs, PCs, LHS, Words);
+    CachedResult R;
+    if (!lookup(Key, R, Words, /*Dataflow=*/true)) {
+      R.Range = UnderlyingSolver->constantRange(BPCs, PCs, LHS, IC);
+      insert(Key, R, std::move(Words));
+    }
+    return R.Range;
   }
 
   std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
@@ -663,19 +1122,23 @@ public:
     if (Model)
       return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
 
-    std::string Repl = GetReplacementString(BPCs, PCs, Mapping);
-    const auto &ent = IsValidCache.find(Repl);
-    if (ent == IsValidCache.end()) {
+    std::vector<uint64_t> Words;
+    std::string Key = getKey("valid",
+                             GetReplacementHash(BPCs, PCs, Mapping, &Words));
+    CachedResult R;
+    if (!lookup(Key, R, Words, /*Dataflow=*/false)) {
       ++MemMissesIsValid;
-      std::error_code EC = UnderlyingSolver->isValid(IC, BPCs, PCs,
-                                                     Mapping, IsValid, 0);
-      IsValidCache.emplace(Repl, std::make_pair(EC, IsValid));
-      return EC;
+      R.EC = UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, R.Flag, 0);
+      insert(Key, R, std::move(Words));
     } else {
       ++MemHitsIsValid;
-      IsValid = ent->second.second;
-      return ent->second.first;
     }
+    IsValid = R.Flag;
+    return R.EC;
+  }
+
+  void prefetch(const std::vector<CandidateReplacement> &Cands) override {
+    UnderlyingSolver->prefetch(Cands);
   }
 
   std::string getName() override {
@@ -687,49 +1150,85 @@ public:
                                    Inst *LHS,
                                    std::map<std::string,APInt> &DBitsVect,
                                    InstContext &IC) override {
-    return UnderlyingSolver->testDemandedBits(BPCs, PCs, LHS, DBitsVect, IC);
+    // the answer is keyed by variable name, so the names are part of the key
+    std::vector<uint64_t> Words;
+    std::string Key = getLHSKey("demanded", BPCs, PCs, LHS, Words,
+                                /*HashNames=*/true);
+    CachedResult R;
+    if (!lookup(Key, R, Words, /*Dataflow=*/true)) {
+      R.EC = UnderlyingSolver->testDemandedBits(BPCs, PCs, LHS,
+                                                R.DemandedBits, IC);
+      insert(Key, R, std::move(Words));
+    }
+    DBitsVect = R.DemandedBits;
+    return R.EC;
   }
 
   std::error_code nonNegative(const BlockPCs &BPCs,
                               const std::vector<InstMapping> &PCs,
                               Inst *LHS, bool &NonNegative,
                               InstContext &IC) override {
-    return UnderlyingSolver->nonNegative(BPCs, PCs, LHS, NonNegative, IC);
+    return cachedFlag("nonneg", BPCs, PCs, LHS, NonNegative, [&](bool &F) {
+      return UnderlyingSolver->nonNegative(BPCs, PCs, LHS, F, IC);
+    });
   }
 
   std::error_code negative(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, bool &Negative,
                            InstContext &IC) override {
-    return UnderlyingSolver->negative(BPCs, PCs, LHS, Negative, IC);
+    return cachedFlag("neg", BPCs, PCs, LHS, Negative, [&](bool &F) {
+      return UnderlyingSolver->negative(BPCs, PCs, LHS, F, IC);
+    });
   }
 
   std::error_code knownBits(const BlockPCs &BPCs,
                             const std::vector<InstMapping> &PCs,
                             Inst *LHS, KnownBits &Known,
                             InstContext &IC) override {
-    return UnderlyingSolver->knownBits(BPCs, PCs, LHS, Known, IC);
+    std::vector<uint64_t> Words;
+    std::string Key = getLHSKey("known", BPCs, PCs, LHS, Words);
+    CachedResult R;
+    if (!lookup(Key, R, Words, /*Dataflow=*/true)) {
+      R.Known = Known;
+      R.EC = UnderlyingSolver->knownBits(BPCs, PCs, LHS, R.Known, IC);
+      insert(Key, R, std::move(Words));
+    }
+    Known = R.Known;
+    return R.EC;
   }
 
   std::error_code powerTwo(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, bool &PowerTwo,
                            InstContext &IC) override {
-    return UnderlyingSolver->powerTwo(BPCs, PCs, LHS, PowerTwo, IC);
+    return cachedFlag("pow2", BPCs, PCs, LHS, PowerTwo, [&](bool &F) {
+      return UnderlyingSolver->powerTwo(BPCs, PCs, LHS, F, IC);
+    });
   }
 
   std::error_code nonZero(const BlockPCs &BPCs,
                           const std::vector<InstMapping> &PCs,
                           Inst *LHS, bool &NonZero,
                           InstContext &IC) override {
-    return UnderlyingSolver->nonZero(BPCs, PCs, LHS, NonZero, IC);
+    return cachedFlag("nonzero", BPCs, PCs, LHS, NonZero, [&](bool &F) {
+      return UnderlyingSolver->nonZero(BPCs, PCs, LHS, F, IC);
+    });
   }
 
   std::error_code signBits(const BlockPCs &BPCs,
                            const std::vector<InstMapping> &PCs,
                            Inst *LHS, unsigned &SignBits,
                            InstContext &IC) override {
-    return UnderlyingSolver->signBits(BPCs, PCs, LHS, SignBits, IC);
+    std::vector<uint64_t> Words;
+    std::string Key = getLHSKey("signbits", BPCs, PCs, LHS, Words);
+    CachedResult R;
+    if (!lookup(Key, R, Words, /*Dataflow=*/true)) {
+      R.EC = UnderlyingSolver->signBits(BPCs, PCs, LHS, R.Number, IC);
+      insert(Key, R, std::move(Words));
+    }
+    SignBits = R.Number;
+    return R.EC;
   }
 
 };
@@ -737,6 +1236,26 @@ public:
 class ExternalCachingSolver : public Solver {
   std::unique_ptr<Solver> UnderlyingSolver;
   KVStore *KV;
+  std::mutex PrefetchLock;
+  // answers fetched by prefetch() that infer() has not asked for yet
+  llvm::StringMap<llvm::Optional<std::string>> Prefetched;
+
+  bool lookup(const std::string &LHSStr, std::string &S) {
+    {
+      std::lock_guard<std::mutex> Guard(PrefetchLock);
+      auto It = Prefetched.find(LHSStr);
+      if (It != Prefetched.end()) {
+        ++ExternalPrefetched;
+        llvm::Optional<std::string> Value = std::move(It->second);
+        Prefetched.erase(It);
+        if (!Value)
+          return false;
+        S = std::move(*Value);
+        return true;
+      }
+    }
+    return KV->hGet(LHSStr, "result", S);
+  }
 
 public:
   ExternalCachingSolver(std::unique_ptr<Solver> UnderlyingSolver, KVStore *KV)
@@ -763,7 +1282,7 @@ public:
     if (LHSStr.length() > MaxLHSSize)
       return std::make_error_code(std::errc::value_too_large);
     std::string S;
-    if (KV->hGet(LHSStr, "result", S)) {
+    if (lookup(LHSStr, S)) {
       ++ExternalHits;
       if (S == "") {
         RHSs.clear();
@@ -811,6 +1330,26 @@ public:
     return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
   }
 
+  void prefetch(const std::vector<CandidateReplacement> &Cands) override {
+    std::vector<std::string> Keys;
+    for (auto &Cand : Cands) {
+      ReplacementContext Context;
+      std::string LHSStr = GetReplacementLHSString(Cand.BPCs, Cand.PCs,
+                                                   Cand.Mapping.LHS, Context);
+      if (LHSStr.length() <= MaxLHSSize)
+        Keys.emplace_back(std::move(LHSStr));
+    }
+    std::vector<llvm::Optional<std::string>> Values;
+    KV->hMGet(Keys, "result", Values);
+    {
+      std::lock_guard<std::mutex> Guard(PrefetchLock);
+      Prefetched.clear();
+      for (size_t I = 0; I < Keys.size(); ++I)
+        Prefetched[Keys[I]] = std::move(Values[I]);
+    }
+    UnderlyingSolver->prefetch(Cands);
+  }
+
   std::string getName() override {
     return UnderlyingSolver->getName() + " + external cache";
   }
@@ -867,6 +1406,168 @@ public:
 
 };
 
+class DataflowShortcutSolver : public Solver {
+  std::unique_ptr<Solver> UnderlyingSolver;
+
+  // Facts derived this way hold for every value of the inputs, so they also
+  // hold under any path condition. They can only prove a property, never
+  // refute one.
+  static void analyze(Inst *LHS, KnownBits &KB, llvm::ConstantRange &CR) {
+    ConcreteInterpreter BlankCI;
+    KB = KnownBitsAnalysis().findKnownBits(LHS, BlankCI,
+                                           /*UsePartialEval=*/false);
+    CR = ConstantRangeAnalysis().findConstantRange(LHS, BlankCI,
+                                                   /*UsePartialEval=*/false);
+  }
+
+  static bool provedNonZero(const KnownBits &KB,
+                            const llvm::ConstantRange &CR) {
+    return !KB.One.isNullValue() ||
+           !CR.contains(APInt::getNullValue(KB.getBitWidth()));
+  }
+
+public:
+  DataflowShortcutSolver(std::unique_ptr<Solver> UnderlyingSolver)
+      : UnderlyingSolver(std::move(UnderlyingSolver)) {}
+
+  std::error_code infer(const BlockPCs &BPCs,
+                        const std::vector<InstMapping> &PCs,
+                        Inst *LHS, std::vector<Inst *> &RHSs,
+                        bool AllowMultipleRHSs, InstContext &IC) override {
+    return UnderlyingSolver->infer(BPCs, PCs, LHS, RHSs, AllowMultipleRHSs,
+                                   IC);
+  }
+
+  std::error_code inferConst(const BlockPCs &BPCs,
+                             const std::vector<InstMapping> &PCs,
+                             Inst *LHS, Inst *&RHS,
+                             std::set<Inst *> &ConstSet,
+                             std::map<Inst *, llvm::APInt> &ResultMap,
+                             InstContext &IC) override {
+    return UnderlyingSolver->inferConst(BPCs, PCs, LHS, RHS, ConstSet,
+                                        ResultMap, IC);
+  }
+
+  llvm::ConstantRange constantRange(const BlockPCs &BPCs,
+                                    const std::vector<InstMapping> &PCs,
+                                    Inst *LHS,
+                                    InstContext &IC) override {
+    return UnderlyingSolver->constantRange(BPCs, PCs, LHS, IC);
+  }
+
+  std::error_code isValid(InstContext &IC, const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          InstMapping Mapping, bool &IsValid,
+                          std::vector<std::pair<Inst *, llvm::APInt>> *Model)
+  override {
+    return UnderlyingSolver->isValid(IC, BPCs, PCs, Mapping, IsValid, Model);
+  }
+
+  void prefetch(const std::vector<CandidateReplacement> &Cands) override {
+    UnderlyingSolver->prefetch(Cands);
+  }
+
+  std::string getName() override {
+    return UnderlyingSolver->getName() + " + dataflow shortcuts";
+  }
+
+  std::error_code testDemandedBits(const BlockPCs &BPCs,
+                                   const std::vector<InstMapping> &PCs,
+                                   Inst *LHS,
+                                   std::map<std::string, APInt> &DBitsVect,
+                                   InstContext &IC) override {
+    return UnderlyingSolver->testDemandedBits(BPCs, PCs, LHS, DBitsVect, IC);
+  }
+
+  std::error_code nonNegative(const BlockPCs &BPCs,
+                              const std::vector<InstMapping> &PCs,
+                              Inst *LHS, bool &NonNegative,
+                              InstContext &IC) override {
+    KnownBits KB;
+    llvm::ConstantRange CR(LHS->Width, /*isFullSet=*/true);
+    analyze(LHS, KB, CR);
+    if (KB.isNonNegative() || CR.isAllNonNegative()) {
+      ++DataflowShortcuts;
+      NonNegative = true;
+      return std::error_code();
+    }
+    return UnderlyingSolver->nonNegative(BPCs, PCs, LHS, NonNegative, IC);
+  }
+
+  std::error_code negative(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, bool &Negative,
+                           InstContext &IC) override {
+    KnownBits KB;
+    llvm::ConstantRange CR(LHS->Width, /*isFullSet=*/true);
+    analyze(LHS, KB, CR);
+    if (KB.isNegative() || CR.isAllNegative()) {
+      ++DataflowShortcuts;
+      Negative = true;
+      return std::error_code();
+    }
+    return UnderlyingSolver->negative(BPCs, PCs, LHS, Negative, IC);
+  }
+
+  std::error_code knownBits(const BlockPCs &BPCs,
+                            const std::vector<InstMapping> &PCs,
+                            Inst *LHS, KnownBits &Known,
+                            InstContext &IC) override {
+    return UnderlyingSolver->knownBits(BPCs, PCs, LHS, Known, IC);
+  }
+
+  std::error_code powerTwo(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, bool &PowerTwo,
+                           InstContext &IC) override {
+    KnownBits KB;
+    llvm::ConstantRange CR(LHS->Width, /*isFullSet=*/true);
+    analyze(LHS, KB, CR);
+    if (KB.countMaxPopulation() <= 1 && provedNonZero(KB, CR)) {
+      ++DataflowShortcuts;
+      PowerTwo = true;
+      return std::error_code();
+    }
+    return UnderlyingSolver->powerTwo(BPCs, PCs, LHS, PowerTwo, IC);
+  }
+
+  std::error_code nonZero(const BlockPCs &BPCs,
+                          const std::vector<InstMapping> &PCs,
+                          Inst *LHS, bool &NonZero,
+                          InstContext &IC) override {
+    KnownBits KB;
+    llvm::ConstantRange CR(LHS->Width, /*isFullSet=*/true);
+    analyze(LHS, KB, CR);
+    if (provedNonZero(KB, CR)) {
+      ++DataflowShortcuts;
+      NonZero = true;
+      return std::error_code();
+    }
+    return UnderlyingSolver->nonZero(BPCs, PCs, LHS, NonZero, IC);
+  }
+
+  std::error_code signBits(const BlockPCs &BPCs,
+                           const std::vector<InstMapping> &PCs,
+                           Inst *LHS, unsigned &SignBits,
+                           InstContext &IC) override {
+    // Only the largest possible answer is final; anything less may still
+    // be improved on by the solver.
+    unsigned W = LHS->Width;
+    KnownBits KB;
+    llvm::ConstantRange CR(W, /*isFullSet=*/true);
+    analyze(LHS, KB, CR);
+    unsigned CRSignBits = std::min(CR.getSignedMin().getNumSignBits(),
+                                   CR.getSignedMax().getNumSignBits());
+    if (KB.countMinSignBits() == W || CRSignBits == W) {
+      ++DataflowShortcuts;
+      SignBits = W;
+      return std::error_code();
+    }
+    return UnderlyingSolver->signBits(BPCs, PCs, LHS, SignBits, IC);
+  }
+
+};
+
 }
 
 namespace souper {
@@ -884,6 +1585,12 @@ std::unique_ptr<Solver> createMemCachingSolver(
       new MemCachingSolver(std::move(UnderlyingSolver)));
 }
 
+std::unique_ptr<Solver> createDataflowShortcutSolver(
+    std::unique_ptr<Solver> UnderlyingSolver) {
+  return std::unique_ptr<Solver>(
+      new DataflowShortcutSolver(std::move(UnderlyingSolver)));
+}
+
 std::unique_ptr<Solver> createExternalCachingSolver(
     std::unique_ptr<Solver> UnderlyingSolver, KVStore *KV) {
   return std::unique_ptr<Solver>(
@@ -0,0 +1,631 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define DEBUG_TYPE "souper"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/Extractor/ExprBuilder.h"
+#include "souper/SMTLIB2/Solver.h"
+
+#include <climits>
+#include <z3.h>
+
+STATISTIC(LibraryErrors, "Number of Z3 library errors");
+STATISTIC(LibrarySats, "Number of satisfiable Z3 library queries");
+STATISTIC(LibraryTimeouts, "Number of Z3 library timeouts");
+STATISTIC(LibraryUnsats, "Number of unsatisfiable Z3 library queries");
+
+using namespace souper;
+
+namespace {
+
+void ignoreZ3Error(Z3_context, Z3_error_code) {}
+
+// A reference counted Z3 context. Errors are checked for explicitly instead
+// of letting Z3 abort the process.
+struct Z3Context {
+  Z3_context Ctx;
+
+  Z3Context() {
+    Z3_config Cfg = Z3_mk_config();
+    Z3_set_param_value(Cfg, "model", "true");
+    Ctx = Z3_mk_context_rc(Cfg);
+    Z3_del_config(Cfg);
+    Z3_set_error_handler(Ctx, ignoreZ3Error);
+  }
+  ~Z3Context() { Z3_del_context(Ctx); }
+};
+
+// Z3 contexts are not thread safe; each thread gets its own, reused by every
+// query issued on that thread.
+Z3_context getThreadContext() {
+  static thread_local Z3Context C;
+  return C.Ctx;
+}
+
+class Z3Builder : public ExprBuilder {
+  Z3_context Ctx;
+  // The context is reference counted: every AST we make is pinned here until
+  // the builder goes away.
+  Z3_ast_vector Pool;
+  UniqueNameSet VarNames;
+  std::map<Inst *, Z3_ast> ExprMap;
+  std::vector<Inst *> Vars;
+  std::vector<Z3_ast> VarExprs;
+
+public:
+  Z3Builder(InstContext &IC) : ExprBuilder(IC), Ctx(getThreadContext()) {
+    Pool = Z3_mk_ast_vector(Ctx);
+    Z3_ast_vector_inc_ref(Ctx, Pool);
+  }
+  ~Z3Builder() {
+    Z3_ast_vector_dec_ref(Ctx, Pool);
+  }
+
+  Z3_context getContext() const { return Ctx; }
+  const std::vector<Inst *> &getVars() const { return Vars; }
+  const std::vector<Z3_ast> &getVarExprs() const { return VarExprs; }
+
+  // Returns a formula that is satisfiable iff Query, an i1 expression, can
+  // be false.
+  Z3_ast getNegatedQuery(Inst *Query) {
+    prepopulateExprMap(Query);
+    return pin(Z3_mk_eq(Ctx, get(Query), bvConst(0, 1)));
+  }
+
+  // Returns a formula that holds iff I, an i1 expression, is true
+  Z3_ast getFormula(Inst *I) {
+    prepopulateExprMap(I);
+    return toBool(get(I));
+  }
+
+  std::string GetExprStr(const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping,
+                         std::vector<Inst *> *ModelVars, bool Negate,
+                         bool DropUB) override {
+    Inst *Cand = GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                /*Precondition=*/0, Negate,
+                                                DropUB);
+    if (!Cand)
+      return std::string();
+    prepopulateExprMap(Cand);
+    return Z3_ast_to_string(Ctx, get(Cand));
+  }
+
+  std::string BuildQuery(const BlockPCs &BPCs,
+                         const std::vector<InstMapping> &PCs,
+                         InstMapping Mapping,
+                         std::vector<Inst *> *ModelVars,
+                         Inst *Precondition, bool Negate,
+                         bool DropUB) override {
+    Inst *Cand = GetCandidateExprForReplacement(BPCs, PCs, Mapping,
+                                                Precondition, Negate, DropUB);
+    if (!Cand)
+      return std::string();
+
+    Z3_solver S = Z3_mk_simple_solver(Ctx);
+    Z3_solver_inc_ref(Ctx, S);
+    Z3_solver_assert(Ctx, S, getNegatedQuery(Cand));
+
+    std::string SMTStr;
+    llvm::raw_string_ostream SMTSS(SMTStr);
+    if (ModelVars)
+      SMTSS << "(set-option :produce-models true)\n";
+    SMTSS << "(set-logic QF_BV)\n";
+    SMTSS << Z3_solver_to_string(Ctx, S);
+    SMTSS << "(check-sat)\n";
+    Z3_solver_dec_ref(Ctx, S);
+
+    // one get-value per variable, the way the SMT-LIB solvers expect to
+    // parse models
+    if (ModelVars) {
+      for (unsigned I = 0; I != Vars.size(); ++I) {
+        SMTSS << "(get-value (" << Z3_ast_to_string(Ctx, VarExprs[I])
+              << "))\n";
+        ModelVars->push_back(Vars[I]);
+      }
+    }
+    SMTSS << "(exit)\n";
+
+    return SMTSS.str();
+  }
+
+private:
+  Z3_ast pin(Z3_ast A) {
+    Z3_ast_vector_push(Ctx, Pool, A);
+    return A;
+  }
+
+  Z3_sort bvSort(unsigned Width) {
+    Z3_sort S = Z3_mk_bv_sort(Ctx, Width);
+    pin(Z3_sort_to_ast(Ctx, S));
+    return S;
+  }
+
+  Z3_ast bvConst(uint64_t Val, unsigned Width) {
+    return pin(Z3_mk_unsigned_int64(Ctx, Val, bvSort(Width)));
+  }
+
+  Z3_ast bvConst(const llvm::APInt &Val) {
+    llvm::SmallString<40> Str;
+    Val.toStringUnsigned(Str, 10);
+    return pin(Z3_mk_numeral(Ctx, Str.c_str(), bvSort(Val.getBitWidth())));
+  }
+
+  // souper booleans are i1 values; Z3 predicates have to be converted
+  Z3_ast fromBool(Z3_ast B) {
+    return pin(Z3_mk_ite(Ctx, B, bvConst(1, 1), bvConst(0, 1)));
+  }
+
+  Z3_ast toBool(Z3_ast BV) {
+    return pin(Z3_mk_eq(Ctx, BV, bvConst(1, 1)));
+  }
+
+  Z3_ast extract(Z3_ast E, unsigned Offset, unsigned Width) {
+    return pin(Z3_mk_extract(Ctx, Offset + Width - 1, Offset, E));
+  }
+
+  Z3_ast zext(Z3_ast E, unsigned FromWidth, unsigned ToWidth) {
+    if (FromWidth == ToWidth)
+      return E;
+    return pin(Z3_mk_zero_ext(Ctx, ToWidth - FromWidth, E));
+  }
+
+  Z3_ast sext(Z3_ast E, unsigned FromWidth, unsigned ToWidth) {
+    if (FromWidth == ToWidth)
+      return E;
+    return pin(Z3_mk_sign_ext(Ctx, ToWidth - FromWidth, E));
+  }
+
+  Z3_ast countOnes(Z3_ast L, unsigned Width) {
+    Z3_ast Count = bvConst(0, Width);
+    for (unsigned i = 0; i < Width; i++) {
+      Z3_ast BitExt = zext(extract(L, i, 1), 1, Width);
+      Count = pin(Z3_mk_bvadd(Ctx, Count, BitExt));
+    }
+    return Count;
+  }
+
+  Z3_ast buildAssoc(Z3_ast (*F)(Z3_context, Z3_ast, Z3_ast),
+                    llvm::ArrayRef<Inst *> Ops) {
+    Z3_ast E = get(Ops[0]);
+    for (Inst *I : llvm::ArrayRef<Inst *>(Ops.data()+1, Ops.size()-1))
+      E = pin(F(Ctx, E, get(I)));
+    return E;
+  }
+
+  Z3_ast buildBinary(Z3_ast (*F)(Z3_context, Z3_ast, Z3_ast),
+                     llvm::ArrayRef<Inst *> Ops) {
+    return pin(F(Ctx, get(Ops[0]), get(Ops[1])));
+  }
+
+  Z3_ast buildCmp(Z3_ast (*F)(Z3_context, Z3_ast, Z3_ast),
+                  llvm::ArrayRef<Inst *> Ops) {
+    return fromBool(buildBinary(F, Ops));
+  }
+
+  // Saturating signed add/sub: compute at Width+1 bits and clamp.
+  Z3_ast buildSignedSat(Inst *I, Z3_ast (*F)(Z3_context, Z3_ast, Z3_ast)) {
+    const std::vector<Inst *> &Ops = I->orderedOps();
+    unsigned W = I->Width;
+    Z3_ast Res = buildBinary(F, Ops);
+    Z3_ast Ext = pin(F(Ctx, sext(get(Ops[0]), W, W + 1),
+                       sext(get(Ops[1]), W, W + 1)));
+    Z3_ast SMin = bvConst(llvm::APInt::getSignedMinValue(W));
+    Z3_ast SMax = bvConst(llvm::APInt::getSignedMaxValue(W));
+    Z3_ast Below = pin(Z3_mk_bvsle(Ctx, Ext, sext(SMin, W, W + 1)));
+    Z3_ast Above = pin(Z3_mk_bvsge(Ctx, Ext, sext(SMax, W, W + 1)));
+    return pin(Z3_mk_ite(Ctx, Below, SMin,
+                         pin(Z3_mk_ite(Ctx, Above, SMax, Res))));
+  }
+
+  Z3_ast build(Inst *I) {
+    const std::vector<Inst *> &Ops = I->orderedOps();
+    switch (I->K) {
+    case Inst::UntypedConst:
+      assert(0 && "unexpected kind");
+    case Inst::Const:
+      return bvConst(I->Val);
+    case Inst::Hole:
+    case Inst::Var:
+      return makeVar(I);
+    case Inst::Phi: {
+      const auto &PredExpr = I->B->PredVars;
+      assert((PredExpr.size() || Ops.size() == 1) && "there must be block predicates");
+      Z3_ast E = get(Ops[0]);
+      // e.g. P2 ? (P1 ? Op1_Expr : Op2_Expr) : Op3_Expr
+      for (unsigned J = 1; J < Ops.size(); ++J)
+        E = pin(Z3_mk_ite(Ctx, toBool(get(PredExpr[J-1])), E, get(Ops[J])));
+      return E;
+    }
+    case Inst::Freeze:
+      return get(Ops[0]);
+    case Inst::Add:
+      return buildAssoc(Z3_mk_bvadd, Ops);
+    case Inst::AddNSW:
+    case Inst::AddNUW:
+    case Inst::AddNW:
+      return buildBinary(Z3_mk_bvadd, Ops);
+    case Inst::Sub:
+    case Inst::SubNSW:
+    case Inst::SubNUW:
+    case Inst::SubNW:
+      return buildBinary(Z3_mk_bvsub, Ops);
+    case Inst::Mul:
+      return buildAssoc(Z3_mk_bvmul, Ops);
+    case Inst::MulNSW:
+    case Inst::MulNUW:
+    case Inst::MulNW:
+      return buildBinary(Z3_mk_bvmul, Ops);
+    // Division by zero is well defined in Z3; the UB constraints built by
+    // ExprBuilder make sure it does not matter.
+    case Inst::UDiv:
+    case Inst::UDivExact:
+      return buildBinary(Z3_mk_bvudiv, Ops);
+    case Inst::SDiv:
+    case Inst::SDivExact:
+      return buildBinary(Z3_mk_bvsdiv, Ops);
+    case Inst::URem:
+      return buildBinary(Z3_mk_bvurem, Ops);
+    case Inst::SRem:
+      return buildBinary(Z3_mk_bvsrem, Ops);
+    case Inst::And:
+      return buildAssoc(Z3_mk_bvand, Ops);
+    case Inst::Or:
+      return buildAssoc(Z3_mk_bvor, Ops);
+    case Inst::Xor:
+      return buildAssoc(Z3_mk_bvxor, Ops);
+    case Inst::Shl:
+    case Inst::ShlNSW:
+    case Inst::ShlNUW:
+    case Inst::ShlNW:
+      return buildBinary(Z3_mk_bvshl, Ops);
+    case Inst::LShr:
+    case Inst::LShrExact:
+      return buildBinary(Z3_mk_bvlshr, Ops);
+    case Inst::AShr:
+    case Inst::AShrExact:
+      return buildBinary(Z3_mk_bvashr, Ops);
+    case Inst::Select:
+      return pin(Z3_mk_ite(Ctx, toBool(get(Ops[0])), get(Ops[1]), get(Ops[2])));
+    case Inst::ZExt:
+      return zext(get(Ops[0]), Ops[0]->Width, I->Width);
+    case Inst::SExt:
+      return sext(get(Ops[0]), Ops[0]->Width, I->Width);
+    case Inst::Trunc:
+      return extract(get(Ops[0]), 0, I->Width);
+    case Inst::Eq:
+      return buildCmp(Z3_mk_eq, Ops);
+    case Inst::Ne:
+      return fromBool(pin(Z3_mk_not(Ctx, buildBinary(Z3_mk_eq, Ops))));
+    case Inst::Ult:
+      return buildCmp(Z3_mk_bvult, Ops);
+    case Inst::Slt:
+      return buildCmp(Z3_mk_bvslt, Ops);
+    case Inst::Ule:
+      return buildCmp(Z3_mk_bvule, Ops);
+    case Inst::Sle:
+      return buildCmp(Z3_mk_bvsle, Ops);
+    case Inst::CtPop:
+      return countOnes(get(Ops[0]), I->Width);
+    case Inst::BSwap: {
+      Z3_ast L = get(Ops[0]);
+      constexpr unsigned bytelen = 8;
+      Z3_ast res = extract(L, 0, bytelen);
+      for (unsigned i = 1; i < I->Width / bytelen; i++)
+        res = pin(Z3_mk_concat(Ctx, res, extract(L, i * bytelen, bytelen)));
+      return res;
+    }
+    case Inst::BitReverse: {
+      Z3_ast L = get(Ops[0]);
+      Z3_ast res = extract(L, 0, 1);
+      for (unsigned i = 1; i < I->Width; i++)
+        res = pin(Z3_mk_concat(Ctx, res, extract(L, i, 1)));
+      return res;
+    }
+    case Inst::Cttz:
+    case Inst::Ctlz: {
+      unsigned Width = I->Width;
+      Z3_ast Val = get(Ops[0]);
+      for (unsigned i=0, j=0; j<Width/2; i++) {
+        j = 1<<i;
+        Z3_ast Shifted = pin(I->K == Inst::Cttz ?
+                             Z3_mk_bvshl(Ctx, Val, bvConst(j, Width)) :
+                             Z3_mk_bvlshr(Ctx, Val, bvConst(j, Width)));
+        Val = pin(Z3_mk_bvor(Ctx, Val, Shifted));
+      }
+      return pin(Z3_mk_bvsub(Ctx, bvConst(Width, Width),
+                             countOnes(Val, Width)));
+    }
+    case Inst::FShl:
+    case Inst::FShr: {
+      unsigned IWidth = I->Width;
+      Z3_ast ShAmtModWidth = pin(Z3_mk_bvurem(Ctx, get(Ops[2]),
+                                              bvConst(IWidth, IWidth)));
+      Z3_ast Concatenated = pin(Z3_mk_concat(Ctx, get(Ops[0]), get(Ops[1])));
+      Z3_ast ShAmtModWidthZExt = zext(ShAmtModWidth, IWidth, 2 * IWidth);
+      Z3_ast Shifted = pin(I->K == Inst::FShl ?
+                           Z3_mk_bvshl(Ctx, Concatenated, ShAmtModWidthZExt) :
+                           Z3_mk_bvlshr(Ctx, Concatenated, ShAmtModWidthZExt));
+      unsigned BitOffset = I->K == Inst::FShr ? 0 : IWidth;
+      return extract(Shifted, BitOffset, IWidth);
+    }
+    case Inst::SAddO:
+      return pin(Z3_mk_bvnot(Ctx, get(addnswUB(I))));
+    case Inst::UAddO:
+      return pin(Z3_mk_bvnot(Ctx, get(addnuwUB(I))));
+    case Inst::SSubO:
+      return pin(Z3_mk_bvnot(Ctx, get(subnswUB(I))));
+    case Inst::USubO:
+      return pin(Z3_mk_bvnot(Ctx, get(subnuwUB(I))));
+    case Inst::SMulO:
+      return pin(Z3_mk_bvnot(Ctx, get(mulnswUB(I))));
+    case Inst::UMulO:
+      return pin(Z3_mk_bvnot(Ctx, get(mulnuwUB(I))));
+    case Inst::ExtractValue: {
+      unsigned Index = Ops[1]->Val.getZExtValue();
+      return get(Ops[0]->Ops[Index]);
+    }
+    case Inst::SAddSat:
+      return buildSignedSat(I, Z3_mk_bvadd);
+    case Inst::UAddSat:
+      return pin(Z3_mk_ite(Ctx, toBool(get(addnuwUB(I))),
+                           buildBinary(Z3_mk_bvadd, Ops),
+                           bvConst(llvm::APInt::getMaxValue(I->Width))));
+    case Inst::SSubSat:
+      return buildSignedSat(I, Z3_mk_bvsub);
+    case Inst::USubSat:
+      return pin(Z3_mk_ite(Ctx, toBool(get(subnuwUB(I))),
+                           buildBinary(Z3_mk_bvsub, Ops),
+                           bvConst(llvm::APInt::getMinValue(I->Width))));
+    case Inst::SAddWithOverflow:
+    case Inst::UAddWithOverflow:
+    case Inst::SSubWithOverflow:
+    case Inst::USubWithOverflow:
+    case Inst::SMulWithOverflow:
+    case Inst::UMulWithOverflow:
+    default:
+      break;
+    }
+    llvm_unreachable("unknown kind");
+  }
+
+  Z3_ast get(Inst *I) {
+    Z3_ast &E = ExprMap[I];
+    if (!E) {
+      E = build(I);
+      assert(Z3_get_bv_sort_size(Ctx, Z3_get_sort(Ctx, E)) == I->Width);
+    }
+    return E;
+  }
+
+  // Same as KLEEBuilder::prepopulateExprMap(): build operands before their
+  // users so that get() does not recurse deeply.
+  void prepopulateExprMap(Inst *Root) {
+    llvm::SmallVector<Inst *, 32> AllInst;
+    AllInst.emplace_back(Root);
+    for (size_t InstNum = 0; InstNum < AllInst.size(); InstNum++) {
+      Inst *CurrInst = AllInst[InstNum];
+      const std::vector<Inst *> &Ops = CurrInst->orderedOps();
+      AllInst.insert(AllInst.end(), Ops.rbegin(), Ops.rend());
+    }
+
+    llvm::for_each(llvm::reverse(AllInst), [this](Inst *CurrInst) {
+      switch (CurrInst->K) {
+      case Inst::UntypedConst:
+      case Inst::SAddWithOverflow:
+      case Inst::UAddWithOverflow:
+      case Inst::SSubWithOverflow:
+      case Inst::USubWithOverflow:
+      case Inst::SMulWithOverflow:
+      case Inst::UMulWithOverflow:
+        return;
+      default:
+        break;
+      }
+      (void)get(CurrInst);
+    });
+  }
+
+  Z3_ast makeVar(Inst *Origin) {
+    std::string NameStr;
+    if (Origin->Name.empty())
+      NameStr = "arr";
+    else if (Origin->Name[0] >= '0' && Origin->Name[0] <= '9')
+      NameStr = "a" + Origin->Name;
+    else
+      NameStr = Origin->Name;
+    std::string Name = VarNames.makeName(NameStr);
+    Z3_symbol Sym = Z3_mk_string_symbol(Ctx, Name.c_str());
+    Z3_ast E = pin(Z3_mk_const(Ctx, Sym, bvSort(Origin->Width)));
+    Vars.push_back(Origin);
+    VarExprs.push_back(E);
+    return E;
+  }
+};
+
+std::error_code readModel(Z3Builder &EB, Z3_solver S,
+                          std::vector<Inst *> &ModelVars,
+                          std::vector<llvm::APInt> *Models) {
+  Z3_context Ctx = EB.getContext();
+  Z3_model M = Z3_solver_get_model(Ctx, S);
+  Z3_model_inc_ref(Ctx, M);
+  std::vector<llvm::APInt> Vals;
+  std::error_code EC;
+  for (unsigned I = 0; I != EB.getVars().size(); ++I) {
+    ModelVars.push_back(EB.getVars()[I]);
+    Z3_ast V;
+    if (!Z3_model_eval(Ctx, M, EB.getVarExprs()[I],
+                       /*model_completion=*/true, &V)) {
+      EC = std::make_error_code(std::errc::protocol_error);
+      break;
+    }
+    Z3_inc_ref(Ctx, V);
+    Vals.push_back(llvm::APInt(EB.getVars()[I]->Width,
+                               Z3_get_numeral_string(Ctx, V), 10));
+    Z3_dec_ref(Ctx, V);
+  }
+  Z3_model_dec_ref(Ctx, M);
+  if (EC)
+    ++LibraryErrors;
+  else if (Models)
+    *Models = std::move(Vals);
+  return EC;
+}
+
+void setTimeout(Z3_context Ctx, Z3_solver S, unsigned Timeout) {
+  Z3_params P = Z3_mk_params(Ctx);
+  Z3_params_inc_ref(Ctx, P);
+  // zero means no timeout to Z3, as it does to us
+  Z3_params_set_uint(Ctx, P, Z3_mk_string_symbol(Ctx, "timeout"),
+                     Timeout ? Timeout * 1000 : UINT_MAX);
+  Z3_solver_set_params(Ctx, S, P);
+  Z3_params_dec_ref(Ctx, P);
+}
+
+// Checks the assertions of S; Result is set if they are satisfiable
+std::error_code checkSolver(Z3Builder &EB, Z3_solver S, bool &Result,
+                            std::vector<Inst *> *ModelVars,
+                            std::vector<llvm::APInt> *Models) {
+  Z3_context Ctx = EB.getContext();
+  switch (Z3_solver_check(Ctx, S)) {
+  case Z3_L_FALSE:
+    Result = false;
+    ++LibraryUnsats;
+    return std::error_code();
+  case Z3_L_TRUE:
+    Result = true;
+    ++LibrarySats;
+    if (ModelVars)
+      return readModel(EB, S, *ModelVars, Models);
+    return std::error_code();
+  default:
+    if (Z3_get_error_code(Ctx) != Z3_OK) {
+      Z3_set_error(Ctx, Z3_OK);
+      ++LibraryErrors;
+      return std::make_error_code(std::errc::protocol_error);
+    }
+    ++LibraryTimeouts;
+    return std::make_error_code(std::errc::timed_out);
+  }
+}
+
+// Keeps one Z3 solver, and the translation of every Inst added so far,
+// for the life of the context. Each check pushes a scope for its
+// assumptions and pops it again.
+class Z3IncrementalContext : public SMTLIBSolver::IncrementalContext {
+  InstContext IC;
+  Z3Builder EB;
+  Z3_solver S;
+
+public:
+  Z3IncrementalContext() : EB(IC) {
+    Z3_context Ctx = EB.getContext();
+    S = Z3_mk_simple_solver(Ctx);
+    Z3_solver_inc_ref(Ctx, S);
+  }
+  ~Z3IncrementalContext() {
+    Z3_solver_dec_ref(EB.getContext(), S);
+  }
+
+  void add(Inst *Constraint) override {
+    Z3_solver_assert(EB.getContext(), S, EB.getFormula(Constraint));
+  }
+
+  std::error_code check(llvm::ArrayRef<Inst *> Assumptions, bool &Result,
+                        std::vector<Inst *> *ModelVars,
+                        std::vector<llvm::APInt> *Models,
+                        unsigned Timeout) override {
+    Z3_context Ctx = EB.getContext();
+    setTimeout(Ctx, S, Timeout);
+    if (!Assumptions.empty()) {
+      Z3_solver_push(Ctx, S);
+      for (auto A : Assumptions)
+        Z3_solver_assert(Ctx, S, EB.getFormula(A));
+    }
+    std::error_code EC = checkSolver(EB, S, Result, ModelVars, Models);
+    if (!Assumptions.empty())
+      Z3_solver_pop(Ctx, S, 1);
+    return EC;
+  }
+};
+
+// Solves queries in-process through the Z3 C API. Queries that come in as
+// souper expressions are translated straight into Z3 terms, and models are
+// read back from Z3 directly; nothing goes through SMT-LIB text.
+class Z3LibrarySolver : public SMTLIBSolver {
+public:
+  std::string getName() const override {
+    return "Z3 library";
+  }
+
+  bool translatesInsts() const override { return true; }
+
+  std::error_code isSatisfiable(llvm::StringRef Query, bool &Result,
+                                unsigned NumModels,
+                                std::vector<llvm::APInt> *Models,
+                                unsigned Timeout) override {
+    Z3_context Ctx = getThreadContext();
+    Z3_eval_smtlib2_string(Ctx, "(reset)");
+    if (Timeout)
+      Z3_eval_smtlib2_string(Ctx, ("(set-option :timeout " +
+                                   std::to_string(Timeout * 1000) +
+                                   ")").c_str());
+    std::string Out = Z3_eval_smtlib2_string(Ctx, Query.str().c_str());
+    Z3_set_error(Ctx, Z3_OK);
+    if (llvm::StringRef(Out).startswith("unknown")) {
+      ++LibraryTimeouts;
+      return std::make_error_code(std::errc::timed_out);
+    }
+    return parseSolverResponse(Out, Result, NumModels, Models);
+  }
+
+  std::error_code isSatisfiableExpr(Inst *Query, bool &Result,
+                                    std::vector<Inst *> *ModelVars,
+                                    std::vector<llvm::APInt> *Models,
+                                    unsigned Timeout) override {
+    InstContext IC;
+    Z3Builder EB(IC);
+    Z3_context Ctx = EB.getContext();
+    Z3_ast Negated = EB.getNegatedQuery(Query);
+
+    Z3_solver S = Z3_mk_simple_solver(Ctx);
+    Z3_solver_inc_ref(Ctx, S);
+    if (Timeout)
+      setTimeout(Ctx, S, Timeout);
+    Z3_solver_assert(Ctx, S, Negated);
+    std::error_code EC = checkSolver(EB, S, Result, ModelVars, Models);
+    Z3_solver_dec_ref(Ctx, S);
+    return EC;
+  }
+
+  std::unique_ptr<IncrementalContext> createIncrementalContext() override {
+    return std::unique_ptr<IncrementalContext>(new Z3IncrementalContext);
+  }
+};
+
+}
+
+std::unique_ptr<ExprBuilder> souper::createZ3Builder(InstContext &IC) {
+  return std::unique_ptr<ExprBuilder>(new Z3Builder(IC));
+}
+
+std::unique_ptr<SMTLIBSolver> souper::createZ3LibrarySolver() {
+  return std::unique_ptr<SMTLIBSolver>(new Z3LibrarySolver);
+}
@@ -426,10 +426,27 @@ namespace souper {
     return EvalValue();
   }
 
-#define KB0 findKnownBits(I->Ops[0], CI, UsePartialEval)
-#define KB1 findKnownBits(I->Ops[1], CI, UsePartialEval)
-#define KB2 findKnownBits(I->Ops[2], CI, UsePartialEval)
-#define VAL(INST) getValue(INST, CI)
+  // Like getValue, for node ID of DAG. The values of the nodes evaluated on
+  // the way are kept in Vals for the next call.
+  static EvalValue getValue(const LinearDAG &DAG, unsigned ID,
+                            ConcreteInterpreter &CI,
+                            std::vector<llvm::Optional<EvalValue>> &Vals) {
+    Inst *I = DAG.getNode(ID);
+    if (I->K == Inst::Const)
+      return {I->Val};
+    else if (I->K == Inst::Var && !isReservedConst(I))
+      return CI.evaluateNode(DAG, ID, Vals);
+
+    if (isConcrete(I))
+      return CI.evaluateNode(DAG, ID, Vals);
+
+    // unimplemented
+    return EvalValue();
+  }
+
+#define KB0 findKnownBits(DAG, Ops[0], CI, UsePartialEval, Vals, KBs)
+#define KB1 findKnownBits(DAG, Ops[1], CI, UsePartialEval, Vals, KBs)
+#define KB2 findKnownBits(DAG, Ops[2], CI, UsePartialEval, Vals, KBs)
 
   llvm::KnownBits KnownBitsAnalysis::mergeKnownBits(std::vector<llvm::KnownBits> Vec) {
     assert(Vec.size() > 0);
@@ -473,19 +490,56 @@ namespace souper {
   }
 
   llvm::KnownBits KnownBitsAnalysis::findKnownBits(Inst *I, ConcreteInterpreter &CI, bool UsePartialEval) {
-    llvm::KnownBits Result(I->Width);
-
     if (cacheHasValue(I))
       return KBCache.at(I);
 
+    // like the DAG version, but keep the known bits of every node analyzed
+    // on the way, so that later calls on a subtree don't redo it
+    LinearDAG DAG(I);
+    std::vector<llvm::Optional<EvalValue>> Vals(DAG.size());
+    std::vector<llvm::Optional<llvm::KnownBits>> KBs(DAG.size());
+    auto Result = findKnownBits(DAG, DAG.size() - 1, CI, UsePartialEval,
+                                Vals, KBs);
+    for (unsigned ID = 0; ID != DAG.size(); ++ID)
+      if (KBs[ID])
+        KBCache.emplace(DAG.getNode(ID), *KBs[ID]);
+    return Result;
+  }
+
+  llvm::KnownBits KnownBitsAnalysis::findKnownBits(const LinearDAG &DAG,
+                                                   ConcreteInterpreter &CI,
+                                                   bool UsePartialEval) {
+    std::vector<llvm::Optional<EvalValue>> Vals(DAG.size());
+    std::vector<llvm::Optional<llvm::KnownBits>> KBs(DAG.size());
+    return findKnownBits(DAG, DAG.size() - 1, CI, UsePartialEval, Vals, KBs);
+  }
+
+  llvm::KnownBits KnownBitsAnalysis::findKnownBits(const LinearDAG &DAG,
+                                                   unsigned ID,
+                                                   ConcreteInterpreter &CI,
+                                                   bool UsePartialEval,
+                                                   std::vector<llvm::Optional<EvalValue>> &Vals,
+                                                   std::vector<llvm::Optional<llvm::KnownBits>> &KBs) {
+    if (KBs[ID])
+      return *KBs[ID];
+
+    Inst *I = DAG.getNode(ID);
+    auto Ops = DAG.getOps(ID);
+    llvm::KnownBits Result(I->Width);
+
+    if (cacheHasValue(I)) {
+      KBs[ID] = KBCache.at(I);
+      return *KBs[ID];
+    }
+
     if (UsePartialEval || I->K == Inst::Const) {
-    EvalValue V = VAL(I);
+    EvalValue V = getValue(DAG, ID, CI, Vals);
     if (V.hasValue()) {
       Result.One = V.getValue();
       Result.Zero = ~V.getValue();
 
       // cache before returning
-      KBCache.emplace(I, Result);
+      KBs[ID] = Result;
 
       return Result;
     }
@@ -499,8 +553,8 @@ namespace souper {
     }
     case Inst::Phi: {
       std::vector<llvm::KnownBits> vec;
-      for (auto &Op : I->Ops) {
-        vec.emplace_back(findKnownBits(Op, CI, UsePartialEval));
+      for (auto Op : Ops) {
+        vec.emplace_back(findKnownBits(DAG, Op, CI, UsePartialEval, Vals, KBs));
       }
       Result = mergeKnownBits(vec);
       break;
@@ -714,6 +768,7 @@ namespace souper {
       if (I->Ops[1]->Val == 0) {
         auto IOld = I;
         I = I->Ops[0]->Ops[0];
+        Ops = DAG.getOps(DAG.getOps(Ops[0])[0]);
         switch (IOld->Ops[0]->K) {
           case souper::Inst::SAddWithOverflow:
           case souper::Inst::UAddWithOverflow:
@@ -744,8 +799,8 @@ namespace souper {
 
     assert(!Result.hasConflict() && "Conflict in resulting KB!");
 
-    KBCache.emplace(I, Result);
-    return KBCache.at(I);
+    KBs[ID] = Result;
+    return Result;
   }
 
 #undef KB0
@@ -762,9 +817,9 @@ namespace souper {
     return k;
   }
 
-#define CR0 findConstantRange(I->Ops[0], CI, UsePartialEval)
-#define CR1 findConstantRange(I->Ops[1], CI, UsePartialEval)
-#define CR2 findConstantRange(I->Ops[2], CI, UsePartialEval)
+#define CR0 findConstantRange(DAG, Ops[0], CI, UsePartialEval, Vals, CRs)
+#define CR1 findConstantRange(DAG, Ops[1], CI, UsePartialEval, Vals, CRs)
+#define CR2 findConstantRange(DAG, Ops[2], CI, UsePartialEval, Vals, CRs)
 
   bool ConstantRangeAnalysis::cacheHasValue(Inst *I) {
     if (CRCache.find(I) != CRCache.end())
@@ -781,16 +836,52 @@ namespace souper {
   llvm::ConstantRange ConstantRangeAnalysis::findConstantRange(Inst *I,
                                                                ConcreteInterpreter &CI,
                                                                bool UsePartialEval) {
-    llvm::ConstantRange Result(I->Width, /*isFullSet=*/true);
-
     if (cacheHasValue(I))
       return CRCache.at(I);
 
+    // keep the range of every node analyzed on the way, like findKnownBits
+    LinearDAG DAG(I);
+    std::vector<llvm::Optional<EvalValue>> Vals(DAG.size());
+    std::vector<llvm::Optional<llvm::ConstantRange>> CRs(DAG.size());
+    auto Result = findConstantRange(DAG, DAG.size() - 1, CI, UsePartialEval,
+                                    Vals, CRs);
+    for (unsigned ID = 0; ID != DAG.size(); ++ID)
+      if (CRs[ID])
+        CRCache.emplace(DAG.getNode(ID), *CRs[ID]);
+    return Result;
+  }
+
+  llvm::ConstantRange ConstantRangeAnalysis::findConstantRange(const LinearDAG &DAG,
+                                                               ConcreteInterpreter &CI,
+                                                               bool UsePartialEval) {
+    std::vector<llvm::Optional<EvalValue>> Vals(DAG.size());
+    std::vector<llvm::Optional<llvm::ConstantRange>> CRs(DAG.size());
+    return findConstantRange(DAG, DAG.size() - 1, CI, UsePartialEval, Vals, CRs);
+  }
+
+  llvm::ConstantRange ConstantRangeAnalysis::findConstantRange(const LinearDAG &DAG,
+                                                               unsigned ID,
+                                                               ConcreteInterpreter &CI,
+                                                               bool UsePartialEval,
+                                                               std::vector<llvm::Optional<EvalValue>> &Vals,
+                                                               std::vector<llvm::Optional<llvm::ConstantRange>> &CRs) {
+    if (CRs[ID])
+      return *CRs[ID];
+
+    Inst *I = DAG.getNode(ID);
+    auto Ops = DAG.getOps(ID);
+    llvm::ConstantRange Result(I->Width, /*isFullSet=*/true);
+
+    if (cacheHasValue(I)) {
+      CRs[ID] = CRCache.at(I);
+      return *CRs[ID];
+    }
+
     if (UsePartialEval || I->K == Inst::Const) {
-    EvalValue V = VAL(I);
+    EvalValue V = getValue(DAG, ID, CI, Vals);
     if (V.hasValue()) {
-      CRCache.emplace(I, llvm::ConstantRange(V.getValue()));
-      return CRCache.at(I);
+      CRs[ID] = llvm::ConstantRange(V.getValue());
+      return *CRs[ID];
     }
     }
 
@@ -819,7 +910,7 @@ namespace souper {
       Result = CR0.add(CR1);
       break;
     case Inst::AddNSW: {
-      auto V1 = VAL(I->Ops[1]);
+      auto V1 = getValue(DAG, Ops[1], CI, Vals);
       if (V1.hasValue()) {
         Result = CR0.addWithNoWrap(V1.getValue(), OverflowingBinaryOperator::NoSignedWrap);
       }
@@ -894,6 +985,7 @@ namespace souper {
       if (I->Ops[1]->Val == 0) {
         auto IOld = I;
         I = I->Ops[0]->Ops[0];
+        Ops = DAG.getOps(DAG.getOps(Ops[0])[0]);
         switch (IOld->Ops[0]->K) {
           case souper::Inst::SAddWithOverflow:
           case souper::Inst::UAddWithOverflow:
@@ -918,13 +1010,12 @@ namespace souper {
       break;
     }
 
-    CRCache.emplace(I, Result);
-    return CRCache.at(I);
+    CRs[ID] = Result;
+    return Result;
   }
 #undef CR0
 #undef CR1
 #undef CR2
-#undef VAL
 
   llvm::ConstantRange ConstantRangeAnalysis::findConstantRangeUsingSolver
     (Inst *I, Solver *S, std::vector<InstMapping> &PCs) {
@@ -1490,6 +1581,11 @@ s.push(); s.add(ForAll(z, y != (x < z))); print("slt", s.check()); s.pop()
   }
 
   void ForcedValueAnalysis::countSymbolicInsts(Inst *I) {
+    // the counts of an inst don't change once known, and those of insts
+    // that threads share are filled in before the threads start, so they
+    // must not be written again
+    if (I->nReservedConsts != -1 && I->nHoles != -1)
+      return;
     I->nReservedConsts = isReservedConst(I) ? 1 : 0;
     I->nHoles = isHole(I) ? 1 : 0;
     for (auto Op : I->Ops) {
@@ -1,3 +1,5 @@
+#define DEBUG_TYPE "souper"
+
 #include "souper/Extractor/ExprBuilder.h"
 #include "souper/Infer/AliveDriver.h"
 #include "souper/Inst/Inst.h"
@@ -15,17 +17,23 @@
 #include "alive2/util/errors.h"
 #include "alive2/util/symexec.h"
 
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string_view>
 #include <unordered_set>
 #include <z3.h>
 
+STATISTIC(AliveSessionHits,
+          "Number of Alive2 verifications that reused a translated LHS");
+
 extern unsigned DebugLevel;
 static const int MaxTries = 30;
 
@@ -43,6 +51,11 @@ static llvm::cl::opt<bool> SkipAliveSolver("alive-skip-solver",
   llvm::cl::desc("Omit Alive solver calls for performance testing (default = false)"),
   llvm::cl::init(false));
 
+static llvm::cl::opt<unsigned> MaxAliveSessions("alive-max-sessions",
+  llvm::cl::desc("Number of translated LHSs kept to verify more RHSs "
+                 "against, 0 to keep none (default = 8)"),
+  llvm::cl::init(8));
+
 class FunctionBuilder {
 public:
   FunctionBuilder(IR::Function &F_) : F(F_) {}
@@ -351,9 +364,24 @@ synthesizeConstantUsingSolver(tools::Transform &t,
   return SynthesisResult;
 }
 
+// Alive2 keeps its SMT context in globals. The drivers that exist at the
+// same time share it, and the last of them to go takes it along.
+static std::shared_ptr<smt::smt_initializer> getSMTInitializer() {
+  static std::mutex Lock;
+  static std::weak_ptr<smt::smt_initializer> Current;
+  std::lock_guard<std::mutex> Guard(Lock);
+  auto Init = Current.lock();
+  if (!Init) {
+    Init = std::make_shared<smt::smt_initializer>();
+    Current = Init;
+  }
+  return Init;
+}
+
 souper::AliveDriver::AliveDriver(Inst *LHS_, Inst *PreCondition_, InstContext &IC_,
                                  std::vector<Inst *> ExtraInputs)
-    : LHS(LHS_), PreCondition(PreCondition_), IC(IC_) {
+    : LHS(LHS_), PreCondition(PreCondition_), IC(IC_),
+      SMTInit(getSMTInitializer()) {
   IsLHS = true;
   InstNumbers = 101;
   //FIXME: Magic number. 101 is chosen arbitrarily.
@@ -984,6 +1012,57 @@ std::unordered_set<RefinementProblem, RefinementProblem::Hash>
 }
 
 }
+// Alive2 keeps its solver context in globals, so callers that may run on
+// several threads take turns.
+static std::mutex AliveLock;
+
+namespace {
+// A driver kept by getAliveSession(). The context is told apart by its ID,
+// since a context created later may reuse the memory of one that is gone,
+// and with it the addresses of LHS and PreCondition. Sessions of contexts
+// that are gone are dropped on the next call.
+struct AliveSession {
+  unsigned ContextID;
+  souper::Inst *LHS, *PreCondition;
+  std::vector<souper::Inst *> ExtraInputs;
+  std::shared_ptr<souper::AliveDriver> Driver;
+};
+
+std::mutex SessionLock;
+// Least recently used first. Never destroyed, since by the time static
+// destructors run the globals of Alive2 that a driver needs may be gone.
+std::vector<AliveSession> &Sessions = *new std::vector<AliveSession>;
+}
+
+std::shared_ptr<souper::AliveDriver>
+souper::getAliveSession(souper::Inst *LHS, souper::Inst *PreCondition,
+                        InstContext &IC, std::vector<Inst *> ExtraInputs) {
+  std::lock_guard<std::mutex> Guard(SessionLock);
+  Sessions.erase(std::remove_if(Sessions.begin(), Sessions.end(),
+                                [](const AliveSession &S) {
+                                  return !InstContext::isLive(S.ContextID);
+                                }),
+                 Sessions.end());
+  for (auto It = Sessions.begin(); It != Sessions.end(); ++It) {
+    if (It->ContextID == IC.getID() && It->LHS == LHS &&
+        It->PreCondition == PreCondition && It->ExtraInputs == ExtraInputs) {
+      ++AliveSessionHits;
+      std::rotate(It, It + 1, Sessions.end());
+      return Sessions.back().Driver;
+    }
+  }
+
+  auto Driver = std::make_shared<AliveDriver>(LHS, PreCondition, IC,
+                                              ExtraInputs);
+  if (MaxAliveSessions == 0)
+    return Driver;
+  if (Sessions.size() >= MaxAliveSessions)
+    Sessions.erase(Sessions.begin());
+  Sessions.push_back({IC.getID(), LHS, PreCondition, std::move(ExtraInputs),
+                      Driver});
+  return Driver;
+}
+
 bool souper::isTransformationValid(souper::Inst *LHS, souper::Inst *RHS,
                                    const std::vector<InstMapping> &PCs,
                                    const souper::BlockPCs &BPCs,
@@ -1006,6 +1085,7 @@ bool souper::isTransformationValid(souper::Inst *LHS, souper::Inst *RHS,
     return false;
   if (DebugLevel > 3)
     llvm::errs() << "Number of sub-goals : " << Goals.size() << "\n";
+  std::lock_guard<std::mutex> Guard(AliveLock);
   for (auto Goal : Goals) {
     if (DebugLevel > 3) {
       llvm::errs() << "Goal:\n";
@@ -1013,10 +1093,16 @@ bool souper::isTransformationValid(souper::Inst *LHS, souper::Inst *RHS,
       RC.printInst(Goal.LHS, llvm::errs(), true);
       llvm::errs() << "\n------\n";
     }
-    std::vector<Inst *> Vars;
-    findVars(Goal.RHS, Vars);
-    AliveDriver Verifier(Goal.LHS, Goal.Pre, IC, Vars);
-    if (!Verifier.verify(Goal.RHS, Goal.Pre))
+    // Alive2 wants the same inputs on both sides
+    std::vector<Inst *> LHSVars, RHSVars, ExtraInputs;
+    findVars(Goal.LHS, LHSVars);
+    findVars(Goal.Pre, LHSVars);
+    findVars(Goal.RHS, RHSVars);
+    for (auto V : RHSVars)
+      if (std::find(LHSVars.begin(), LHSVars.end(), V) == LHSVars.end())
+        ExtraInputs.push_back(V);
+    auto Verifier = getAliveSession(Goal.LHS, Goal.Pre, IC, ExtraInputs);
+    if (!Verifier->verify(Goal.RHS, Goal.Pre))
       return false;
   }
   return true;
@@ -1027,6 +1113,7 @@ bool souper::isCandidateInfeasible(souper::Inst* RHS, souper::ValueCache& C,
                                    llvm::APInt LHSValue, InstContext &IC) {
 
   auto LHS = IC.getConst(LHSValue);
+  std::lock_guard<std::mutex> Guard(AliveLock);
   // TODO: Use PC
   AliveDriver Pruner(LHS, nullptr, IC);
 
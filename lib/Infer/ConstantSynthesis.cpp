@@ -16,7 +16,9 @@
 
 #include "llvm/ADT/APInt.h"
 #include "llvm/Support/CommandLine.h"
+#include "souper/Extractor/ExprBuilder.h"
 #include "souper/Infer/ConstantSynthesis.h"
+#include "souper/Infer/Counterexamples.h"
 #include "souper/Infer/Interpreter.h"
 #include "souper/Infer/Pruning.h"
 
@@ -30,6 +32,10 @@ namespace {
   static cl::opt<unsigned> MaxSpecializations("souper-constant-synthesis-max-num-specializations",
     cl::desc("Maximum number of input specializations in constant synthesis (default=15)."),
     cl::init(15));
+  static cl::opt<bool> IncrementalCEGIS("souper-constant-synthesis-incremental",
+    cl::desc("Keep the queries of constant synthesis loaded in the solver "
+             "across iterations, if the solver supports it (default=true)"),
+    cl::init(true));
 }
 
 namespace souper {
@@ -343,28 +349,85 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     }
   }
 
+  // counterexamples to earlier guesses are taken as if the second query
+  // had come up with them
+  if (Counterexamples) {
+    size_t Substitutions = 0;
+    for (auto &&VC : Counterexamples->getInputs()) {
+      if (Substitutions++ >= MaxSpecializations) {
+        break;
+      }
+      std::map<Inst *, llvm::APInt> VCCopy;
+      for (auto Pair : VC) {
+        VCCopy[Pair.first] = Pair.second.getValue();
+      }
+      std::map<Inst *, Inst *> InstCache;
+      std::map<Block *, Block *> BlockCache;
+      Inst *SubstLHS = getInstCopy(Mapping.LHS, IC, InstCache, BlockCache, &VCCopy, true);
+      Inst *SubstRHS = getInstCopy(Mapping.RHS, IC, InstCache, BlockCache, &VCCopy, true);
+      // the guess only has to match the LHS on the demanded bits, like in
+      // the verification query
+      if (!Mapping.LHS->DemandedBits.isAllOnesValue()) {
+        Inst *DemandedBits = IC.getConst(Mapping.LHS->DemandedBits);
+        SubstLHS = IC.getInst(Inst::And, SubstLHS->Width, {SubstLHS, DemandedBits});
+        SubstRHS = IC.getInst(Inst::And, SubstRHS->Width, {SubstRHS, DemandedBits});
+      }
+      Inst *Subst = IC.getInst(Inst::Eq, 1, {SubstLHS, SubstRHS});
+      SubstAnte = IC.getInst(Inst::And, 1, {Subst, SubstAnte});
+    }
+  }
+
   auto ConstConstraints = TrueConst;
   std::set<Inst *> Visited;
   visitConstants(Mapping.RHS, Visited, ConstConstraints, ConstSet, IC, AvoidNops);
 
+  // TriedAnte and SubstAnte only ever grow by conjuncts. A solver that can
+  // keep the first query loaded gets the new conjuncts as they come. The
+  // second query is checked in a context of its own too, which keeps the
+  // translation of the LHS from one guess to the next.
+  std::unique_ptr<SMTLIBSolver::IncrementalContext> FirstQuery, SecondQuery;
+  if (IncrementalCEGIS) {
+    FirstQuery = SMTSolver->createIncrementalContext();
+    SecondQuery = SMTSolver->createIncrementalContext();
+  }
+  if (FirstQuery && SecondQuery) {
+    Inst *Query = getQueryFormula(IC, BPCs, PCs,
+                                  InstMapping(Mapping.LHS, Mapping.RHS),
+                                  IC.getInst(Inst::And, 1,
+                                             {ConstConstraints, TriedAnte}),
+                                  true, true);
+    if (!Query) {
+      if (DebugLevel > 3)
+        llvm::errs() << "ConstantSynthesis: can't build the first query\n";
+      return std::make_error_code(std::errc::value_too_large);
+    }
+    FirstQuery->add(Query);
+    if (SubstAnte != TrueConst)
+      FirstQuery->add(SubstAnte);
+  } else {
+    FirstQuery.reset();
+    SecondQuery.reset();
+  }
+
   for (int I = 0; I < MaxTries; ++I)  {
     bool IsSat;
     std::vector<Inst *> ModelInstsFirstQuery;
     std::vector<llvm::APInt> ModelValsFirstQuery;
 
-    // TriedAnte /\ SubstAnte
-    Inst *FirstQueryAnte = IC.getInst(Inst::And, 1,
-                                      { ConstConstraints,
-                                        IC.getInst(Inst::And, 1, {SubstAnte, TriedAnte})});
-
-    std::string Query = BuildQuery(IC, BPCs, PCs, InstMapping(Mapping.LHS, Mapping.RHS),
-                                   &ModelInstsFirstQuery, FirstQueryAnte, true, true);
-
-    if (Query.empty())
-      return std::make_error_code(std::errc::value_too_large);
-
-    EC = SMTSolver->isSatisfiable(Query, IsSat, ModelInstsFirstQuery.size(),
-                                  &ModelValsFirstQuery, Timeout);
+    if (FirstQuery) {
+      EC = FirstQuery->check({}, IsSat, &ModelInstsFirstQuery,
+                             &ModelValsFirstQuery, Timeout);
+    } else {
+      // TriedAnte /\ SubstAnte
+      Inst *FirstQueryAnte = IC.getInst(Inst::And, 1,
+                                        { ConstConstraints,
+                                          IC.getInst(Inst::And, 1, {SubstAnte, TriedAnte})});
+
+      EC = SolveQuery(SMTSolver, IC, BPCs, PCs,
+                      InstMapping(Mapping.LHS, Mapping.RHS), IsSat,
+                      &ModelInstsFirstQuery, &ModelValsFirstQuery,
+                      FirstQueryAnte, Timeout, true, true);
+    }
 
     if (EC) {
       if (DebugLevel > 3)
@@ -405,6 +468,8 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       }
     }
     TriedAnte = IC.getInst(Inst::And, 1, {TriedAnte, TriedAnteLocal});
+    if (FirstQuery)
+      FirstQuery->add(TriedAnteLocal);
 
     std::map<Inst *, Inst *> InstCache;
     std::map<Block *, Block *> BlockCache;
@@ -426,20 +491,43 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     std::vector<Inst *> ModelInstsSecondQuery;
     std::vector<llvm::APInt> ModelValsSecondQuery;
 
-    Query = BuildQuery(IC, BPCs, PCs, InstMapping(Mapping.LHS, RHSCopy),
-                       &ModelInstsSecondQuery, 0);
-
-    if (Query.empty())
-      return std::make_error_code(std::errc::value_too_large);
+    // a known counterexample spares the solver the trouble of finding one
+    const ValueCache *Refutation = nullptr;
+    if (Counterexamples)
+      Refutation = Counterexamples->findRefutation(RHSCopy);
 
-    EC = SMTSolver->isSatisfiable(Query, IsSat, ModelInstsSecondQuery.size(),
-                                  &ModelValsSecondQuery, Timeout);
+    if (Refutation) {
+      if (DebugLevel > 3)
+        llvm::errs() << "second query skipped, a known counterexample refutes the guess\n";
+      IsSat = true;
+      for (auto &P : *Refutation) {
+        ModelInstsSecondQuery.push_back(P.first);
+        ModelValsSecondQuery.push_back(P.second.Value);
+      }
+    } else if (SecondQuery) {
+      // the guess is only assumed for this check; plugging it in as
+      // constants, rather than constraining symbolic ones, keeps the query
+      // as easy as the one SolveQuery() builds
+      Inst *Query = getQueryFormula(IC, BPCs, PCs,
+                                    InstMapping(Mapping.LHS, RHSCopy), 0);
+      if (Query)
+        EC = SecondQuery->check({Query}, IsSat, &ModelInstsSecondQuery,
+                                &ModelValsSecondQuery, Timeout);
+      else
+        EC = std::make_error_code(std::errc::value_too_large);
+    } else {
+      EC = SolveQuery(SMTSolver, IC, BPCs, PCs, InstMapping(Mapping.LHS, RHSCopy),
+                      IsSat, &ModelInstsSecondQuery, &ModelValsSecondQuery, 0,
+                      Timeout);
+    }
     if (EC) {
       if (DebugLevel > 3) {
         llvm::errs()<<"ConstantSynthesis: solver returns error on second query\n";
       }
       return EC;
     }
+    if (IsSat && !Refutation && Counterexamples)
+      Counterexamples->add(ModelInstsSecondQuery, ModelValsSecondQuery);
 
     if (!IsSat) {
       if (DebugLevel > 3) {
@@ -484,11 +572,12 @@ ConstantSynthesis::synthesize(SMTLIBSolver *SMTSolver,
                                   BlockCache, &SubstConstMap, true);
       }
 
-      SubstAnte = IC.getInst(Inst::And, 1,
-                             {IC.getInst(Inst::Eq, 1, {ConcreteLHS,
-                                                       getInstCopy(Mapping.RHS, IC, InstCache,
-                                                                   BlockCache, &SubstConstMap, true)}),
-                              SubstAnte});
+      Inst *Subst = IC.getInst(Inst::Eq, 1, {ConcreteLHS,
+                                             getInstCopy(Mapping.RHS, IC, InstCache,
+                                                         BlockCache, &SubstConstMap, true)});
+      SubstAnte = IC.getInst(Inst::And, 1, {Subst, SubstAnte});
+      if (FirstQuery)
+        FirstQuery->add(Subst);
     }
   }
 
@@ -0,0 +1,156 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Infer/Counterexamples.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <algorithm>
+#include <mutex>
+
+using namespace souper;
+using namespace llvm;
+
+namespace {
+  static cl::opt<unsigned> MaxCounterexamples("souper-max-counterexamples",
+    cl::desc("Maximum number of solver counterexamples kept per LHS to "
+             "refute guesses with, 0 to keep none (default=64)"),
+    cl::init(64));
+
+  // The counterexamples of every LHS seen so far, by structural hash. A
+  // row has a value for each input, in the order findVars() finds them,
+  // which is the same for all left-hand sides with the same hash.
+  std::mutex RegistryLock;
+  StringMap<std::vector<std::vector<APInt>>> Registry;
+
+  bool isUntrusted(Inst *I) {
+    return I->K == Inst::Phi || I->K == Inst::Freeze;
+  }
+}
+
+CounterexampleStore::CounterexampleStore(Inst *LHS, const BlockPCs &BPCs,
+                                         const std::vector<InstMapping> &PCs)
+  : LHS(LHS), PCs(PCs) {
+  Enabled = MaxCounterexamples > 0 && !hasGivenInst(LHS, isUntrusted);
+  for (auto &PC : PCs)
+    Enabled &= !hasGivenInst(PC.LHS, isUntrusted) &&
+               !hasGivenInst(PC.RHS, isUntrusted);
+  if (!Enabled)
+    return;
+
+  std::vector<Inst *> Found;
+  findVars(LHS, Found);
+  for (auto &PC : PCs) {
+    findVars(PC.LHS, Found);
+    findVars(PC.RHS, Found);
+  }
+  for (auto V : Found)
+    if (VarSet.insert(V).second)
+      Vars.push_back(V);
+
+  Key = GetReplacementLHSHash(BPCs, PCs, LHS).bytes();
+  std::vector<std::vector<APInt>> Known;
+  {
+    std::lock_guard<std::mutex> Guard(RegistryLock);
+    auto It = Registry.find(Key);
+    if (It != Registry.end())
+      Known = It->second;
+  }
+  for (auto &Row : Known)
+    addRow(Row);
+}
+
+bool CounterexampleStore::addRow(const std::vector<APInt> &Row) {
+  if (Inputs.size() >= MaxCounterexamples || Row.size() != Vars.size())
+    return false;
+  ValueCache Input;
+  for (unsigned I = 0; I != Vars.size(); ++I) {
+    if (Row[I].getBitWidth() != Vars[I]->Width)
+      return false;
+    Input.insert({Vars[I], Row[I]});
+  }
+  if (std::find(Rows.begin(), Rows.end(), Row) != Rows.end())
+    return false;
+
+  ConcreteInterpreter CI(LHS, Input);
+  for (auto &PC : PCs) {
+    auto L = CI.evaluateInst(PC.LHS);
+    auto R = CI.evaluateInst(PC.RHS);
+    if (!L.hasValue() || !R.hasValue() || L.getValue() != R.getValue())
+      return false;
+  }
+  auto V = CI.evaluateInst(LHS);
+  if (!V.hasValue())
+    return false;
+
+  Inputs.push_back(Input);
+  Rows.push_back(Row);
+  Interpreters.push_back(CI);
+  LHSVals.push_back(V.getValue());
+  return true;
+}
+
+bool CounterexampleStore::add(const std::vector<Inst *> &ModelVars,
+                              const std::vector<APInt> &ModelVals) {
+  if (!Enabled)
+    return false;
+  std::vector<APInt> Row;
+  for (auto V : Vars) {
+    auto It = std::find(ModelVars.begin(), ModelVars.end(), V);
+    if (It == ModelVars.end())
+      return false;
+    Row.push_back(ModelVals[It - ModelVars.begin()]);
+  }
+  if (!addRow(Row))
+    return false;
+
+  std::lock_guard<std::mutex> Guard(RegistryLock);
+  auto &Known = Registry[Key];
+  if (Known.size() < MaxCounterexamples &&
+      std::find(Known.begin(), Known.end(), Row) == Known.end())
+    Known.push_back(Row);
+  return true;
+}
+
+bool CounterexampleStore::canEvaluate(Inst *RHS) {
+  return !hasGivenInst(RHS, [this](Inst *I) {
+    switch (I->K) {
+    case Inst::Var:
+      // synthesis constants are not among the inputs either
+      return !VarSet.count(I);
+    case Inst::ReservedConst:
+    case Inst::ReservedInst:
+    case Inst::Hole:
+      return true;
+    default:
+      return isUntrusted(I);
+    }
+  });
+}
+
+const ValueCache *CounterexampleStore::findRefutation(Inst *RHS) {
+  if (Inputs.empty() || RHS->Width != LHS->Width || !canEvaluate(RHS))
+    return nullptr;
+  for (unsigned I = 0; I != Inputs.size(); ++I) {
+    auto V = Interpreters[I].evaluateInst(RHS);
+    // only the demanded bits of the LHS have to match
+    if (V.hasValue() &&
+        !((V.getValue() ^ LHSVals[I]) & LHS->DemandedBits).isNullValue()) {
+      ++Refuted;
+      return &Inputs[I];
+    }
+  }
+  return nullptr;
+}
@@ -12,21 +12,38 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define DEBUG_TYPE "souper"
+
 #include "llvm/ADT/APInt.h"
 #include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Support/CommandLine.h"
 #include "souper/Infer/AliveDriver.h"
 #include "souper/Infer/ConstantSynthesis.h"
+#include "souper/Infer/Counterexamples.h"
 #include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/Infer/Pruning.h"
 
+#include <atomic>
+#include <chrono>
 #include <queue>
 #include <functional>
 #include <set>
+#include <thread>
 
 static const unsigned MaxTries = 30;
 static const unsigned MaxInputSpecializationTries = 2;
 
+STATISTIC(NarrowAttempts, "Number of LHSs synthesized at reduced width first");
+STATISTIC(NarrowSolved, "Number of LHSs solved by reduced-width synthesis");
+STATISTIC(NarrowCandidates,
+          "Number of reduced-width results lifted to full width");
+STATISTIC(NarrowFalseCandidates,
+          "Number of lifted results that full-width verification refuted");
+STATISTIC(NarrowMicros,
+          "Microseconds spent in reduced-width synthesis and lifting");
+STATISTIC(FullWidthMicros, "Microseconds spent in full-width synthesis");
+
 bool UseAlive;
 extern unsigned DebugLevel;
 
@@ -100,6 +117,18 @@ namespace {
   static cl::opt<bool> OnlyInferIN("souper-only-infer-iN",
     cl::desc("Only infer integer constants (default=false)"),
     cl::init(false));
+  static cl::opt<bool> RefuteGuesses("souper-enumerative-synthesis-refute",
+    cl::desc("Drop concrete guesses that differ from the LHS on one of the "
+             "pruning inputs without verifying them (default=true)"),
+    cl::init(true));
+  static cl::opt<unsigned> Jobs("souper-enumerative-synthesis-jobs",
+    cl::desc("Number of threads that enumerate and prune guesses "
+             "(default=1)"),
+    cl::init(1));
+  static cl::opt<unsigned> NarrowWidth("souper-enumerative-synthesis-narrow-width",
+    cl::desc("Synthesize for a copy of a wider LHS narrowed to this width "
+             "first, and lift the results back, 0 to disable (default=0)"),
+    cl::init(0));
 }
 
 // TODO
@@ -130,7 +159,6 @@ namespace {
 // test against CEGIS with LHS components
 // test the width matching stuff
 // take outside uses into account -- only in the cost model?
-// experiment with synthesizing at reduced bitwidth, then expanding the result
 // aggressively avoid calling into the solver
 
 void addGuess(Inst *RHS, unsigned TargetWidth, InstContext &IC, int MaxCost, std::vector<Inst *> &Guesses,
@@ -179,14 +207,52 @@ void sortGuesses(Container &Guesses) {
                    });
 }
 
-using CallbackType = std::function<bool(Inst *)>;
+// Evaluates concrete guesses on the inputs of the PruningManager, all of
+// which satisfy the PCs. A guess whose value differs from that of the LHS,
+// in a demanded bit, on one of these inputs can't be valid, so it is
+// dropped without asking the solver.
+class GuessRefuter {
+  BatchInterpreter Interpreter;
+  std::vector<EvalValue> LHSVals;
+  llvm::APInt DemandedBits;
+
+public:
+  unsigned Refuted = 0;
+
+  GuessRefuter(Inst *LHS, std::vector<ValueCache> &InputVals)
+    : Interpreter(LHS, InputVals), DemandedBits(LHS->DemandedBits) {
+    LHSVals = Interpreter.evaluateInst(LHS);
+  }
 
-bool getGuesses(const std::vector<Inst *> &Inputs,
-                int Width, int LHSCost,
-                InstContext &IC, Inst *PrevInst, Inst *PrevSlot,
-                int &TooExpensive,
-                PruneFunc prune, CallbackType Generate) {
+  // Returns true if one of the inputs shows that Guess is not a valid RHS.
+  bool isRefuted(Inst *Guess) {
+    std::set<Inst *> ConstSet;
+    souper::getConstants(Guess, ConstSet);
+    if (!ConstSet.empty())
+      return false;
+
+    std::vector<EvalValue> Vals = Interpreter.evaluateInst(Guess);
+    for (unsigned I = 0; I != Vals.size(); ++I) {
+      if (Vals[I].hasValue() && LHSVals[I].hasValue() &&
+          !((Vals[I].Value ^ LHSVals[I].Value) & DemandedBits).isNullValue()) {
+        ++Refuted;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+using CallbackType = std::function<bool(Inst *)>;
 
+// Returns the insts that can fill PrevSlot in PrevInst, or be the root of
+// a guess if there is no PrevInst: conversions of the inputs, and
+// instructions whose operands are inputs, constants or new holes.
+std::vector<Inst *> getPartialGuesses(const std::vector<Inst *> &Inputs,
+                                      int Width, int LHSCost,
+                                      InstContext &IC, Inst *PrevInst,
+                                      Inst *PrevSlot, int &TooExpensive,
+                                      llvm::Optional<Inst::Kind> RootKind) {
   std::vector<Inst *> unaryHoleUsers;
   findInsts(PrevInst, unaryHoleUsers, [PrevSlot](Inst *I) {
     return I->Ops.size() == 1 && I->Ops[0] == PrevSlot;
@@ -489,55 +555,299 @@ bool getGuesses(const std::vector<Inst *> &Inputs,
       }
     }
   }
+  // a parallel enumeration splits the work by the kind of the root
+  if (RootKind)
+    PartialGuesses.erase(std::remove_if(PartialGuesses.begin(),
+                                        PartialGuesses.end(),
+                                        [&RootKind](Inst *I) {
+                                          return I->K != *RootKind;
+                                        }),
+                         PartialGuesses.end());
+
+  // the order of the partial guesses breaks ties between complete guesses
+  // of equal cost below
   sortGuesses(PartialGuesses);
-  //FIXME: This is a bit heavy-handed. Find a way to eliminate this sorting.
-
-  for (auto I : PartialGuesses) {
-    Inst *JoinedGuess;
-    // if it is the first time the function getGuesses() gets called, then
-    // leave it as the root and do not plug it to any other insts
-    if (!PrevInst)
-      JoinedGuess = I;
-    else {
-      // plugin the new guess I to PrevInst
-      std::map<Inst *, Inst *> InstCache;
-      JoinedGuess = instJoin(PrevInst, PrevSlot, I, InstCache, IC);
+  return PartialGuesses;
+}
+
+// A lower bound on the cost of every guess that fills the holes of Guess.
+// Filling the holes may make two subtrees equal, and the InstContext then
+// merges them, so the cost of Guess less its holes is not a bound. The
+// hole-free insts are kept, and stay distinct from each other, so all of
+// their costs count. Of the insts above a hole, the ones on a path from the
+// root down to a hole stay distinct from each other and from the insts below
+// them; one may still become a hole-free inst elsewhere in Guess, so only
+// those of a kind and width that no hole-free inst has count, and the root,
+// which is above every other inst. The bound takes the path that costs most.
+static int getMinCost(Inst *Guess) {
+  std::map<Inst *, bool> HasHole;
+  std::function<bool(Inst *)> FindHoles = [&](Inst *I) {
+    auto It = HasHole.find(I);
+    if (It != HasHole.end())
+      return It->second;
+    bool Found = I->K == Inst::Hole;
+    for (auto Op : I->Ops)
+      Found |= FindHoles(Op);
+    return HasHole[I] = Found;
+  };
+  FindHoles(Guess);
+
+  int Cost = 0;
+  std::set<std::pair<Inst::Kind, unsigned>> HoleFreeKinds;
+  for (auto &Entry : HasHole) {
+    if (Entry.second)
+      continue;
+    Cost += Inst::getCost(Entry.first->K);
+    HoleFreeKinds.insert({Entry.first->K, Entry.first->Width});
+  }
+
+  std::map<Inst *, int> PathCost;
+  std::function<int(Inst *)> MaxPathCost = [&](Inst *I) {
+    if (I->K == Inst::Hole)
+      return 0;
+    auto It = PathCost.find(I);
+    if (It != PathCost.end())
+      return It->second;
+    int Max = 0;
+    for (auto Op : I->Ops)
+      if (HasHole[Op])
+        Max = std::max(Max, MaxPathCost(Op));
+    if (I == Guess || !HoleFreeKinds.count({I->K, I->Width}))
+      Max += Inst::getCost(I->K);
+    return PathCost[I] = Max;
+  };
+  return Cost + MaxPathCost(Guess);
+}
+
+// A guess in the queue of getGuesses(). For a complete guess MinCost is its
+// cost, and for one with holes it is the bound of getMinCost(), which no
+// guess that fills the holes costs less than. Path has the index of the
+// partial guess used at each step; in a depth-first enumeration the guesses
+// would come in increasing order of their paths.
+struct QueuedGuess {
+  Inst *Guess;
+  // the hole to fill next, null for a complete guess
+  Inst *Slot;
+  int MinCost;
+  std::vector<unsigned> Path;
+};
+
+// Orders the queue by MinCost. At equal cost, partial guesses come first,
+// so that a complete guess comes out only once every partial guess that
+// could still lead to a guess of that cost has been expanded, and then in
+// the order of a depth-first enumeration. When the cost is ignored, the
+// whole enumeration is depth-first.
+struct QueuedGuessCompare {
+  bool operator()(const QueuedGuess &A, const QueuedGuess &B) const {
+    if (!IgnoreCost) {
+      if (A.MinCost != B.MinCost)
+        return A.MinCost > B.MinCost;
+      if ((A.Slot == nullptr) != (B.Slot == nullptr))
+        return A.Slot == nullptr;
     }
+    return A.Path > B.Path;
+  }
+};
 
-    // get all empty slots from the newly plugged inst
-    std::vector<Inst *> CurrSlots;
-    getHoles(JoinedGuess, CurrSlots);
-    //FIXME: This is inefficient, to do for each symbolic and concrete candidate
-
-    // if no empty slot, then push the guess to the result list
-    if (CurrSlots.empty()) {
-      std::vector<Inst *> empty;
-      if (prune(JoinedGuess, empty)) {
-        std::vector<Inst *> ConcreteTypedGuesses;
-        addGuess(JoinedGuess, JoinedGuess->Width, IC, LHSCost, ConcreteTypedGuesses, TooExpensive);
-        for (auto &&Guess : ConcreteTypedGuesses) {
-          if (!Generate(Guess)) {
-            return false;
-          }
+// Enumerates the guesses best-first and passes each one that survives
+// pruning to Generate in nondecreasing cost order: when a complete guess
+// comes out of the queue, every guess still to come fills the holes of a
+// queued guess whose MinCost is at least as high. The queue holds the
+// guesses that still have holes, and the complete guesses that are not yet
+// the cheapest left. Returns false if Generate asked to stop.
+bool getGuesses(const std::vector<Inst *> &Inputs,
+                int Width, int LHSCost,
+                InstContext &IC, int &TooExpensive,
+                PruneFunc prune, CallbackType Generate,
+                llvm::Optional<Inst::Kind> RootKind = llvm::None) {
+  std::priority_queue<QueuedGuess, std::vector<QueuedGuess>,
+                      QueuedGuessCompare> Queue;
+
+  auto Expand = [&](const QueuedGuess *Prev) {
+    Inst *PrevInst = Prev ? Prev->Guess : nullptr;
+    Inst *PrevSlot = Prev ? Prev->Slot : nullptr;
+    int SlotWidth = Prev ? PrevSlot->Width : Width;
+    // The roots of every kind are made before those of other kinds than
+    // RootKind are dropped; the caller counts them only once.
+    int RootTooExpensive = 0;
+    std::vector<Inst *> PartialGuesses =
+      getPartialGuesses(Inputs, SlotWidth, LHSCost, IC, PrevInst, PrevSlot,
+                        Prev || !RootKind ? TooExpensive : RootTooExpensive,
+                        Prev ? llvm::None : RootKind);
+
+    for (unsigned Index = 0; Index != PartialGuesses.size(); ++Index) {
+      Inst *I = PartialGuesses[Index];
+      std::vector<unsigned> Path = Prev ? Prev->Path : std::vector<unsigned>();
+      Path.push_back(Index);
+
+      Inst *JoinedGuess;
+      // at the root there is nothing to plug the new guess I into
+      if (!PrevInst)
+        JoinedGuess = I;
+      else {
+        std::map<Inst *, Inst *> InstCache;
+        JoinedGuess = instJoin(PrevInst, PrevSlot, I, InstCache, IC);
+      }
+
+      std::vector<Inst *> CurrSlots;
+      getHoles(JoinedGuess, CurrSlots);
+
+      if (CurrSlots.empty()) {
+        std::vector<Inst *> empty;
+        if (prune(JoinedGuess, empty)) {
+          std::vector<Inst *> ConcreteTypedGuesses;
+          addGuess(JoinedGuess, JoinedGuess->Width, IC, LHSCost,
+                   ConcreteTypedGuesses, TooExpensive);
+          for (auto &&Guess : ConcreteTypedGuesses)
+            Queue.push({Guess, nullptr, souper::cost(Guess), Path});
         }
+        continue;
+      }
+
+      if (prune(JoinedGuess, CurrSlots)) {
+        // TODO: replace this naive hole selection with some better algorithms
+        Queue.push({JoinedGuess, CurrSlots.front(), getMinCost(JoinedGuess),
+                    std::move(Path)});
       }
-      continue;
     }
+  };
 
-    // if there exist empty slots, then call getGuesses() recursively
-    // and fill the empty slots
-    if (prune(JoinedGuess, CurrSlots)) {
-      // TODO: replace this naive hole selection with some better algorithms
-      if (!getGuesses(Inputs, CurrSlots.front()->Width,
-                      LHSCost, IC, JoinedGuess,
-                      CurrSlots.front(), TooExpensive, prune, Generate)) {
+  Expand(nullptr);
+  while (!Queue.empty()) {
+    QueuedGuess Next = Queue.top();
+    Queue.pop();
+    if (!Next.Slot) {
+      if (!Generate(Next.Guess))
         return false;
-      }
+      continue;
     }
+    Expand(&Next);
   }
   return true;
 }
 
+// Rebuilds a guess that was enumerated in a scratch InstContext in IC. The
+// insts in Shared, which come from the LHS, are used as they are.
+Inst *adoptGuess(Inst *I, InstContext &IC, const std::set<Inst *> &Shared,
+                 std::map<Inst *, Inst *> &InstCache) {
+  if (Shared.count(I))
+    return I;
+  auto It = InstCache.find(I);
+  if (It != InstCache.end())
+    return It->second;
+
+  Inst *Copy;
+  if (I->K == Inst::Var) {
+    assert(I->SynthesisConstID != 0 && "unexpected var in guess");
+    Copy = IC.createSynthesisConstant(I->Width, I->SynthesisConstID);
+  } else if (I->K == Inst::Const) {
+    Copy = IC.getConst(I->Val);
+  } else {
+    std::vector<Inst *> Ops;
+    for (auto Op : I->Ops)
+      Ops.push_back(adoptGuess(Op, IC, Shared, InstCache));
+    Copy = IC.getInst(I->K, I->Width, Ops, I->DemandedBits, I->Available);
+  }
+  InstCache[I] = Copy;
+  return Copy;
+}
+
+// Enumerates and prunes the guesses on up to Jobs threads. The work is
+// split by the kind of the root of the guess; the threads take the kinds
+// one at a time, and each works in an InstContext and with pruners of its
+// own. The guesses that survive are rebuilt in SC.IC and returned in
+// increasing cost order.
+std::vector<Inst *> getGuessesInParallel(SynthesisContext &SC,
+                                         const std::vector<Inst *> &Cands,
+                                         int LHSCost,
+                                         PruningManager &DataflowPruning,
+                                         int &TooExpensive) {
+  int Width = SC.LHS->Width;
+
+  // find the kinds with a dry run that stops at the roots, and count the
+  // roots that are too expensive there
+  std::vector<Inst::Kind> Kinds;
+  {
+    InstContext DryIC;
+    getGuesses(Cands, Width, LHSCost, DryIC, TooExpensive,
+               [&Kinds](Inst *I, std::vector<Inst *> &RI) {
+                 if (std::find(Kinds.begin(), Kinds.end(), I->K) ==
+                     Kinds.end())
+                   Kinds.push_back(I->K);
+                 return false;
+               },
+               [](Inst *Guess) { return true; });
+  }
+
+  // The threads share the insts of the LHS, and their contexts hand them
+  // out like SC.IC would, so that a guess that rebuilds part of the LHS is
+  // pruned and costed as in a serial enumeration. Fill in the facts that
+  // the analyses memoize in them now, so that no thread writes to them:
+  // isConcrete() sets the counts of symbolic constants and holes that the
+  // forced value analysis would otherwise set, and orderedOps() memoizes
+  // the sorted operands.
+  std::vector<Inst *> LHSInsts;
+  findInsts(SC.LHS, LHSInsts, [](Inst *I) { return true; });
+  for (auto I : LHSInsts) {
+    isConcrete(I);
+    I->orderedOps();
+  }
+
+  std::vector<std::unique_ptr<InstContext>> ScratchICs;
+  std::vector<std::vector<Inst *>> Survivors(Kinds.size());
+  std::atomic<size_t> Next(0);
+  std::atomic<int> ThreadsTooExpensive(0);
+  auto Worker = [&](InstContext &LocalIC) {
+    SynthesisContext LocalSC{LocalIC, SC.SMTSolver, SC.LHS, SC.LHSUB,
+        SC.PCs, SC.BPCs, SC.CheckAllGuesses, SC.Timeout};
+    std::vector<Inst *> LocalInputs;
+    findVars(SC.LHS, LocalInputs);
+    PruningManager LocalPruning(LocalSC, LocalInputs, DebugLevel);
+
+    std::set<Inst*> Visited(Cands.begin(), Cands.end());
+    std::vector<PruneFunc> PruneFuncs = { [&Visited](Inst *I, std::vector<Inst*> &ReservedInsts)  {
+      return CountPrune(I, ReservedInsts, Visited);
+    }};
+    if (EnableDataflowPruning) {
+      LocalPruning.initFrom(DataflowPruning);
+      PruneFuncs.push_back(LocalPruning.getPruneFunc());
+    }
+    auto PruneCallback = MkPruneFunc(PruneFuncs);
+
+    int LocalTooExpensive = 0;
+    for (size_t J = Next++; J < Kinds.size(); J = Next++) {
+      getGuesses(Cands, Width, LHSCost, LocalIC, LocalTooExpensive,
+                 PruneCallback,
+                 [&Survivors, J](Inst *Guess) {
+                   Survivors[J].push_back(Guess);
+                   return true;
+                 }, Kinds[J]);
+    }
+    ThreadsTooExpensive += LocalTooExpensive;
+  };
+  std::vector<std::thread> Threads;
+  for (unsigned I = 0; I < std::min<size_t>(Jobs, Kinds.size()); ++I) {
+    ScratchICs.emplace_back(new InstContext);
+    ScratchICs.back()->share(SC.IC, LHSInsts);
+    Threads.emplace_back(Worker, std::ref(*ScratchICs.back()));
+  }
+  for (auto &T : Threads)
+    T.join();
+  TooExpensive += ThreadsTooExpensive;
+
+  std::set<Inst *> Shared(LHSInsts.begin(), LHSInsts.end());
+
+  std::vector<Inst *> Guesses;
+  for (auto &KindGuesses : Survivors) {
+    for (auto Guess : KindGuesses) {
+      std::map<Inst *, Inst *> InstCache;
+      Guesses.push_back(adoptGuess(Guess, SC.IC, Shared, InstCache));
+    }
+  }
+  sortGuesses(Guesses);
+  return Guesses;
+}
+
 Inst *findConst(souper::Inst *I,
                 std::set<const Inst *> &Visited) {
   if (I->K == Inst::Var && I->SynthesisConstID != 0) {
@@ -581,10 +891,9 @@ bool canDifferInLSB(SynthesisContext &SC, Inst *RHSGuess) {
 
   InstMapping NewMapping{NewLHS, NewRHS};
 
-  auto Query = BuildQuery(SC.IC, SC.BPCs, SC.PCs, NewMapping, 0, 0);
-
   bool QueryIsSat;
-  auto EC = SC.SMTSolver->isSatisfiable(Query, QueryIsSat, 0, 0, SC.Timeout);
+  auto EC = SolveQuery(SC.SMTSolver, SC.IC, SC.BPCs, SC.PCs, NewMapping,
+                       QueryIsSat, 0, 0, 0, SC.Timeout);
   if (EC) {
     if (DebugLevel > 1)
       llvm::errs() << "Solver error in LSB pruning!\n";
@@ -608,32 +917,32 @@ std::error_code synthesizeWithAlive(SynthesisContext &SC, std::vector<Inst *> &R
     Ante = SC.IC.getInst(Inst::And, 1, {Ante, Eq});
   }
 
-  AliveDriver Verifier(SC.LHS, Ante, SC.IC);
+  auto Verifier = getAliveSession(SC.LHS, Ante, SC.IC);
   Inst *RHS;
   for (auto &&G : Guesses) {
     std::set<const Inst *> Visited;
     auto C = findConst(G, Visited);
     if (!C) {
-      if (Verifier.verify(G)) {
+      if (Verifier->verify(G)) {
         RHS = G;
       } else {
         continue;
       }
     } else {
       if (SynthesisConstWithCegisLoop) {
-        auto ConstMap = Verifier.synthesizeConstantsWithCegis(G, SC.IC);
+        auto ConstMap = Verifier->synthesizeConstantsWithCegis(G, SC.IC);
         if (ConstMap.empty())
           continue;
         auto GWithC = getInstCopy(G, SC.IC, InstCache, BlockCache, &ConstMap,
                                   /*CloneVars=*/false);
         RHS = GWithC;
       } else {
-        auto ConstMap = Verifier.synthesizeConstants(G);
+        auto ConstMap = Verifier->synthesizeConstants(G);
         // TODO: Counterexample guided loop or UB constraints in query
 
         auto GWithC = getInstCopy(G, SC.IC, InstCache, BlockCache, &ConstMap,
                                   /*CloneVars=*/false);
-        if (Verifier.verify(GWithC)) {
+        if (Verifier->verify(GWithC)) {
           RHS = GWithC;
         } else {
           continue;
@@ -655,21 +964,29 @@ std::error_code synthesizeWithAlive(SynthesisContext &SC, std::vector<Inst *> &R
   return EC;
 }
 
-std::error_code isConcreteCandidateSat(SynthesisContext &SC, Inst *RHSGuess, bool &IsSat) {
+std::error_code isConcreteCandidateSat(SynthesisContext &SC, Inst *RHSGuess, bool &IsSat,
+                                       CounterexampleStore &Counterexamples) {
   std::error_code EC;
   InstMapping Mapping(SC.LHS, RHSGuess);
 
-  std::string Query2 = BuildQuery(SC.IC, SC.BPCs, SC.PCs, Mapping, 0, 0);
-
-  EC = SC.SMTSolver->isSatisfiable(Query2, IsSat, 0, 0, SC.Timeout);
+  // the model, if any, is kept to refute later guesses with
+  std::vector<Inst *> ModelVars;
+  std::vector<llvm::APInt> ModelVals;
+  bool WantModel = Counterexamples.isEnabled();
+  EC = SolveQuery(SC.SMTSolver, SC.IC, SC.BPCs, SC.PCs, Mapping, IsSat,
+                  WantModel ? &ModelVars : 0, WantModel ? &ModelVals : 0,
+                  0, SC.Timeout);
   if (EC && DebugLevel > 1) {
     llvm::errs() << "verification query failed!\n";
   }
+  if (!EC && IsSat && WantModel)
+    Counterexamples.add(ModelVars, ModelVals);
   return EC;
 }
 
 std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RHSs,
-                                   const std::vector<souper::Inst *> &Guesses) {
+                                   const std::vector<souper::Inst *> &Guesses,
+                                   CounterexampleStore &Counterexamples) {
   std::error_code EC;
 
   // find the valid one
@@ -683,6 +1000,39 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RH
     llvm::errs() << S << "\n";
   }
 
+  // Check the guesses without constants as one batch up front; the ones it
+  // leaves unsolved are checked one at a time below. Guesses that a known
+  // counterexample refutes don't go to the solver at all. Unless all guesses
+  // are wanted, the batch stops at the first guess with constants: that one
+  // may succeed, and then nothing after it would have been checked.
+  std::vector<Inst *> ConcreteGuesses;
+  std::map<Inst *, bool> BatchResults;
+  for (auto I : Guesses) {
+    std::set<Inst *> ConstSet;
+    souper::getConstants(I, ConstSet);
+    if (!ConstSet.empty()) {
+      if (!SC.CheckAllGuesses)
+        break;
+      continue;
+    }
+    if (Counterexamples.findRefutation(I))
+      BatchResults[I] = true;
+    else
+      ConcreteGuesses.push_back(I);
+  }
+  if (ConcreteGuesses.size() > 1) {
+    std::vector<llvm::Optional<bool>> IsSat;
+    EC = SolveQueryBatch(SC.SMTSolver, SC.IC, SC.BPCs, SC.PCs, SC.LHS,
+                         ConcreteGuesses, IsSat, !SC.CheckAllGuesses,
+                         SC.Timeout);
+    if (EC && DebugLevel > 1)
+      llvm::errs() << "batch verification stopped: " << EC.message() << "\n";
+    for (unsigned J = 0; J != ConcreteGuesses.size(); ++J)
+      if (IsSat[J].hasValue())
+        BatchResults[ConcreteGuesses[J]] = IsSat[J].getValue();
+    EC = std::error_code();
+  }
+
   for (auto I : Guesses) {
     GuessIndex++;
     if (DebugLevel > 2) {
@@ -701,9 +1051,16 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RH
     if (!GuessHasConstant) {
       bool IsSAT;
 
-      EC = isConcreteCandidateSat(SC, I, IsSAT);
-      if (EC)
-        return EC;
+      auto It = BatchResults.find(I);
+      if (It != BatchResults.end()) {
+        IsSAT = It->second;
+      } else if (Counterexamples.findRefutation(I)) {
+        IsSAT = true;
+      } else {
+        EC = isConcreteCandidateSat(SC, I, IsSAT, Counterexamples);
+        if (EC)
+          return EC;
+      }
       if (IsSAT) {
         if (DebugLevel > 3)
           llvm::errs() << "second query is SAT-- constant doesn't work\n";
@@ -715,7 +1072,7 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RH
       }
     } else {
       // guess has constant(s)
-      ConstantSynthesis CS;
+      ConstantSynthesis CS{/*Pruner=*/nullptr, &Counterexamples};
       EC = CS.synthesize(SC.SMTSolver, SC.BPCs, SC.PCs, InstMapping (SC.LHS, I), ConstSet,
                          ResultConstMap, SC.IC, /*MaxTries=*/MaxTries, SC.Timeout,
                          /*AvoidNops=*/true);
@@ -779,21 +1136,22 @@ std::error_code synthesizeWithKLEE(SynthesisContext &SC, std::vector<Inst *> &RH
 }
 
 std::error_code verify(SynthesisContext &SC, std::vector<Inst *> &RHSs,
-                       const std::vector<souper::Inst *> &Guesses) {
+                       const std::vector<souper::Inst *> &Guesses,
+                       CounterexampleStore &Counterexamples) {
   std::error_code EC;
   if (SkipSolver || Guesses.empty())
     return EC;
 
   return UseAlive ? synthesizeWithAlive(SC, RHSs, Guesses) :
-                    synthesizeWithKLEE(SC, RHSs, Guesses);
+                    synthesizeWithKLEE(SC, RHSs, Guesses, Counterexamples);
 }
 
-std::error_code
-EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
-                                const BlockPCs &BPCs,
-                                const std::vector<InstMapping> &PCs,
-                                Inst *LHS, std::vector<Inst *> &RHSs,
-                                bool CheckAllGuesses, InstContext &IC, unsigned Timeout) {
+std::error_code enumerateAndVerify(SMTLIBSolver *SMTSolver,
+                                   const BlockPCs &BPCs,
+                                   const std::vector<InstMapping> &PCs,
+                                   Inst *LHS, std::vector<Inst *> &RHSs,
+                                   bool CheckAllGuesses, InstContext &IC,
+                                   unsigned Timeout) {
   if ((OnlyInferI1 || OnlyInferIN) && MaxNumInstructions >= 1)
     llvm::report_fatal_error("Sorry, it is an error to synthesize >= 1 instructions "
                              "in integer-only mode");
@@ -828,13 +1186,41 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
   }
   auto PruneCallback = MkPruneFunc(PruneFuncs);
 
+  // Counterexamples from earlier synthesis for this LHS, and those that
+  // verification comes up with, also go to the pruner, which then tries
+  // them on the guesses that are yet to be enumerated.
+  CounterexampleStore Counterexamples(SC.LHS, SC.BPCs, SC.PCs);
+  size_t NumFed = 0;
+  auto FeedPruner = [&Counterexamples, &NumFed, &DataflowPruning]() {
+    if (!EnableDataflowPruning)
+      return;
+    auto &Inputs = Counterexamples.getInputs();
+    for (; NumFed < Inputs.size(); ++NumFed)
+      DataflowPruning.addInput(Inputs[NumFed]);
+  };
+  FeedPruner();
+
+  // The concrete interpreter only follows the first branch of a phi, so
+  // its values are not to be trusted for an LHS that has one
+  std::unique_ptr<GuessRefuter> Refuter;
+  if (RefuteGuesses && MaxNumInstructions > 0 &&
+      !hasGivenInst(SC.LHS, [](Inst *I) { return I->K == Inst::Phi; })) {
+    if (!EnableDataflowPruning)
+      DataflowPruning.init();
+    Refuter.reset(new GuessRefuter(SC.LHS, DataflowPruning.getInputVals()));
+  }
+
   std::vector<Inst *> Guesses;
 
-  auto Generate = [&SC, &Guesses, &RHSs, &EC](Inst *Guess) {
+  auto Generate = [&SC, &Guesses, &RHSs, &EC, &Refuter, &Counterexamples,
+                   &FeedPruner](Inst *Guess) {
+    if (Refuter && Refuter->isRefuted(Guess))
+      return true;
     Guesses.push_back(Guess);
     if (Guesses.size() >= MaxV && !SkipSolver) {
       sortGuesses(Guesses);
-      EC = verify(SC, RHSs, Guesses);
+      EC = verify(SC, RHSs, Guesses, Counterexamples);
+      FeedPruner();
       Guesses.clear();
       return SC.CheckAllGuesses || (!SC.CheckAllGuesses && RHSs.empty()); // Continue if no RHS
     }
@@ -854,17 +1240,29 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
     }
   }
 
-  if (MaxNumInstructions > 0)
-    getGuesses(Cands, SC.LHS->Width,
-               LHSCost, SC.IC, nullptr, nullptr, TooExpensive, PruneCallback, Generate);
+  if (MaxNumInstructions > 0 && Jobs > 1) {
+    // all guesses are enumerated before the first one is verified
+    for (auto Guess : getGuessesInParallel(SC, Cands, LHSCost,
+                                           DataflowPruning, TooExpensive))
+      if (!Generate(Guess))
+        break;
+  } else if (MaxNumInstructions > 0) {
+    getGuesses(Cands, SC.LHS->Width, LHSCost, SC.IC, TooExpensive,
+               PruneCallback, Generate);
+  }
 
   if (!Guesses.empty() && !SkipSolver) {
     sortGuesses(Guesses);
-    EC = verify(SC, RHSs, Guesses);
+    EC = verify(SC, RHSs, Guesses, Counterexamples);
   }
 
   if (DebugLevel > 1) {
     DataflowPruning.printStats(llvm::errs());
+    if (Refuter)
+      llvm::errs() << "Concrete inputs refuted " << Refuter->Refuted
+                   << " guesses\n";
+    llvm::errs() << "Counterexamples refuted " << Counterexamples.Refuted
+                 << " guesses\n";
     llvm::errs() << "There are " << Guesses.size() << " Guesses\n";
   }
 
@@ -881,3 +1279,108 @@ EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
 
   return EC;
 }
+
+// Synthesizes for a copy of the LHS narrowed to NarrowWidth bits, where
+// queries and pruning are much cheaper, and lifts the results back to the
+// width of the LHS. A lifted result is verified at full width, first with
+// the synthesized constants sign-extended, then with constants synthesized
+// anew in case they only worked at the narrow width. Returns false if the
+// LHS can't be narrowed or none of the lifted results is valid.
+bool synthesizeNarrow(SynthesisContext &SC, std::vector<Inst *> &RHSs) {
+  unsigned Width = SC.LHS->Width;
+  std::map<Inst *, Inst *> Narrowed;
+  Inst *NarrowLHS = getInstCopyWithWidth(SC.LHS, SC.IC, Width, NarrowWidth,
+                                         Narrowed);
+  if (!NarrowLHS)
+    return false;
+  std::vector<InstMapping> NarrowPCs;
+  for (auto &PC : SC.PCs) {
+    Inst *L = getInstCopyWithWidth(PC.LHS, SC.IC, Width, NarrowWidth, Narrowed);
+    Inst *R = getInstCopyWithWidth(PC.RHS, SC.IC, Width, NarrowWidth, Narrowed);
+    if (!L || !R)
+      return false;
+    NarrowPCs.emplace_back(L, R);
+  }
+
+  ++NarrowAttempts;
+  std::vector<Inst *> NarrowRHSs;
+  if (enumerateAndVerify(SC.SMTSolver, SC.BPCs, NarrowPCs, NarrowLHS,
+                         NarrowRHSs, SC.CheckAllGuesses, SC.IC, SC.Timeout))
+    return false;
+  if (DebugLevel > 1)
+    llvm::errs() << "lifting " << NarrowRHSs.size() << " RHSs synthesized at "
+                 << NarrowWidth << " bits\n";
+
+  // what came from the LHS goes back to it; the rest is rebuilt
+  std::map<Inst *, Inst *> Widened;
+  for (auto &P : Narrowed)
+    Widened[P.second] = P.first;
+
+  CounterexampleStore Counterexamples(SC.LHS, SC.BPCs, SC.PCs);
+  sortGuesses(NarrowRHSs);
+  for (auto NarrowRHS : NarrowRHSs) {
+    ++NarrowCandidates;
+    std::vector<Inst *> Guesses;
+    std::map<Inst *, Inst *> InstCache = Widened;
+    if (Inst *RHS = getInstCopyWithWidth(NarrowRHS, SC.IC, NarrowWidth, Width,
+                                         InstCache))
+      Guesses.push_back(RHS);
+
+    std::vector<Inst *> Consts;
+    findInsts(NarrowRHS, Consts, [&Widened](Inst *I) {
+      return I->K == Inst::Const && I->Width == NarrowWidth &&
+        !Widened.count(I);
+    });
+    if (!Consts.empty()) {
+      std::map<Inst *, Inst *> SymbolicCache = Widened;
+      unsigned ID = 0;
+      for (auto C : Consts)
+        SymbolicCache[C] = SC.IC.createSynthesisConstant(Width, ++ID);
+      if (Inst *RHS = getInstCopyWithWidth(NarrowRHS, SC.IC, NarrowWidth,
+                                           Width, SymbolicCache))
+        Guesses.push_back(RHS);
+    }
+
+    std::vector<Inst *> Lifted;
+    if (verify(SC, Lifted, Guesses, Counterexamples) || Lifted.empty()) {
+      ++NarrowFalseCandidates;
+      continue;
+    }
+    for (auto RHS : Lifted)
+      if (std::find(RHSs.begin(), RHSs.end(), RHS) == RHSs.end())
+        RHSs.push_back(RHS);
+    if (!SC.CheckAllGuesses)
+      break;
+  }
+  return !RHSs.empty();
+}
+
+uint64_t microsSince(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - Start).count();
+}
+
+std::error_code
+EnumerativeSynthesis::synthesize(SMTLIBSolver *SMTSolver,
+                                const BlockPCs &BPCs,
+                                const std::vector<InstMapping> &PCs,
+                                Inst *LHS, std::vector<Inst *> &RHSs,
+                                bool CheckAllGuesses, InstContext &IC, unsigned Timeout) {
+  if (NarrowWidth > 1 && LHS->Width > NarrowWidth && BPCs.empty()) {
+    SynthesisContext SC{IC, SMTSolver, LHS, getUBInstCondition(IC, LHS),
+        PCs, BPCs, CheckAllGuesses, Timeout};
+    auto Start = std::chrono::steady_clock::now();
+    bool Solved = synthesizeNarrow(SC, RHSs);
+    NarrowMicros += microsSince(Start);
+    if (Solved) {
+      ++NarrowSolved;
+      return std::error_code();
+    }
+  }
+
+  auto Start = std::chrono::steady_clock::now();
+  std::error_code EC = enumerateAndVerify(SMTSolver, BPCs, PCs, LHS, RHSs,
+                                          CheckAllGuesses, IC, Timeout);
+  FullWidthMicros += microsSince(Start);
+  return EC;
+}
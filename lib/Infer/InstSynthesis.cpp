@@ -174,15 +174,12 @@ std::error_code InstSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       InstMapping Mapping(Query, TrueConst);
       // Negate the query to get a SAT model.
       // Don't use original BPCs/PCs, they are useless
-      std::string QueryStr = BuildQuery(IC, {}, LoopPCs, Mapping,
-                                        &ModelInsts, /*Precondition=*/0, /*Negate=*/true);
-      if (QueryStr.empty())
-        return std::make_error_code(std::errc::value_too_large);
       bool IsSat;
       if (DebugLevel > 1)
         llvm::outs() << "solving synthesis constraint.. ";
-      EC = SMTSolver->isSatisfiable(QueryStr, IsSat, ModelInsts.size(),
-                                    &ModelVals, Timeout);
+      EC = SolveQuery(SMTSolver, IC, {}, LoopPCs, Mapping, IsSat, &ModelInsts,
+                      &ModelVals, /*Precondition=*/0, Timeout,
+                      /*Negate=*/true);
       if (EC)
         return EC;
 
@@ -231,11 +228,9 @@ std::error_code InstSynthesis::synthesize(SMTLIBSolver *SMTSolver,
       ModelInsts.clear();
       ModelVals.clear();
       InstMapping CandMapping(LHS, Cand);
-      QueryStr = BuildQuery(IC, BPCs, PCs, CandMapping, &ModelInsts, /*Precondition=*/0, /*Negate=*/false);
-      if (QueryStr.empty())
-        return std::make_error_code(std::errc::value_too_large);
-      EC = SMTSolver->isSatisfiable(QueryStr, IsSat, ModelInsts.size(),
-                                    &ModelVals, Timeout);
+      EC = SolveQuery(SMTSolver, IC, BPCs, PCs, CandMapping, IsSat,
+                      &ModelInsts, &ModelVals, /*Precondition=*/0, Timeout,
+                      /*Negate=*/false);
       if (EC)
         return EC;
 
@@ -1376,13 +1371,10 @@ std::error_code InstSynthesis::getInitialConcreteInputs(std::vector<std::map<Ins
     std::vector<llvm::APInt> ModelVals;
     InstMapping Mapping(LHS, LIC->createVar(LHS->Width, "output"));
     // Negate the query to get a SAT model
-    std::string QueryStr = BuildQuery(*LIC, *LBPCs, InputPCs, Mapping,
-                                      &ModelInsts, /*Precondition=*/0,/*Negate=*/true);
-    if (QueryStr.empty())
-      return std::make_error_code(std::errc::value_too_large);
     bool IsSat;
-    EC = LSMTSolver->isSatisfiable(QueryStr, IsSat, ModelInsts.size(),
-                                   &ModelVals, LTimeout);
+    EC = SolveQuery(LSMTSolver, *LIC, *LBPCs, InputPCs, Mapping, IsSat,
+                    &ModelInsts, &ModelVals, /*Precondition=*/0, LTimeout,
+                    /*Negate=*/true);
     if (EC)
       return EC;
 
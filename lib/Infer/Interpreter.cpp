@@ -14,6 +14,8 @@
 
 #include "souper/Infer/Interpreter.h"
 
+#include "llvm/Support/MathExtras.h"
+
 namespace souper {
   EvalValue evaluateAddNSW(llvm::APInt a, llvm::APInt b) {
     bool Ov;
@@ -106,7 +108,7 @@ namespace souper {
   }
 
   EvalValue evaluateSDiv(llvm::APInt a, llvm::APInt b) {
-    if (b == 0 || (a.isMinSignedValue() && b == -1))
+    if (b == 0 || (a.isMinSignedValue() && b.isAllOnesValue()))
       return EvalValue::ub();
     return {a.sdiv(b)};
   }
@@ -135,11 +137,217 @@ namespace souper {
     return {a.ashr(b)};
   }
 
+  // Evaluation of values of at most 64 bits on uint64_t. A value of width W
+  // is kept zero-extended in the low W bits; the helpers below mask the
+  // results of the native operations back to W bits.
+
+  static uint64_t nativeMask(unsigned W) {
+    return W == 64 ? ~0ULL : (1ULL << W) - 1;
+  }
+
+  static int64_t nativeSExt(uint64_t V, unsigned W) {
+    return (int64_t)(V << (64 - W)) >> (64 - W);
+  }
+
+  static bool nativeSAddOv(uint64_t A, uint64_t B, unsigned W) {
+    int64_t Res;
+    return llvm::AddOverflow(nativeSExt(A, W), nativeSExt(B, W), Res) ||
+      Res != nativeSExt(Res & nativeMask(W), W);
+  }
+
+  static bool nativeSSubOv(uint64_t A, uint64_t B, unsigned W) {
+    int64_t Res;
+    return llvm::SubOverflow(nativeSExt(A, W), nativeSExt(B, W), Res) ||
+      Res != nativeSExt(Res & nativeMask(W), W);
+  }
+
+  static bool nativeSMulOv(uint64_t A, uint64_t B, unsigned W) {
+    int64_t Res;
+    return llvm::MulOverflow(nativeSExt(A, W), nativeSExt(B, W), Res) ||
+      Res != nativeSExt(Res & nativeMask(W), W);
+  }
+
+  static bool nativeUAddOv(uint64_t A, uint64_t B, unsigned W) {
+    uint64_t Res = A + B;
+    return Res < A || Res > nativeMask(W);
+  }
+
+  static bool nativeUSubOv(uint64_t A, uint64_t B, unsigned W) {
+    return B > A;
+  }
+
+  static bool nativeUMulOv(uint64_t A, uint64_t B, unsigned W) {
+    bool Ov = false;
+    uint64_t Res = llvm::SaturatingMultiply(A, B, &Ov);
+    return Ov || Res > nativeMask(W);
+  }
+
+  // Evaluates the common instructions whose operands and result are at most
+  // 64 bits wide and all have values. Returns None for anything else, which
+  // is then left to the APInt-based evaluation.
+  static llvm::Optional<EvalValue>
+  evaluateNative(Inst *I, llvm::SmallVectorImpl<EvalValue> &Args) {
+    unsigned W = I->Width;
+    if (W == 0 || W > 64 || Args.empty() || Args.size() > 3)
+      return llvm::None;
+    uint64_t V[3];
+    unsigned OpW = Args[0].Value.getBitWidth();
+    for (unsigned J = 0; J != Args.size(); ++J) {
+      if (!Args[J].hasValue() || Args[J].Value.getBitWidth() > 64)
+        return llvm::None;
+      V[J] = Args[J].Value.getZExtValue();
+    }
+    uint64_t M = nativeMask(W);
+
+    uint64_t Res;
+    switch (I->K) {
+    case Inst::Add:
+      Res = V[0] + V[1];
+      break;
+    case Inst::AddNSW:
+      if (nativeSAddOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] + V[1];
+      break;
+    case Inst::AddNUW:
+      if (nativeUAddOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] + V[1];
+      break;
+    case Inst::AddNW:
+      if (nativeSAddOv(V[0], V[1], W) || nativeUAddOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] + V[1];
+      break;
+    case Inst::Sub:
+      Res = V[0] - V[1];
+      break;
+    case Inst::SubNSW:
+      if (nativeSSubOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] - V[1];
+      break;
+    case Inst::SubNUW:
+      if (nativeUSubOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] - V[1];
+      break;
+    case Inst::SubNW:
+      if (nativeSSubOv(V[0], V[1], W) || nativeUSubOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] - V[1];
+      break;
+    case Inst::Mul:
+      Res = V[0] * V[1];
+      break;
+    case Inst::MulNSW:
+      if (nativeSMulOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] * V[1];
+      break;
+    case Inst::MulNUW:
+      if (nativeUMulOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] * V[1];
+      break;
+    case Inst::MulNW:
+      if (nativeSMulOv(V[0], V[1], W) || nativeUMulOv(V[0], V[1], W))
+        return EvalValue::poison(W);
+      Res = V[0] * V[1];
+      break;
+    case Inst::UDiv:
+      if (V[1] == 0)
+        return EvalValue::ub();
+      Res = V[0] / V[1];
+      break;
+    case Inst::URem:
+      if (V[1] == 0)
+        return EvalValue::ub();
+      Res = V[0] % V[1];
+      break;
+    case Inst::SDiv:
+    case Inst::SRem: {
+      int64_t A = nativeSExt(V[0], W), B = nativeSExt(V[1], W);
+      if (B == 0 || (B == -1 && V[0] == (1ULL << (W - 1))))
+        return EvalValue::ub();
+      Res = I->K == Inst::SDiv ? A / B : A % B;
+      break;
+    }
+    case Inst::And:
+      Res = V[0] & V[1];
+      break;
+    case Inst::Or:
+      Res = V[0] | V[1];
+      break;
+    case Inst::Xor:
+      Res = V[0] ^ V[1];
+      break;
+    case Inst::Shl:
+      if (V[1] >= W)
+        return EvalValue::poison(W);
+      Res = V[0] << V[1];
+      break;
+    case Inst::LShr:
+      if (V[1] >= W)
+        return EvalValue::poison(W);
+      Res = V[0] >> V[1];
+      break;
+    case Inst::AShr:
+      if (V[1] >= W)
+        return EvalValue::poison(W);
+      Res = nativeSExt(V[0], W) >> V[1];
+      break;
+    case Inst::Select:
+      return V[0] ? Args[1] : Args[2];
+    case Inst::ZExt:
+    case Inst::Trunc:
+      Res = V[0];
+      break;
+    case Inst::SExt:
+      Res = nativeSExt(V[0], OpW);
+      break;
+    case Inst::Eq:
+      Res = V[0] == V[1];
+      break;
+    case Inst::Ne:
+      Res = V[0] != V[1];
+      break;
+    case Inst::Ult:
+      Res = V[0] < V[1];
+      break;
+    case Inst::Ule:
+      Res = V[0] <= V[1];
+      break;
+    case Inst::Slt:
+      Res = nativeSExt(V[0], OpW) < nativeSExt(V[1], OpW);
+      break;
+    case Inst::Sle:
+      Res = nativeSExt(V[0], OpW) <= nativeSExt(V[1], OpW);
+      break;
+    case Inst::CtPop:
+      Res = llvm::countPopulation(V[0]);
+      break;
+    case Inst::Ctlz:
+      Res = llvm::countLeadingZeros(V[0]) - (64 - OpW);
+      break;
+    case Inst::Cttz:
+      Res = V[0] ? llvm::countTrailingZeros(V[0]) : OpW;
+      break;
+    default:
+      return llvm::None;
+    }
+    return EvalValue(llvm::APInt(W, Res & M));
+  }
+
 #define ARG0 Args[0].getValue()
 #define ARG1 Args[1].getValue()
 #define ARG2 Args[2].getValue()
 
-  EvalValue ConcreteInterpreter::evaluateSingleInst(Inst *Inst, std::vector<EvalValue> &Args) {
+  EvalValue ConcreteInterpreter::evaluateSingleInst(Inst *Inst, llvm::SmallVectorImpl<EvalValue> &Args) {
+    if (!APIntOnly)
+      if (auto Result = evaluateNative(Inst, Args))
+        return *Result;
+
     // UB propagates unconditionally
     for (auto &A : Args)
       if (A.K == EvalValue::ValueKind::UB)
@@ -238,7 +446,7 @@ namespace souper {
 
     case Inst::SDiv:
       if (ARG1 == 0 ||
-          (ARG0.isMinSignedValue() && ARG1 == -1))
+          (ARG0.isMinSignedValue() && ARG1.isAllOnesValue()))
         return EvalValue::ub();
       return {ARG0.sdiv(ARG1)};
 
@@ -456,11 +664,11 @@ namespace souper {
 #undef ARG2
 
   EvalValue ConcreteInterpreter::evaluateInst(Inst *Root) {
-    if (Cache.find(Root) != Cache.end())
-      return Cache[Root];
+    auto It = Cache.find(Root);
+    if (It != Cache.end())
+      return It->second;
 
-    // TODO SmallVector
-    std::vector<EvalValue> EvaluatedArgs;
+    llvm::SmallVector<EvalValue, 3> EvaluatedArgs;
     for (auto &&I : Root->Ops)
       EvaluatedArgs.push_back(evaluateInst(I));
     auto Result = evaluateSingleInst(Root, EvaluatedArgs);
@@ -468,4 +676,346 @@ namespace souper {
       Cache[Root] = Result;
     return Result;
   }
+
+  EvalValue ConcreteInterpreter::evaluateNode(const LinearDAG &DAG,
+                                              unsigned ID,
+                                              std::vector<llvm::Optional<EvalValue>> &Vals) {
+    if (Vals[ID])
+      return *Vals[ID];
+
+    // Going down from node ID, a node that already has a value, in Vals or
+    // in the cache, hides its operands. Only the nodes that are still
+    // reached need evaluating, each of them once, however many users it has.
+    std::vector<bool> Reached(ID + 1), Evaluate(ID + 1);
+    Reached[ID] = true;
+    for (unsigned N = ID + 1; N-- > 0; ) {
+      if (!Reached[N] || Vals[N])
+        continue;
+      auto It = Cache.find(DAG.getNode(N));
+      if (It != Cache.end()) {
+        Vals[N] = It->second;
+        continue;
+      }
+      Evaluate[N] = true;
+      for (auto Op : DAG.getOps(N))
+        Reached[Op] = true;
+    }
+
+    llvm::SmallVector<EvalValue, 3> Args;
+    for (unsigned N = 0; N <= ID; ++N) {
+      if (!Evaluate[N])
+        continue;
+      Args.clear();
+      for (auto Op : DAG.getOps(N))
+        Args.push_back(*Vals[Op]);
+      Vals[N] = evaluateSingleInst(DAG.getNode(N), Args);
+      if (CacheWritable)
+        Cache[DAG.getNode(N)] = *Vals[N];
+    }
+    return *Vals[ID];
+  }
+
+  // The lanes of a column keep their EvalValue::ValueKind. In the order of
+  // that enum, UB comes after poison, so the kind of a lane of an operation
+  // that propagates both is the largest kind of its operands. Lanes that
+  // come out undef or unimplemented that way are redone one at a time.
+
+  template <typename ColumnT, typename OpT>
+  static void mapLanes(ColumnT &C, const ColumnT &A, const ColumnT &B,
+                       uint64_t M, OpT Op) {
+    for (size_t L = 0, N = C.Kinds.size(); L != N; ++L) {
+      C.Vals[L] = Op(A.Vals[L], B.Vals[L]) & M;
+      C.Kinds[L] = std::max(A.Kinds[L], B.Kinds[L]);
+    }
+  }
+
+  // Lanes that shift by the width or more are poison
+  template <typename ColumnT>
+  static void poisonLongShifts(ColumnT &C, const ColumnT &B) {
+    const uint8_t Val = static_cast<uint8_t>(EvalValue::ValueKind::Val);
+    const uint8_t Poison = static_cast<uint8_t>(EvalValue::ValueKind::Poison);
+    for (size_t L = 0, N = C.Kinds.size(); L != N; ++L)
+      if (C.Kinds[L] == Val && B.Vals[L] >= C.Width)
+        C.Kinds[L] = Poison;
+  }
+
+  BatchInterpreter::BatchInterpreter(std::vector<ValueCache> &Inputs)
+    : Inputs(Inputs) {
+    for (auto &Input : Inputs)
+      for (auto &P : Input)
+        Given.insert(P.first);
+  }
+
+  EvalValue BatchInterpreter::getLane(const Column &C, size_t L) {
+    switch (static_cast<EvalValue::ValueKind>(C.Kinds[L])) {
+    case EvalValue::ValueKind::Val:
+      if (C.Width <= 64)
+        return {llvm::APInt(C.Width, C.Vals[L])};
+      return {C.Wide[L]};
+    case EvalValue::ValueKind::Poison:
+      return EvalValue::poison(C.Width);
+    case EvalValue::ValueKind::Undef:
+      return EvalValue::undef(C.Width);
+    case EvalValue::ValueKind::UB:
+      return EvalValue::ub();
+    case EvalValue::ValueKind::Unimplemented:
+      return EvalValue::unimplemented();
+    }
+    llvm_unreachable("unknown value kind");
+  }
+
+  void BatchInterpreter::setLane(Column &C, size_t L, const EvalValue &V) {
+    C.Kinds[L] = static_cast<uint8_t>(V.K);
+    if (V.K != EvalValue::ValueKind::Val)
+      return;
+    if (C.Width <= 64)
+      C.Vals[L] = V.Value.getZExtValue();
+    else
+      C.Wide[L] = V.Value;
+  }
+
+  bool BatchInterpreter::evaluateLanes(Inst *I,
+                                       std::vector<const Column *> &Ops,
+                                       Column &C) {
+    unsigned W = C.Width;
+    if (W == 0 || W > 64)
+      return false;
+    for (auto Op : Ops)
+      if (Op->Width == 0 || Op->Width > 64)
+        return false;
+    size_t N = C.Kinds.size();
+    uint64_t M = nativeMask(W);
+    const uint8_t Val = static_cast<uint8_t>(EvalValue::ValueKind::Val);
+    const uint8_t Poison = static_cast<uint8_t>(EvalValue::ValueKind::Poison);
+    const uint8_t Undef = static_cast<uint8_t>(EvalValue::ValueKind::Undef);
+
+    switch (I->K) {
+    case Inst::Const:
+    case Inst::UntypedConst:
+      std::fill(C.Vals.begin(), C.Vals.end(), I->Val.getZExtValue());
+      std::fill(C.Kinds.begin(), C.Kinds.end(), Val);
+      return true;
+
+    case Inst::Add:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return A + B; });
+      return true;
+
+    case Inst::Sub:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return A - B; });
+      return true;
+
+    case Inst::Mul:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return A * B; });
+      return true;
+
+    case Inst::And:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return A & B; });
+      return true;
+
+    case Inst::Or:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return A | B; });
+      return true;
+
+    case Inst::Xor:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return A ^ B; });
+      return true;
+
+    case Inst::Shl:
+      mapLanes(C, *Ops[0], *Ops[1], M, [W](uint64_t A, uint64_t B) {
+        return B < W ? A << B : 0;
+      });
+      poisonLongShifts(C, *Ops[1]);
+      return true;
+
+    case Inst::LShr:
+      mapLanes(C, *Ops[0], *Ops[1], M, [W](uint64_t A, uint64_t B) {
+        return B < W ? A >> B : 0;
+      });
+      poisonLongShifts(C, *Ops[1]);
+      return true;
+
+    case Inst::AShr:
+      mapLanes(C, *Ops[0], *Ops[1], M, [W](uint64_t A, uint64_t B) {
+        return B < W ? static_cast<uint64_t>(nativeSExt(A, W) >> B) : 0;
+      });
+      poisonLongShifts(C, *Ops[1]);
+      return true;
+
+    case Inst::Eq:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return uint64_t(A == B); });
+      return true;
+
+    case Inst::Ne:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return uint64_t(A != B); });
+      return true;
+
+    case Inst::Ult:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return uint64_t(A < B); });
+      return true;
+
+    case Inst::Ule:
+      mapLanes(C, *Ops[0], *Ops[1], M,
+               [](uint64_t A, uint64_t B) { return uint64_t(A <= B); });
+      return true;
+
+    case Inst::Slt: {
+      unsigned OpW = Ops[0]->Width;
+      mapLanes(C, *Ops[0], *Ops[1], M, [OpW](uint64_t A, uint64_t B) {
+        return uint64_t(nativeSExt(A, OpW) < nativeSExt(B, OpW));
+      });
+      return true;
+    }
+
+    case Inst::Sle: {
+      unsigned OpW = Ops[0]->Width;
+      mapLanes(C, *Ops[0], *Ops[1], M, [OpW](uint64_t A, uint64_t B) {
+        return uint64_t(nativeSExt(A, OpW) <= nativeSExt(B, OpW));
+      });
+      return true;
+    }
+
+    case Inst::ZExt:
+    case Inst::Trunc:
+      for (size_t L = 0; L != N; ++L) {
+        C.Vals[L] = Ops[0]->Vals[L] & M;
+        C.Kinds[L] = Ops[0]->Kinds[L];
+      }
+      return true;
+
+    case Inst::SExt: {
+      unsigned OpW = Ops[0]->Width;
+      for (size_t L = 0; L != N; ++L) {
+        C.Vals[L] = nativeSExt(Ops[0]->Vals[L], OpW) & M;
+        C.Kinds[L] = Ops[0]->Kinds[L];
+      }
+      return true;
+    }
+
+    case Inst::Select: {
+      // UB in any operand wins, and poison only comes from the condition
+      // or the chosen operand
+      const Column &Cond = *Ops[0], &X = *Ops[1], &Y = *Ops[2];
+      for (size_t L = 0; L != N; ++L) {
+        bool T = Cond.Vals[L] & 1;
+        uint8_t Max = std::max(Cond.Kinds[L], std::max(X.Kinds[L], Y.Kinds[L]));
+        C.Vals[L] = T ? X.Vals[L] : Y.Vals[L];
+        if (Max >= Undef)
+          C.Kinds[L] = Max;
+        else if (Cond.Kinds[L] == Poison)
+          C.Kinds[L] = Poison;
+        else
+          C.Kinds[L] = T ? X.Kinds[L] : Y.Kinds[L];
+      }
+      return true;
+    }
+
+    default:
+      return false;
+    }
+  }
+
+  bool BatchInterpreter::allGiven(Inst *I) {
+    if (!Given.count(I))
+      return false;
+    for (auto &Input : Inputs)
+      if (!Input.count(I))
+        return false;
+    return true;
+  }
+
+  void BatchInterpreter::evaluate(Inst *I, std::vector<const Column *> &Ops,
+                                  Column &C) {
+    size_t N = Inputs.size();
+    C.Width = (I->K == Inst::Const || I->K == Inst::UntypedConst) ?
+      I->Val.getBitWidth() : I->Width;
+    C.Kinds.resize(N);
+    if (C.Width <= 64)
+      C.Vals.resize(N);
+    else
+      C.Wide.resize(N);
+
+    // like ConcreteInterpreter, use the values that the inputs give
+    std::vector<const EvalValue *> GivenVals(N, nullptr);
+    size_t NumGiven = 0;
+    if (Given.count(I)) {
+      for (size_t L = 0; L != N; ++L) {
+        auto V = Inputs[L].find(I);
+        if (V != Inputs[L].end()) {
+          GivenVals[L] = &V->second;
+          ++NumGiven;
+        }
+      }
+    }
+
+    if (NumGiven != N) {
+      bool Done = evaluateLanes(I, Ops, C);
+      const uint8_t Undef = static_cast<uint8_t>(EvalValue::ValueKind::Undef);
+      for (size_t L = 0; L != N; ++L) {
+        if (GivenVals[L] || (Done && C.Kinds[L] < Undef))
+          continue;
+        llvm::SmallVector<EvalValue, 3> Args;
+        for (auto Op : Ops)
+          Args.push_back(getLane(*Op, L));
+        setLane(C, L, Scalar.evaluateSingleInst(I, Args));
+      }
+    }
+    for (size_t L = 0; L != N; ++L)
+      if (GivenVals[L])
+        setLane(C, L, *GivenVals[L]);
+  }
+
+  std::vector<EvalValue> BatchInterpreter::evaluateInst(Inst *Root) {
+    LinearDAG DAG(Root);
+    std::vector<Column> Scratch(DAG.size());
+    std::vector<const Column *> Cols(DAG.size(), nullptr);
+    // like ConcreteInterpreter::evaluateInst, don't go below the nodes that
+    // are cached or that all of the inputs give a value for
+    std::vector<bool> Reached(DAG.size()), Evaluate(DAG.size());
+    Reached.back() = true;
+    for (size_t ID = DAG.size(); ID-- > 0; ) {
+      if (!Reached[ID])
+        continue;
+      Inst *I = DAG.getNode(ID);
+      auto It = Columns.find(I);
+      if (It != Columns.end()) {
+        Cols[ID] = &It->second;
+        continue;
+      }
+      Evaluate[ID] = true;
+      if (allGiven(I))
+        continue;
+      for (auto Op : DAG.getOps(ID))
+        Reached[Op] = true;
+    }
+
+    std::vector<const Column *> Ops;
+    for (size_t ID = 0; ID != DAG.size(); ++ID) {
+      if (!Evaluate[ID])
+        continue;
+      Inst *I = DAG.getNode(ID);
+      Ops.clear();
+      for (auto Op : DAG.getOps(ID))
+        Ops.push_back(Cols[Op]);
+      evaluate(I, Ops, Scratch[ID]);
+      if (CacheWritable)
+        Cols[ID] = &(Columns[I] = std::move(Scratch[ID]));
+      else
+        Cols[ID] = &Scratch[ID];
+    }
+
+    const Column &C = *Cols.back();
+    std::vector<EvalValue> Result;
+    for (size_t L = 0; L != Inputs.size(); ++L)
+      Result.push_back(getLane(C, L));
+    return Result;
+  }
 }
@@ -16,6 +16,7 @@
 #include "souper/Infer/AbstractInterpreter.h"
 #include "souper/Infer/Pruning.h"
 #include "souper/Extractor/Candidates.h"
+#include <atomic>
 #include <cstdlib>
 
 namespace {
@@ -51,7 +52,7 @@ namespace {
 namespace souper {
 
 std::string getUniqueName() {
-  static int counter = 0;
+  static std::atomic<int> counter(0);
   return "dummy" + std::to_string(counter++);
 }
 
@@ -226,6 +227,13 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
     }
   }
 
+  // a concrete RHS is evaluated on all inputs up front
+  std::vector<EvalValue> RHSVals;
+  if (RHSIsConcrete && !(LHSHasPhi && AbstractInterpretPhi))
+    RHSVals = Batch.evaluateInst(RHS);
+  // the analyses below go over the same RHS on every input
+  LinearDAG RHSDAG(RHS);
+
   bool FoundNonTopAnalysisResult = false;
   ForcedValueAnalysis FVA(RHS);
   for (int I = 0; I < InputVals.size(); ++I) {
@@ -252,7 +260,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
 
     if (LHSHasPhi && AbstractInterpretPhi) {
       auto LHSCR = LHSConstantRange[I];
-      auto RHSCR = ConstantRangeAnalysis().findConstantRange(RHS, ConcreteInterpreters[I]);
+      auto RHSCR = ConstantRangeAnalysis().findConstantRange(RHSDAG, ConcreteInterpreters[I]);
       if (!RHSCR.isFullSet()) {
         FoundNonTopAnalysisResult = true;
       }
@@ -271,7 +279,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
       }
 
       auto LHSKB = LHSKnownBits[I];
-      auto RHSKB = KnownBitsAnalysis().findKnownBits(RHS, ConcreteInterpreters[I]);
+      auto RHSKB = KnownBitsAnalysis().findKnownBits(RHSDAG, ConcreteInterpreters[I]);
       if (!RHSKB.isUnknown()) {
         FoundNonTopAnalysisResult = true;
       }
@@ -296,7 +304,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
         if (StatsLevel > 2)
           llvm::errs() << "  LHS value = " << Val << "\n";
         if (!RHSIsConcrete) {
-          auto CR = ConstantRangeAnalysis().findConstantRange(RHS, ConcreteInterpreters[I]);
+          auto CR = ConstantRangeAnalysis().findConstantRange(RHSDAG, ConcreteInterpreters[I]);
           if (StatsLevel > 2)
             llvm::errs() << "  RHS ConstantRange = " << CR << "\n";
           if (EnableCR && !CR.contains(Val)) {
@@ -311,7 +319,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
             }
             return true;
           }
-          auto KB = KnownBitsAnalysis().findKnownBits(RHS, ConcreteInterpreters[I]);
+          auto KB = KnownBitsAnalysis().findKnownBits(RHSDAG, ConcreteInterpreters[I]);
           if (StatsLevel > 2)
             llvm::errs() << "  RHS KnownBits = " << KnownBitsAnalysis::knownBitsString(KB) << "\n";
           if (EnableKB && (KB.Zero & Val) != 0 || (KB.One & ~Val) != 0) {
@@ -412,7 +420,7 @@ bool PruningManager::isInfeasible(souper::Inst *RHS,
             }
           }
         } else {
-          auto RHSV = ConcreteInterpreters[I].evaluateInst(RHS);
+          auto &RHSV = RHSVals[I];
           if (RHSV.hasValue()) {
             if (Val != RHSV.getValue()) {
               if (StatsLevel > 2) {
@@ -488,9 +496,10 @@ bool PruningManager::isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel) {
 
         auto Cond = SC.IC.getInst(Inst::Eq, 1, {LHSReplacement, RHSReplacement});
         InstMapping Mapping {Cond, SC.IC.getConst(llvm::APInt(1, true))};
-        auto Query = BuildQuery(SC.IC, {}, {}, Mapping, &ModelVars, nullptr, true);
         if (StatsLevel > 3) {
-          llvm::errs() << Query << "\n";
+          std::vector<Inst *> QueryVars;
+          llvm::errs() << BuildQuery(SC.IC, {}, {}, Mapping, &QueryVars,
+                                     nullptr, true) << "\n";
 
           llvm::errs() << "LHS\n";
           ReplacementContext RC1; RC1.printInst(Mapping.LHS, llvm::errs(), true);
@@ -499,8 +508,10 @@ bool PruningManager::isInfeasibleWithSolver(Inst *RHS, unsigned StatsLevel) {
         }
 
         bool Result;
-        std::vector<llvm::APInt> Models(ModelVars.size());
-        auto EC = SC.SMTSolver->isSatisfiable(Query, Result, Models.size(), &Models, 1000);
+        std::vector<llvm::APInt> Models;
+        auto EC = SolveQuery(SC.SMTSolver, SC.IC, {}, {}, Mapping, Result,
+                             &ModelVars, &Models, nullptr, 1000,
+                             /*Negate=*/true);
 
         if (EC) {
           llvm::errs() << "Solver error in Pruning. " << EC.message() << " \n";
@@ -542,7 +553,16 @@ PruningManager::PruningManager(
                     InputVars(Inputs_) {}
 
 void PruningManager::init() {
-  setPhiConcretePreds(SC.LHS);
+  init(nullptr);
+}
+
+void PruningManager::initFrom(const PruningManager &Other) {
+  init(&Other.InputVals);
+}
+
+void PruningManager::init(const std::vector<ValueCache> *GivenInputVals) {
+  if (!GivenInputVals)
+    setPhiConcretePreds(SC.LHS);
   Ante = SC.IC.getConst(llvm::APInt(1, true));
   for (auto PC : SC.PCs ) {
     Inst *Eq = SC.IC.getInst(Inst::Eq, 1, {PC.LHS, PC.RHS});
@@ -551,11 +571,15 @@ void PruningManager::init() {
 
   findVars(Ante, InputVars);
 
-  InputVals = generateInputSets(InputVars);
+  if (GivenInputVals)
+    InputVals = *GivenInputVals;
+  else
+    InputVals = generateInputSets(InputVars);
 
   for (auto &&Input : InputVals) {
     ConcreteInterpreters.emplace_back(SC.LHS, Input);
   }
+  Batch = BatchInterpreter(SC.LHS, InputVals);
 
   if (hasGivenInst(SC.LHS, [](Inst *I){ return I->K == Inst::Phi;})) {
     LHSHasPhi = true;
@@ -614,6 +638,24 @@ void PruningManager::init() {
   ExprInfo::analyze(SC.LHS, LHSInfo);
 }
 
+bool PruningManager::addInput(const ValueCache &Input) {
+  ValueCache Cache = Input;
+  if (!isInputValid(Cache))
+    return false;
+  InputVals.insert(InputVals.begin(), Cache);
+  ConcreteInterpreters.emplace(ConcreteInterpreters.begin(), SC.LHS,
+                               InputVals.front());
+  Batch = BatchInterpreter(SC.LHS, InputVals);
+  if (LHSHasPhi && AbstractInterpretPhi) {
+    auto &CI = ConcreteInterpreters.front();
+    LHSKnownBits.insert(LHSKnownBits.begin(),
+                        KnownBitsAnalysis().findKnownBits(SC.LHS, CI));
+    LHSConstantRange.insert(LHSConstantRange.begin(),
+                            ConstantRangeAnalysis().findConstantRange(SC.LHS, CI));
+  }
+  return true;
+}
+
 bool isDataflowConsistent(ValueCache &Cache) {
   for (auto &&Pair : Cache) {
     if (Pair.second.hasValue()) {
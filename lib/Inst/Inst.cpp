@@ -14,10 +14,16 @@
 
 #include "souper/Inst/Inst.h"
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <queue>
 #include <set>
 
@@ -566,6 +572,44 @@ void Inst::Print() {
 }
 #endif
 
+namespace {
+std::mutex LiveContextsLock;
+// Never destroyed, since contexts with static storage may outlive it
+std::set<unsigned> &LiveContexts = *new std::set<unsigned>;
+}
+
+InstContext::InstContext() {
+  static std::atomic<unsigned> NextID(0);
+  ID = ++NextID;
+  std::lock_guard<std::mutex> Guard(LiveContextsLock);
+  LiveContexts.insert(ID);
+}
+
+InstContext::~InstContext() {
+  std::lock_guard<std::mutex> Guard(LiveContextsLock);
+  LiveContexts.erase(ID);
+}
+
+bool InstContext::isLive(unsigned ID) {
+  std::lock_guard<std::mutex> Guard(LiveContextsLock);
+  return LiveContexts.count(ID);
+}
+
+void InstContext::share(InstContext &Other, const std::vector<Inst *> &Insts) {
+  SharedFrom = &Other;
+  SharedInsts.insert(Insts.begin(), Insts.end());
+}
+
+Inst *InstContext::findInst(llvm::FoldingSetNodeID &ID, void *&IP) {
+  if (SharedFrom) {
+    void *SharedIP = 0;
+    Inst *I = SharedFrom->InstSet.FindNodeOrInsertPos(ID, SharedIP);
+    if (I && SharedInsts.count(I))
+      return I;
+  }
+  return InstSet.FindNodeOrInsertPos(ID, IP);
+}
+
 Inst *InstContext::getConst(const llvm::APInt &Val) {
   llvm::FoldingSetNodeID ID;
   ID.AddInteger(Inst::Const);
@@ -573,7 +617,7 @@ Inst *InstContext::getConst(const llvm::APInt &Val) {
   Val.Profile(ID);
 
   void *IP = 0;
-  if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
+  if (Inst *I = findInst(ID, IP))
     return I;
 
   auto N = new Inst;
@@ -592,7 +636,7 @@ Inst *InstContext::getUntypedConst(const llvm::APInt &Val) {
   Val.Profile(ID);
 
   void *IP = 0;
-  if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
+  if (Inst *I = findInst(ID, IP))
     return I;
 
   auto N = new Inst;
@@ -701,7 +745,7 @@ Inst *InstContext::getPhi(Block *B, const std::vector<Inst *> &Ops, llvm::APInt
     ID.Add(DemandedBits);
 
   void *IP = 0;
-  if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
+  if (Inst *I = findInst(ID, IP))
     return I;
 
   auto N = new Inst;
@@ -747,7 +791,7 @@ Inst *InstContext::getInst(Inst::Kind K, unsigned Width,
     ID.Add(DemandedBits);
 
   void *IP = 0;
-  if (Inst *I = InstSet.FindNodeOrInsertPos(ID, IP))
+  if (Inst *I = findInst(ID, IP))
     return I;
 
   auto N = new Inst;
@@ -1047,10 +1091,234 @@ std::string souper::GetReplacementLHSString(const BlockPCs &BPCs,
     Inst *LHS, ReplacementContext &Context, bool printNames) {
   std::string Str;
   llvm::raw_string_ostream SS(Str);
-  PrintReplacementLHS(SS, BPCs, PCs, LHS, Context);
+  PrintReplacementLHS(SS, BPCs, PCs, LHS, Context, printNames);
   return SS.str();
 }
 
+namespace {
+
+// Writes a canonical, name-free description of the Insts it visits, in the
+// order ReplacementContext prints them, as a sequence of words. Each Inst is
+// defined once, after its operands, and referred to by number afterwards;
+// constants are written out at every use, as the printer does.
+class StructuralHasher {
+  enum Tag : uint64_t { Def = 1, Ref, ConstRef, BlockDef, PC, BlockPC, LHS };
+
+  llvm::SmallVector<uint64_t, 256> Words;
+  llvm::DenseMap<Inst *, uint64_t> InstNumbers;
+  llvm::DenseMap<Block *, uint64_t> BlockNumbers;
+  bool HashNames;
+
+  void add(uint64_t W) { Words.push_back(W); }
+
+  void add(const llvm::APInt &V) {
+    add(V.getBitWidth());
+    for (unsigned I = 0; I != V.getNumWords(); ++I)
+      add(V.getRawData()[I]);
+  }
+
+  uint64_t nextNumber() { return InstNumbers.size() + BlockNumbers.size(); }
+
+  uint64_t addBlock(Block *B) {
+    auto It = BlockNumbers.find(B);
+    if (It != BlockNumbers.end())
+      return It->second;
+    add(BlockDef);
+    add(B->Preds);
+    uint64_t N = nextNumber();
+    BlockNumbers[B] = N;
+    return N;
+  }
+
+  void addDef(Inst *I, Inst *Root) {
+    if (I->K == Inst::Phi)
+      addBlock(I->B);
+    const std::vector<Inst *> &Ops = I->orderedOps();
+    for (Inst *Op : Ops)
+      addRef(Op, Root);
+    add(Def);
+    add(I->K);
+    add(I->Width);
+    add(Ops.size());
+    if (I->K == Inst::Phi)
+      add(BlockNumbers[I->B]);
+    if (I->K == Inst::Var) {
+      add(I->KnownZeros);
+      add(I->KnownOnes);
+      add(I->NonNegative | I->Negative << 1 | I->NonZero << 2 |
+          I->PowOfTwo << 3);
+      add(I->NumSignBits);
+      add(I->Range.getLower());
+      add(I->Range.getUpper());
+      if (HashNames)
+        add(llvm::xxHash64(I->Name));
+    }
+    add(Root->DepsWithExternalUses.count(I));
+    InstNumbers[I] = nextNumber();
+  }
+
+public:
+  StructuralHasher(bool HashNames) : HashNames(HashNames) {}
+
+  void addRef(Inst *I, Inst *Root) {
+    if (I->K == Inst::Const || I->K == Inst::UntypedConst) {
+      add(ConstRef);
+      add(I->K);
+      add(I->Val);
+      return;
+    }
+    if (!InstNumbers.count(I))
+      addDef(I, Root);
+    add(Ref);
+    add(InstNumbers[I]);
+  }
+
+  void addPC(const InstMapping &PC) {
+    addRef(PC.LHS, PC.LHS);
+    addRef(PC.RHS, PC.RHS);
+    add(Tag::PC);
+  }
+
+  void addBlockPC(const BlockPCMapping &BPC) {
+    uint64_t B = addBlock(BPC.B);
+    addRef(BPC.PC.LHS, BPC.PC.LHS);
+    addRef(BPC.PC.RHS, BPC.PC.RHS);
+    add(Tag::BlockPC);
+    add(B);
+    add(BPC.PredIdx);
+  }
+
+  void addLHS(Inst *I) {
+    addRef(I, I);
+    add(Tag::LHS);
+    add(I->DemandedBits);
+    add(I->HarvestKind == HarvestType::HarvestedFromUse);
+  }
+
+  void addMapping(const InstMapping &Mapping) {
+    addRef(Mapping.LHS, Mapping.LHS);
+    addRef(Mapping.RHS, Mapping.RHS);
+    add(Tag::LHS);
+    add(Mapping.LHS->DemandedBits);
+    add(Mapping.LHS->HarvestKind == HarvestType::HarvestedFromUse);
+  }
+
+  const llvm::SmallVectorImpl<uint64_t> &words() const { return Words; }
+
+  StructuralHash get() {
+    llvm::MD5 Hash;
+    Hash.update(llvm::ArrayRef<uint8_t>(
+        reinterpret_cast<const uint8_t *>(Words.data()),
+        Words.size() * sizeof(uint64_t)));
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    StructuralHash H;
+    H.High = Result.high();
+    H.Low = Result.low();
+    return H;
+  }
+};
+
+}
+
+std::string StructuralHash::bytes() const {
+  std::string S(sizeof(High) + sizeof(Low), 0);
+  memcpy(&S[0], &High, sizeof(High));
+  memcpy(&S[sizeof(High)], &Low, sizeof(Low));
+  return S;
+}
+
+// The hash of an LHS along with what it was computed for. The fields of the
+// LHS that the harvester may still set are kept to notice when they change;
+// the insts below the LHS and those of the path conditions don't change.
+struct souper::StructuralHashMemo {
+  bool HashNames;
+  std::vector<InstMapping> PCs;
+  BlockPCs BPCs;
+  llvm::APInt DemandedBits;
+  HarvestType HarvestKind;
+  std::unordered_set<Inst *> DepsWithExternalUses;
+  StructuralHash Hash;
+  std::vector<uint64_t> Words;
+
+  bool matches(const BlockPCs &OtherBPCs,
+               const std::vector<InstMapping> &OtherPCs, Inst *LHS,
+               bool OtherHashNames) const {
+    auto SamePC = [](const InstMapping &A, const InstMapping &B) {
+      return A.LHS == B.LHS && A.RHS == B.RHS;
+    };
+    auto SameBPC = [&SamePC](const BlockPCMapping &A,
+                             const BlockPCMapping &B) {
+      return A.B == B.B && A.PredIdx == B.PredIdx && SamePC(A.PC, B.PC);
+    };
+    return HashNames == OtherHashNames &&
+           std::equal(PCs.begin(), PCs.end(), OtherPCs.begin(),
+                      OtherPCs.end(), SamePC) &&
+           std::equal(BPCs.begin(), BPCs.end(), OtherBPCs.begin(),
+                      OtherBPCs.end(), SameBPC) &&
+           DemandedBits.getBitWidth() == LHS->DemandedBits.getBitWidth() &&
+           DemandedBits == LHS->DemandedBits &&
+           HarvestKind == LHS->HarvestKind &&
+           DepsWithExternalUses == LHS->DepsWithExternalUses;
+  }
+};
+
+namespace {
+std::mutex HashMemoLock;
+}
+
+StructuralHash souper::GetReplacementLHSHash(const BlockPCs &BPCs,
+    const std::vector<InstMapping> &PCs, Inst *LHS, bool HashNames,
+    std::vector<uint64_t> *Words) {
+  std::shared_ptr<StructuralHashMemo> Memo;
+  {
+    std::lock_guard<std::mutex> Guard(HashMemoLock);
+    Memo = LHS->HashMemo;
+  }
+  if (Memo && Memo->matches(BPCs, PCs, LHS, HashNames)) {
+    if (Words)
+      *Words = Memo->Words;
+    return Memo->Hash;
+  }
+
+  StructuralHasher Hasher(HashNames);
+  for (const auto &PC : PCs)
+    Hasher.addPC(PC);
+  for (const auto &BPC : BPCs)
+    Hasher.addBlockPC(BPC);
+  Hasher.addLHS(LHS);
+
+  Memo = std::make_shared<StructuralHashMemo>();
+  Memo->HashNames = HashNames;
+  Memo->PCs = PCs;
+  Memo->BPCs = BPCs;
+  Memo->DemandedBits = LHS->DemandedBits;
+  Memo->HarvestKind = LHS->HarvestKind;
+  Memo->DepsWithExternalUses = LHS->DepsWithExternalUses;
+  Memo->Hash = Hasher.get();
+  Memo->Words.assign(Hasher.words().begin(), Hasher.words().end());
+  if (Words)
+    *Words = Memo->Words;
+  StructuralHash H = Memo->Hash;
+  std::lock_guard<std::mutex> Guard(HashMemoLock);
+  LHS->HashMemo = std::move(Memo);
+  return H;
+}
+
+StructuralHash souper::GetReplacementHash(const BlockPCs &BPCs,
+    const std::vector<InstMapping> &PCs, InstMapping Mapping,
+    std::vector<uint64_t> *Words) {
+  StructuralHasher Hasher(/*HashNames=*/false);
+  for (const auto &PC : PCs)
+    Hasher.addPC(PC);
+  for (const auto &BPC : BPCs)
+    Hasher.addBlockPC(BPC);
+  Hasher.addMapping(Mapping);
+  if (Words)
+    Words->assign(Hasher.words().begin(), Hasher.words().end());
+  return Hasher.get();
+}
+
 void souper::PrintReplacementRHS(llvm::raw_ostream &Out, Inst *RHS,
                                  ReplacementContext &Context, bool printNames) {
   std::string SRef = Context.printInst(RHS, Out, printNames);
@@ -1225,6 +1493,69 @@ Inst *souper::getInstCopy(Inst *I, InstContext &IC,
   return Copy;
 }
 
+Inst *souper::getInstCopyWithWidth(Inst *I, InstContext &IC,
+                                   unsigned FromWidth, unsigned ToWidth,
+                                   std::map<Inst *, Inst *> &InstCache) {
+  if (InstCache.count(I))
+    return InstCache.at(I);
+
+  unsigned Width;
+  if (I->Width == FromWidth)
+    Width = ToWidth;
+  else if (I->Width == 1)
+    Width = 1;
+  else
+    return nullptr;
+
+  std::vector<Inst *> Ops;
+  for (auto const &Op : I->Ops) {
+    Inst *OpCopy = getInstCopyWithWidth(Op, IC, FromWidth, ToWidth, InstCache);
+    if (!OpCopy)
+      return nullptr;
+    Ops.push_back(OpCopy);
+  }
+
+  Inst *Copy = nullptr;
+  switch (I->K) {
+  case Inst::Var:
+    if (I->SynthesisConstID != 0 || I->KnownZeros != 0 || I->KnownOnes != 0 ||
+        !I->Range.isFullSet() || I->NumSignBits > 1 ||
+        !I->DemandedBits.isAllOnesValue())
+      return nullptr;
+    Copy = IC.createVar(Width, I->Name,
+                        llvm::ConstantRange(Width, /*isFullSet=*/true),
+                        llvm::APInt(Width, 0), llvm::APInt(Width, 0),
+                        I->NonZero, I->NonNegative, I->PowOfTwo, I->Negative,
+                        /*NumSignBits=*/1, llvm::APInt::getAllOnesValue(Width),
+                        /*SynthesisConstID=*/0);
+    break;
+  case Inst::Const: {
+    llvm::APInt Val = I->Val.sextOrTrunc(Width);
+    if (Val.sextOrTrunc(I->Width) != I->Val)
+      return nullptr;
+    Copy = IC.getConst(Val);
+    break;
+  }
+  case Inst::Phi:
+  case Inst::Hole:
+  case Inst::UntypedConst:
+  case Inst::BSwap:
+  case Inst::ExtractValue:
+  case Inst::ReservedConst:
+  case Inst::ReservedInst:
+    return nullptr;
+  default:
+    if (Inst::isOverflowIntrinsicMain(I->K) ||
+        Inst::isOverflowIntrinsicSub(I->K) ||
+        !I->DemandedBits.isAllOnesValue())
+      return nullptr;
+    Copy = IC.getInst(I->K, Width, Ops, I->Available);
+    break;
+  }
+  InstCache[I] = Copy;
+  return Copy;
+}
+
 Inst *souper::instJoin(Inst *I, Inst *EmptyInst, Inst *NewInst,
                        std::map<Inst *, Inst *> &InstCache,
                        InstContext &IC) {
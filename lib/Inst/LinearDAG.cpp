@@ -0,0 +1,55 @@
+// Copyright 2019 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/Inst/LinearDAG.h"
+
+using namespace souper;
+
+unsigned LinearDAG::add(Inst *Root) {
+  auto It = IDs.find(Root);
+  if (It != IDs.end())
+    return It->second;
+
+  // depth-first, numbering each inst once all of its operands are numbered
+  std::vector<std::pair<Inst *, unsigned>> Stack{{Root, 0}};
+  while (!Stack.empty()) {
+    Inst *I = Stack.back().first;
+    unsigned NextOp = Stack.back().second;
+    if (NextOp < I->Ops.size()) {
+      ++Stack.back().second;
+      Inst *Op = I->Ops[NextOp];
+      if (!IDs.count(Op))
+        Stack.emplace_back(Op, 0);
+      continue;
+    }
+    Stack.pop_back();
+    if (IDs.count(I))
+      continue;
+
+    IDs[I] = Nodes.size();
+    Nodes.push_back(I);
+    for (auto Op : I->Ops)
+      OpIDs.push_back(IDs.lookup(Op));
+    OpBegin.push_back(OpIDs.size());
+  }
+  return IDs.lookup(Root);
+}
+
+bool LinearDAG::lookup(Inst *I, unsigned &ID) const {
+  auto It = IDs.find(I);
+  if (It == IDs.end())
+    return false;
+  ID = It->second;
+  return true;
+}
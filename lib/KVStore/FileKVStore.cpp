@@ -0,0 +1,245 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "souper/KVStore/KVStore.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/CRC.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+
+using namespace llvm;
+using namespace souper;
+
+// The file starts with the magic string below, followed by records of the
+// form
+//
+//   u32  CRC-32 of the rest of the record
+//   u8   operation
+//   u32  key length, u32 field length, u32 value length
+//   key, field and value bytes
+//
+// with integers stored little-endian. Records are only ever appended, by a
+// writer that holds the file lock. Readers map the file and replay the
+// records they have not seen yet into an in-memory index, without taking
+// the lock. A record whose checksum does not match is either still being
+// written or was cut short by a crash; replay stops in front of it, and
+// the next writer truncates it away before appending.
+
+namespace {
+
+const char Magic[] = "SOUPERKV";
+const size_t MagicSize = sizeof(Magic) - 1;
+const size_t RecordHeaderSize = 17;
+
+enum Operation : uint8_t {
+  OpSet = 1,
+  OpIncr = 2,
+};
+
+class FileKVBackend : public KVBackend {
+  std::string Path;
+  int FD;
+  std::mutex Lock;
+  // field values, keyed by the key and the field separated by a NUL
+  StringMap<std::string> Index;
+  // end of the prefix of the file that has been replayed
+  uint64_t End = 0;
+
+  static std::string indexKey(StringRef Key, StringRef Field) {
+    return (Key + Twine('\0') + Field).str();
+  }
+
+  uint64_t fileSize();
+  void apply(Operation Op, StringRef Key, StringRef Field, StringRef Value);
+  void replay();
+  void append(Operation Op, StringRef Key, StringRef Field, StringRef Value);
+
+public:
+  FileKVBackend(StringRef Path);
+  ~FileKVBackend();
+  void hIncrBy(StringRef Key, StringRef Field, int Incr) override;
+  bool hGet(StringRef Key, StringRef Field, std::string &Value) override;
+  void hMGet(ArrayRef<std::string> Keys, StringRef Field,
+             std::vector<Optional<std::string>> &Values) override;
+  void hSet(StringRef Key, StringRef Field, StringRef Value) override;
+};
+
+}
+
+FileKVBackend::FileKVBackend(StringRef Path) : Path(Path.str()) {
+  if (auto EC = sys::fs::openFileForReadWrite(Path, FD,
+                                              sys::fs::CD_OpenAlways,
+                                              sys::fs::OF_Append))
+    report_fatal_error("Can't open KV store '" + Twine(Path) + "': " +
+                       EC.message() + "\n");
+  replay();
+}
+
+FileKVBackend::~FileKVBackend() {
+  sys::Process::SafelyCloseFileDescriptor(FD);
+}
+
+uint64_t FileKVBackend::fileSize() {
+  sys::fs::file_status Status;
+  if (auto EC = sys::fs::status(FD, Status))
+    report_fatal_error("Can't stat KV store '" + Twine(Path) + "': " +
+                       EC.message() + "\n");
+  return Status.getSize();
+}
+
+void FileKVBackend::apply(Operation Op, StringRef Key, StringRef Field,
+                          StringRef Value) {
+  std::string &Slot = Index[indexKey(Key, Field)];
+  if (Op == OpSet) {
+    Slot = Value.str();
+    return;
+  }
+  // like HINCRBY, a missing field counts as zero
+  long long Old = 0, Incr = 0;
+  if (StringRef(Slot).getAsInteger(10, Old))
+    Old = 0;
+  if (Value.getAsInteger(10, Incr))
+    Incr = 0;
+  Slot = std::to_string(Old + Incr);
+}
+
+void FileKVBackend::replay() {
+  uint64_t Size = fileSize();
+  if (Size <= End || Size < MagicSize)
+    return;
+
+  std::error_code EC;
+  sys::fs::mapped_file_region Map(sys::fs::convertFDToNativeFile(FD),
+                                  sys::fs::mapped_file_region::readonly,
+                                  Size, 0, EC);
+  if (EC)
+    report_fatal_error("Can't map KV store '" + Twine(Path) + "': " +
+                       EC.message() + "\n");
+  const char *Data = Map.const_data();
+
+  if (End == 0) {
+    if (StringRef(Data, MagicSize) != Magic)
+      report_fatal_error("'" + Twine(Path) + "' is not a Souper KV store\n");
+    End = MagicSize;
+  }
+
+  using namespace support::endian;
+  while (Size - End >= RecordHeaderSize) {
+    const char *P = Data + End;
+    uint32_t CRC = read32le(P);
+    uint8_t Op = P[4];
+    uint32_t KeyLen = read32le(P + 5);
+    uint32_t FieldLen = read32le(P + 9);
+    uint32_t ValueLen = read32le(P + 13);
+    uint64_t Len = RecordHeaderSize + uint64_t(KeyLen) + FieldLen + ValueLen;
+    if (Size - End < Len)
+      break;
+    if (crc32(arrayRefFromStringRef(StringRef(P + 4, Len - 4))) != CRC)
+      break;
+    if (Op != OpSet && Op != OpIncr)
+      break;
+    StringRef Body(P + RecordHeaderSize, Len - RecordHeaderSize);
+    apply(Operation(Op), Body.substr(0, KeyLen),
+          Body.substr(KeyLen, FieldLen), Body.substr(KeyLen + FieldLen));
+    End += Len;
+  }
+}
+
+void FileKVBackend::append(Operation Op, StringRef Key, StringRef Field,
+                           StringRef Value) {
+  std::string Record(RecordHeaderSize, 0);
+  using namespace support::endian;
+  Record[4] = Op;
+  write32le(&Record[5], Key.size());
+  write32le(&Record[9], Field.size());
+  write32le(&Record[13], Value.size());
+  Record += Key;
+  Record += Field;
+  Record += Value;
+  write32le(&Record[0],
+            crc32(arrayRefFromStringRef(StringRef(Record).drop_front(4))));
+
+  if (auto EC = sys::fs::lockFile(FD))
+    report_fatal_error("Can't lock KV store '" + Twine(Path) + "': " +
+                       EC.message() + "\n");
+  // Other processes may have appended since we last looked. Anything that
+  // still does not replay now that we hold the lock is a torn record.
+  replay();
+  std::string Prefix;
+  uint64_t Size = fileSize();
+  if (End == 0) {
+    Prefix = Magic;
+    End = MagicSize;
+    if (Size)
+      sys::fs::resize_file(FD, 0);
+  } else if (Size > End) {
+    sys::fs::resize_file(FD, End);
+  }
+
+  raw_fd_ostream OS(FD, /*shouldClose=*/false, /*unbuffered=*/true);
+  OS << Prefix << Record;
+  OS.flush();
+  bool Failed = OS.has_error();
+  OS.clear_error();
+  sys::fs::unlockFile(FD);
+  if (Failed)
+    report_fatal_error("Can't write KV store '" + Twine(Path) + "'\n");
+
+  apply(Op, Key, Field, Value);
+  End += Record.size();
+}
+
+void FileKVBackend::hIncrBy(StringRef Key, StringRef Field, int Incr) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  append(OpIncr, Key, Field, std::to_string(Incr));
+}
+
+bool FileKVBackend::hGet(StringRef Key, StringRef Field, std::string &Value) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  replay();
+  auto It = Index.find(indexKey(Key, Field));
+  if (It == Index.end())
+    return false;
+  Value = It->second;
+  return true;
+}
+
+void FileKVBackend::hMGet(ArrayRef<std::string> Keys, StringRef Field,
+                          std::vector<Optional<std::string>> &Values) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  replay();
+  Values.clear();
+  for (auto &Key : Keys) {
+    auto It = Index.find(indexKey(Key, Field));
+    if (It == Index.end())
+      Values.emplace_back(None);
+    else
+      Values.emplace_back(It->second);
+  }
+}
+
+void FileKVBackend::hSet(StringRef Key, StringRef Field, StringRef Value) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  append(OpSet, Key, Field, Value);
+}
+
+std::unique_ptr<KVBackend> souper::createFileKVBackend(StringRef Path) {
+  return std::unique_ptr<KVBackend>(new FileKVBackend(Path));
+}
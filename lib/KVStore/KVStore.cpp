@@ -16,29 +16,68 @@
 
 #include "llvm/Support/CommandLine.h"
 #include "hiredis.h"
+#include <mutex>
 
 using namespace llvm;
 using namespace souper;
 
 static cl::opt<unsigned> RedisPort("souper-redis-port", cl::init(6379),
     cl::desc("Redis server port (default=6379)"));
+static cl::opt<std::string> Backend("souper-kv-backend", cl::init("redis"),
+    cl::desc("Where the external cache lives: 'redis', or 'file:<path>' for "
+             "a local file (default=redis)"));
+
+// Number of increments buffered before they are sent to the server.
+static const unsigned MaxPendingIncrements = 128;
 
 namespace souper {
 
-class KVStore::KVImpl {
+KVBackend::~KVBackend() {}
+
+void KVBackend::hMGet(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                      std::vector<llvm::Optional<std::string>> &Values) {
+  Values.clear();
+  for (auto &Key : Keys) {
+    std::string Value;
+    if (hGet(Key, Field, Value))
+      Values.emplace_back(std::move(Value));
+    else
+      Values.emplace_back(llvm::None);
+  }
+}
+
+void KVBackend::flush() {}
+
+namespace {
+
+// One connection, shared by all threads that use the store. Increments are
+// pipelined: they are appended to the connection's output buffer and their
+// replies are only read once enough of them have piled up, or before the
+// next command that needs an answer, since replies arrive in order.
+class RedisKVBackend : public KVBackend {
   redisContext *Ctx;
+  std::mutex Lock;
+  unsigned PendingIncrements = 0;
+  void drain();
 public:
-  KVImpl();
-  ~KVImpl();
-  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr);
-  bool hGet(llvm::StringRef Key, llvm::StringRef Field, std::string &Value);
-  void hSet(llvm::StringRef Key, llvm::StringRef Field, llvm::StringRef Value);
+  RedisKVBackend(unsigned Port);
+  ~RedisKVBackend();
+  void hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr) override;
+  bool hGet(llvm::StringRef Key, llvm::StringRef Field,
+            std::string &Value) override;
+  void hMGet(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+             std::vector<llvm::Optional<std::string>> &Values) override;
+  void hSet(llvm::StringRef Key, llvm::StringRef Field,
+            llvm::StringRef Value) override;
+  void flush() override;
 };
 
-KVStore::KVImpl::KVImpl() {
+}
+
+RedisKVBackend::RedisKVBackend(unsigned Port) {
   const char *hostname = "127.0.0.1";
   struct timeval Timeout = { 1, 500000 }; // 1.5 seconds
-  Ctx = redisConnectWithTimeout(hostname, RedisPort, Timeout);
+  Ctx = redisConnectWithTimeout(hostname, Port, Timeout);
   if (!Ctx) {
     llvm::report_fatal_error("Can't allocate redis context\n");
   }
@@ -48,27 +87,76 @@ KVStore::KVImpl::KVImpl() {
   }
 }
 
-KVStore::KVImpl::~KVImpl() {
+RedisKVBackend::~RedisKVBackend() {
+  drain();
   redisFree(Ctx);
 }
 
-void KVStore::KVImpl::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
-                              int Incr) {
-  redisReply *reply = (redisReply *)redisCommand(Ctx, "HINCRBY %s %s 1",
-                                                 Key.data(), Field.data());
-  if (!reply || Ctx->err) {
+void RedisKVBackend::drain() {
+  for (; PendingIncrements; --PendingIncrements) {
+    redisReply *reply;
+    if (redisGetReply(Ctx, (void **)&reply) != REDIS_OK || !reply) {
+      llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
+    }
+    if (reply->type != REDIS_REPLY_INTEGER) {
+      llvm::report_fatal_error(
+          "Redis protocol error for static profile, didn't expect reply type "
+          + std::to_string(reply->type));
+    }
+    freeReplyObject(reply);
+  }
+}
+
+void RedisKVBackend::flush() {
+  std::lock_guard<std::mutex> Guard(Lock);
+  drain();
+}
+
+void RedisKVBackend::hIncrBy(llvm::StringRef Key, llvm::StringRef Field,
+                             int Incr) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  if (redisAppendCommand(Ctx, "HINCRBY %b %b %d", Key.data(), Key.size(),
+                         Field.data(), Field.size(), Incr) != REDIS_OK) {
     llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
   }
-  if (reply->type != REDIS_REPLY_INTEGER) {
-    llvm::report_fatal_error(
-        "Redis protocol error for static profile, didn't expect reply type "
-        + std::to_string(reply->type));
+  if (++PendingIncrements >= MaxPendingIncrements)
+    drain();
+}
+
+void RedisKVBackend::hMGet(llvm::ArrayRef<std::string> Keys,
+                           llvm::StringRef Field,
+                           std::vector<llvm::Optional<std::string>> &Values) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  drain();
+  for (auto &Key : Keys) {
+    if (redisAppendCommand(Ctx, "HGET %b %b", Key.data(), Key.size(),
+                           Field.data(), Field.size()) != REDIS_OK) {
+      llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
+    }
+  }
+  Values.clear();
+  for (size_t I = 0; I < Keys.size(); ++I) {
+    redisReply *reply;
+    if (redisGetReply(Ctx, (void **)&reply) != REDIS_OK || !reply) {
+      llvm::report_fatal_error((llvm::StringRef)"Redis error: " + Ctx->errstr);
+    }
+    if (reply->type == REDIS_REPLY_NIL) {
+      Values.emplace_back(llvm::None);
+    } else if (reply->type == REDIS_REPLY_STRING) {
+      Values.emplace_back(std::string(reply->str, reply->len));
+    } else {
+      llvm::report_fatal_error(
+          "Redis protocol error for cache lookup, didn't expect reply type " +
+          std::to_string(reply->type));
+    }
+    freeReplyObject(reply);
   }
-  freeReplyObject(reply);
 }
 
-bool KVStore::KVImpl::hGet(llvm::StringRef Key, llvm::StringRef Field,
-                           std::string &Value) {
+bool RedisKVBackend::hGet(llvm::StringRef Key, llvm::StringRef Field,
+                          std::string &Value) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  drain();
   redisReply *reply = (redisReply *)redisCommand(Ctx, "HGET %s %s", Key.data(),
                                                  Field.data());
   if (!reply || Ctx->err) {
@@ -88,8 +176,10 @@ bool KVStore::KVImpl::hGet(llvm::StringRef Key, llvm::StringRef Field,
   }
 }
 
-void KVStore::KVImpl::hSet(llvm::StringRef Key, llvm::StringRef Field,
-                              llvm::StringRef Value) {
+void RedisKVBackend::hSet(llvm::StringRef Key, llvm::StringRef Field,
+                          llvm::StringRef Value) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  drain();
   redisReply *reply = (redisReply *)redisCommand(Ctx, "HSET %s %s %s",
       Key.data(), Field.data(), Value.data());
   if (!reply || Ctx->err) {
@@ -103,9 +193,28 @@ void KVStore::KVImpl::hSet(llvm::StringRef Key, llvm::StringRef Field,
   freeReplyObject(reply);
 }
 
-KVStore::KVStore() : Impl (new KVImpl) {}
+std::unique_ptr<KVBackend> createRedisKVBackend(unsigned Port) {
+  return std::unique_ptr<KVBackend>(new RedisKVBackend(Port));
+}
+
+static std::unique_ptr<KVBackend> createSelectedBackend() {
+  StringRef Spec = Backend;
+  if (Spec == "redis")
+    return createRedisKVBackend(RedisPort);
+  if (Spec.consume_front("file:") && !Spec.empty())
+    return createFileKVBackend(Spec);
+  llvm::report_fatal_error("Unknown KV backend '" + Backend +
+                           "', expected 'redis' or 'file:<path>'\n");
+}
+
+KVStore::KVStore() : Impl (createSelectedBackend()) {}
 
-KVStore::~KVStore() {}
+KVStore::KVStore(std::unique_ptr<KVBackend> Backend)
+    : Impl(std::move(Backend)) {}
+
+KVStore::~KVStore() {
+  flush();
+}
 
 void KVStore::hIncrBy(llvm::StringRef Key, llvm::StringRef Field, int Incr) {
   Impl->hIncrBy(Key, Field, Incr);
@@ -121,4 +230,13 @@ void KVStore::hSet(llvm::StringRef Key, llvm::StringRef Field,
   Impl->hSet(Key, Field, Value);
 }
 
+void KVStore::hMGet(llvm::ArrayRef<std::string> Keys, llvm::StringRef Field,
+                    std::vector<llvm::Optional<std::string>> &Values) {
+  Impl->hMGet(Keys, Field, Values);
+}
+
+void KVStore::flush() {
+  Impl->flush();
+}
+
 }
@@ -14,12 +14,14 @@
 
 #define DEBUG_TYPE "souper"
 
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/DemandedBits.h"
 #include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
@@ -40,12 +42,18 @@
 #include "souper/KVStore/KVStore.h"
 #include "souper/SMTLIB2/Solver.h"
 #include "souper/Codegen/Codegen.h"
+#include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/Tool/GetSolver.h"
 #include "souper/Tool/CandidateMapUtils.h"
 #include "set"
+#include <atomic>
+#include <map>
+#include <thread>
 
 STATISTIC(InstructionReplaced, "Number of instructions replaced by another instruction");
 STATISTIC(DominanceCheckFailed, "Number of failed replacement due to dominance check");
+STATISTIC(RescansAvoided, "Number of function rescans avoided by applying "
+          "several replacements per harvest");
 
 using namespace souper;
 using namespace llvm;
@@ -73,6 +81,11 @@ static cl::opt<bool> DynamicProfile("souper-dynamic-profile", cl::init(false),
 static cl::opt<bool> StaticProfile("souper-static-profile", cl::init(false),
     cl::desc("Static profiling of Souper optimizations (default=false)"));
 
+static cl::opt<bool> IncrementalRescan("souper-incremental-rescan",
+    cl::init(false),
+    cl::desc("Apply all non-conflicting replacements found in one harvest, "
+             "then re-harvest only the blocks they touched (default=false)"));
+
 static cl::opt<unsigned> FirstReplace("souper-first-opt", cl::Hidden,
     cl::init(0),
     cl::desc("First Souper optimization to perform (default=0)"));
@@ -87,9 +100,71 @@ static const bool DynamicProfileAll = true;
 static const bool DynamicProfileAll = false;
 #endif
 
+typedef SmallPtrSet<BasicBlock *, 16> BlockSet;
+
+// The candidates harvested from one function and, if they were solved ahead
+// of time, the answers.
+struct FunctionHarvest {
+  struct Answer {
+    // the candidate was solved on a copy living here
+    std::unique_ptr<InstContext> IC;
+    std::error_code EC;
+    std::vector<Inst *> RHSs;
+  };
+
+  Function *F;
+  InstContext IC;
+  ExprBuilderContext EBC;
+  CandidateMap CandMap;
+  std::vector<Answer> Answers;
+};
+
 struct SouperPass : public ModulePass {
   static char ID;
 
+  static BasicBlock *getHarvestBlock(const CandidateReplacement &Cand) {
+    if (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromUse)
+      return Cand.Mapping.LHS->HarvestFrom;
+    return Cand.Origin->getParent();
+  }
+
+  // Whether a replacement applied earlier in the same harvest may have
+  // invalidated Cand: its root, a user of its root, or a value that its
+  // expression or path conditions were built from has been rewritten.
+  static bool isStale(const CandidateReplacement &Cand,
+                      const SmallPtrSetImpl<Value *> &Touched) {
+    if (Touched.empty())
+      return false;
+    if (Touched.count(Cand.Origin))
+      return true;
+    for (auto *U : Cand.Origin->users())
+      if (Touched.count(U))
+        return true;
+
+    std::vector<Inst *> Worklist = {Cand.Mapping.LHS};
+    for (auto &PC : Cand.PCs) {
+      Worklist.push_back(PC.LHS);
+      Worklist.push_back(PC.RHS);
+    }
+    for (auto &BPC : Cand.BPCs) {
+      Worklist.push_back(BPC.PC.LHS);
+      Worklist.push_back(BPC.PC.RHS);
+    }
+    std::set<Inst *> Visited;
+    while (!Worklist.empty()) {
+      Inst *I = Worklist.back();
+      Worklist.pop_back();
+      if (!Visited.insert(I).second)
+        continue;
+      for (auto *V : I->Origins)
+        if (Touched.count(V))
+          return true;
+      for (auto *Op : I->Ops)
+        Worklist.push_back(Op);
+    }
+    return false;
+  }
+
   Value* getOperand(Inst* I, unsigned index, Instruction *ReplacedInst,
                     ExprBuilderContext &EBC, DominatorTree &DT,
                     std::map<Inst *, Value *> &ReplacedValues,
@@ -197,29 +272,13 @@ public:
         .getValue(I);
   }
 
-  bool runOnFunction(Function *F) {
-    std::string FunctionName;
-    if (F->hasLocalLinkage()) {
-      FunctionName =
-        (F->getParent()->getModuleIdentifier() + ":" + F->getName()).str();
-    } else {
-      FunctionName = F->getName();
-    }
-
-    if (DebugLevel > 1) {
-      errs() << "\n";
-      errs() << "; entering Souper's runOnFunction() for " << FunctionName << "()\n\n";
-      F->getParent()->dump();
-      errs() << "\n";
-    }
-
-    InstContext IC;
-    ExprBuilderContext EBC;
-    std::map<Inst *, Value *> ReplacedValues;
+  // Harvests candidates from the blocks in Dirty, or from all of F if it is
+  // null.
+  void harvest(Function *F, FunctionHarvest &H, BlockSet *Dirty) {
+    H.F = F;
     LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
     if (!LI)
       report_fatal_error("getLoopInfo() failed");
-    auto &DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
     DemandedBits *DB = &getAnalysis<DemandedBitsWrapperPass>(*F).getDemandedBits();
     if (!DB)
       report_fatal_error("getDemandedBits() failed");
@@ -233,12 +292,13 @@ public:
     if (!TLI)
       report_fatal_error("getTLI() failed");
 
-    FunctionCandidateSet CS = ExtractCandidatesFromPass(F, LI, DB, LVI, SE, TLI, IC, EBC);
+    ExprBuilderOptions Opts;
+    Opts.HarvestBlocks = Dirty;
+    FunctionCandidateSet CS = ExtractCandidatesFromPass(F, LI, DB, LVI, SE, TLI, H.IC, H.EBC, Opts);
 
     if (DebugLevel > 3)
       errs() << "; extracted candidates\n";
 
-    CandidateMap CandMap;
     for (auto &B : CS.Blocks) {
       for (auto &R : B->Replacements) {
         if (DebugLevel > 4) {
@@ -249,11 +309,98 @@ public:
           ReplacementContext Context;
           PrintReplacementLHS(errs(), R.BPCs, R.PCs, R.Mapping.LHS, Context);
         }
-        AddToCandidateMap(CandMap, R);
+        AddToCandidateMap(H.CandMap, R);
       }
     }
+  }
+
+  // Solves the candidates of all harvests ahead of time on SolverJobs
+  // threads. Each candidate is solved on a copy in an InstContext of its
+  // own, since InstContexts cannot be shared between threads.
+  void solveHarvests(std::vector<std::unique_ptr<FunctionHarvest>> &Harvests) {
+    std::vector<std::pair<FunctionHarvest *, size_t>> Work;
+    CandidateMap All;
+    for (auto &H : Harvests) {
+      H->Answers.resize(H->CandMap.size());
+      for (size_t I = 0; I < H->CandMap.size(); ++I)
+        Work.emplace_back(H.get(), I);
+      All.insert(All.end(), H->CandMap.begin(), H->CandMap.end());
+    }
+    S->prefetch(All);
+
+    std::atomic<size_t> Next(0);
+    auto Worker = [&]() {
+      for (size_t J = Next++; J < Work.size(); J = Next++) {
+        FunctionHarvest &H = *Work[J].first;
+        auto &A = H.Answers[Work[J].second];
+        A.IC.reset(new InstContext);
+        CandidateReplacement Cand =
+          CloneCandidate(H.CandMap[Work[J].second], *A.IC);
+        A.EC = S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS, A.RHSs,
+                        /*AllowMultipleRHSs=*/false, *A.IC);
+      }
+    };
+    std::vector<std::thread> Threads;
+    for (unsigned I = 0; I < std::min<size_t>(SolverJobs, Work.size()); ++I)
+      Threads.emplace_back(Worker);
+    for (auto &T : Threads)
+      T.join();
+  }
+
+  // Harvests F and applies the first replacement found. With
+  // -souper-incremental-rescan, every replacement that does not conflict
+  // with an earlier one is applied instead; only the blocks in Dirty are
+  // harvested, unless it is null, and on return Dirty holds the blocks that
+  // need another look. If Pre is given, its candidates and answers are used
+  // instead of a new harvest.
+  bool runOnFunction(Function *F, BlockSet *Dirty = nullptr,
+                     FunctionHarvest *Pre = nullptr) {
+    std::string FunctionName;
+    if (F->hasLocalLinkage()) {
+      FunctionName =
+        (F->getParent()->getModuleIdentifier() + ":" + F->getName()).str();
+    } else {
+      FunctionName = F->getName();
+    }
 
-    for (auto &Cand : CandMap) {
+    if (DebugLevel > 1) {
+      errs() << "\n";
+      errs() << "; entering Souper's runOnFunction() for " << FunctionName << "()\n\n";
+      F->getParent()->dump();
+      errs() << "\n";
+    }
+
+    FunctionHarvest Local;
+    if (!Pre)
+      harvest(F, Local, Dirty);
+    FunctionHarvest &H = Pre ? *Pre : Local;
+    InstContext &IC = H.IC;
+    ExprBuilderContext &EBC = H.EBC;
+    CandidateMap &CandMap = H.CandMap;
+
+    std::map<Inst *, Value *> ReplacedValues;
+    auto &DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+    TargetLibraryInfo* TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(*F);
+    if (!TLI)
+      report_fatal_error("getTLI() failed");
+
+    // look all candidates up in the external cache in one round trip
+    if (!DynamicProfileAll && H.Answers.empty())
+      S->prefetch(CandMap);
+
+    // in incremental mode: the instructions rewritten so far, the number of
+    // replacements applied and the blocks to harvest again
+    SmallPtrSet<Value *, 32> Touched;
+    unsigned Applied = 0;
+    BlockSet NextDirty;
+
+    for (size_t Idx = 0; Idx < CandMap.size(); ++Idx) {
+      auto &Cand = CandMap[Idx];
+
+      if (IncrementalRescan && isStale(Cand, Touched)) {
+        NextDirty.insert(getHarvestBlock(Cand));
+        continue;
+      }
 
       if (StaticProfile) {
         std::string Str;
@@ -270,9 +417,15 @@ public:
         continue;
       }
       std::vector<Inst *> RHSs;
-      if (std::error_code EC =
-          S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                   RHSs, /*AllowMultipleRHSs=*/false, IC)) {
+      std::error_code EC;
+      if (H.Answers.empty()) {
+        EC = S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                      RHSs, /*AllowMultipleRHSs=*/false, IC);
+      } else {
+        EC = H.Answers[Idx].EC;
+        RHSs = H.Answers[Idx].RHSs;
+      }
+      if (EC) {
         if (EC == std::errc::timed_out ||
             EC == std::errc::value_too_large) {
           continue;
@@ -349,6 +502,35 @@ public:
       if (DynamicProfile)
         dynamicProfile(F, Cand);
 
+      if (IncrementalRescan) {
+        Touched.insert(I);
+        NextDirty.insert(getHarvestBlock(Cand));
+        // the harvests of everything computed from I, directly or not, are
+        // stale now
+        SmallVector<Instruction *, 16> Worklist;
+        for (auto *U : I->users()) {
+          auto *Usr = dyn_cast<Instruction>(U);
+          if (!Usr ||
+              (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromUse &&
+               Usr->getParent() != Cand.Mapping.LHS->HarvestFrom))
+            continue;
+          Worklist.push_back(Usr);
+        }
+        while (!Worklist.empty()) {
+          Instruction *Usr = Worklist.pop_back_val();
+          if (!Touched.insert(Usr).second)
+            continue;
+          NextDirty.insert(Usr->getParent());
+          // the path conditions of the successors may have changed as well
+          if (Usr->isTerminator())
+            for (auto *Succ : successors(Usr))
+              NextDirty.insert(Succ);
+          for (auto *U : Usr->users())
+            if (auto *Next = dyn_cast<Instruction>(U))
+              Worklist.push_back(Next);
+        }
+      }
+
       if (Cand.Mapping.LHS->HarvestKind == HarvestType::HarvestedFromDef) {
         I->replaceAllUsesWith(NewVal);
       } else {
@@ -364,7 +546,10 @@ public:
         }
       }
 
-      eliminateDeadCode(*F, TLI);
+      // later candidates may still point at instructions that become dead,
+      // so in incremental mode dead code is only removed after the last one
+      if (!IncrementalRescan)
+        eliminateDeadCode(*F, TLI);
 
       if (DebugLevel > 2) {
         if (DebugLevel > 4) {
@@ -377,6 +562,11 @@ public:
         errs() << "\n";
       }
 
+      if (IncrementalRescan) {
+        ++Applied;
+        continue;
+      }
+
       if (DebugLevel > 1) {
         errs() << "#########################################################\n";
         errs() << "; exiting Souper's runOnFunction() for " << FunctionName << "()\n";
@@ -385,11 +575,18 @@ public:
       return true;
     }
 
+    if (Applied) {
+      eliminateDeadCode(*F, TLI);
+      RescansAvoided += Applied - 1;
+      if (Dirty)
+        *Dirty = std::move(NextDirty);
+    }
+
     if (DebugLevel > 1) {
       errs() << "#########################################################\n";
       errs() << "; exiting Souper's runOnFunction() for " << FunctionName << "()\n";
     }
-    return false;
+    return Applied != 0;
   }
 
   bool runOnModule(Module &M) {
@@ -402,15 +599,60 @@ public:
     std::vector<Function *> FL;
     for (auto &I : M)
       FL.push_back((Function *)&I);
+    // Harvest all functions and solve their candidates in parallel up
+    // front. The IR is only changed afterwards, one function at a time.
+    std::map<Function *, std::unique_ptr<FunctionHarvest>> Harvested;
+    bool SolveAhead = SolverJobs > 1 && !UseAlive && !DynamicProfileAll;
+    if (SolveAhead) {
+      std::vector<std::unique_ptr<FunctionHarvest>> Harvests;
+      for (auto *F : FL) {
+        if (F->isDeclaration())
+          continue;
+        Harvests.emplace_back(new FunctionHarvest);
+        harvest(F, *Harvests.back(), /*Dirty=*/nullptr);
+      }
+      solveHarvests(Harvests);
+      for (auto &H : Harvests)
+        Harvested[H->F] = std::move(H);
+    }
+
     for (auto *F : FL) {
       if (F->isDeclaration())
         continue;
-      while (runOnFunction(F)) {
+      std::unique_ptr<FunctionHarvest> Pre;
+      auto It = Harvested.find(F);
+      if (It != Harvested.end()) {
+        Pre = std::move(It->second);
+        Harvested.erase(It);
+      }
+      // in incremental mode, the first harvest covers every block and later
+      // ones only the blocks that replacements touched
+      BlockSet Dirty;
+      for (auto &BB : *F)
+        Dirty.insert(&BB);
+      while (runOnFunction(F, IncrementalRescan ? &Dirty : nullptr,
+                           Pre.get())) {
+        Pre.reset();
         Changed = true;
-        if (DebugLevel > 2)
-          errs() << "rescanning function after transformation was applied\n";
+        if (DebugLevel > 2) {
+          if (IncrementalRescan)
+            errs() << "rescanning " << Dirty.size()
+                   << " blocks after transformations were applied\n";
+          else
+            errs() << "rescanning function after transformation was applied\n";
+        }
+        // the candidates of a rescan are solved in parallel too
+        if (SolveAhead) {
+          std::vector<std::unique_ptr<FunctionHarvest>> Rescan;
+          Rescan.emplace_back(new FunctionHarvest);
+          harvest(F, *Rescan.back(), IncrementalRescan ? &Dirty : nullptr);
+          solveHarvests(Rescan);
+          Pre = std::move(Rescan.back());
+        }
       }
     }
+    if (StaticProfile)
+      KV->flush();
     if (Verify && verifyModule(M, &errs()))
       llvm::report_fatal_error("module broken after (and probably by) Souper");
     if (DebugLevel > 1)
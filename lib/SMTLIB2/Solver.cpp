@@ -23,25 +23,71 @@
 #include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "souper/SMTLIB2/Solver.h"
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 #include <system_error>
 
 using namespace llvm;
 using namespace souper;
 
+STATISTIC(BatchQueries, "Number of SMT queries solved in a batch");
+STATISTIC(BatchSharedCommands,
+          "Number of SMT commands shared by the queries of a batch");
 STATISTIC(Errors, "Number of SMT solver errors");
+STATISTIC(Restarts, "Number of persistent SMT solver process restarts");
 STATISTIC(Sats, "Number of satisfiable SMT queries");
 STATISTIC(Timeouts, "Number of SMT solver timeouts");
 STATISTIC(Unsats, "Number of unsatisfiable SMT queries");
 
 SMTLIBSolver::~SMTLIBSolver() {}
 
+SMTLIBSolver::IncrementalContext::~IncrementalContext() {}
+
+std::error_code SMTLIBSolver::isSatisfiableExpr(Inst *Query, bool &Result,
+                                                std::vector<Inst *> *ModelVars,
+                                                std::vector<APInt> *Models,
+                                                unsigned Timeout) {
+  return std::make_error_code(std::errc::function_not_supported);
+}
+
+std::unique_ptr<SMTLIBSolver::IncrementalContext>
+SMTLIBSolver::createIncrementalContext() {
+  return nullptr;
+}
+
+std::error_code
+SMTLIBSolver::isSatisfiableBatch(ArrayRef<std::string> Queries,
+                                 std::vector<Optional<bool>> &IsSat,
+                                 bool StopAtFirstUnsat, unsigned Timeout) {
+  IsSat.assign(Queries.size(), None);
+  for (unsigned I = 0; I != Queries.size(); ++I) {
+    bool Result;
+    if (std::error_code EC = isSatisfiable(Queries[I], Result, 0, nullptr,
+                                           Timeout))
+      return EC;
+    IsSat[I] = Result;
+    if (!Result && StopAtFirstUnsat)
+      break;
+  }
+  return std::error_code();
+}
+
 namespace {
 
 // Bare bones SMT-LIB parser; enough to parse a get-value response.
@@ -201,6 +247,46 @@ std::vector<APInt> ParseModels(StringRef Models, unsigned NumModels,
   return ModelVals;
 }
 
+// Split an SMT-LIB script into its top-level commands, dropping comments
+// between them. Returns false if the script is not a sequence of balanced
+// s-expressions.
+bool splitCommands(StringRef Script, std::vector<StringRef> &Cmds) {
+  size_t I = 0, N = Script.size(), Start = 0;
+  unsigned Level = 0;
+  while (I != N) {
+    char C = Script[I];
+    if (C == ';') {
+      while (I != N && Script[I] != '\n')
+        ++I;
+      continue;
+    }
+    if (C == '"' || C == '|') {
+      if (Level == 0)
+        return false;
+      ++I;
+      while (I != N && Script[I] != C)
+        ++I;
+      if (I == N)
+        return false;
+      ++I;
+      continue;
+    }
+    if (C == '(') {
+      if (Level++ == 0)
+        Start = I;
+    } else if (C == ')') {
+      if (Level == 0)
+        return false;
+      if (--Level == 0)
+        Cmds.push_back(Script.slice(Start, I + 1));
+    } else if (Level == 0 && !isspace(C)) {
+      return false;
+    }
+    ++I;
+  }
+  return Level == 0;
+}
+
 class ProcessSMTLIBSolver : public SMTLIBSolver {
   std::string Name;
   bool Keep;
@@ -269,42 +355,425 @@ public:
     default: {
       llvm::ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
           MemoryBuffer::getFile(OutputPath.str());
+      ::remove(OutputPath.c_str());
       if (std::error_code EC = MB.getError()) {
-        ::remove(OutputPath.c_str());
         ++Errors;
         return EC;
       }
+      return parseSolverResponse((*MB)->getBuffer(), Result, NumModels,
+                                 Models);
+    }
+    }
+  }
+
+};
+
+// A solver process that stays alive across queries. Scripts are written to
+// its standard input and its answers are read back from standard output,
+// both over one socket, until an end-of-response marker that we ask the
+// solver to echo after every script.
+class SolverSession {
+  std::string Path;
+  std::vector<std::string> Args;
+  pid_t Pid = -1;
+  int FD = -1;
+  bool Started = false;
+
+  static constexpr const char *Marker = "souper-end-of-response";
 
-      if ((*MB)->getBuffer().startswith("sat\n")) {
-        ::remove(OutputPath.c_str());
-        Result = true;
-        ++Sats;
-        std::string ErrStr;
-        if (Models) {
-          *Models = ParseModels((*MB)->getBuffer().slice(4, StringRef::npos),
-                                NumModels, ErrStr);
+public:
+  SolverSession(StringRef Path, const std::vector<std::string> &Args)
+      : Path(Path.str()), Args(Args) {}
+  ~SolverSession() { stop(/*Kill=*/false); }
+
+  bool isRunning() const { return Pid != -1; }
+
+  std::error_code start() {
+    int FDs[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, FDs) == -1)
+      return std::error_code(errno, std::generic_category());
+    fcntl(FDs[0], F_SETFD, FD_CLOEXEC);
+    fcntl(FDs[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+    int One = 1;
+    setsockopt(FDs[0], SOL_SOCKET, SO_NOSIGPIPE, &One, sizeof(One));
+#endif
+
+    // build argv before forking: the child must not allocate
+    std::vector<const char *> ArgPtrs;
+    ArgPtrs.push_back(Path.c_str());
+    std::transform(Args.begin(), Args.end(), std::back_inserter(ArgPtrs),
+                   [](const std::string &Arg) { return Arg.c_str(); });
+    ArgPtrs.push_back(nullptr);
+
+    pid_t P = fork();
+    if (P == -1) {
+      std::error_code EC(errno, std::generic_category());
+      ::close(FDs[0]);
+      ::close(FDs[1]);
+      return EC;
+    }
+    if (P == 0) {
+      if (dup2(FDs[1], STDIN_FILENO) == -1) _exit(1);
+      if (dup2(FDs[1], STDOUT_FILENO) == -1) _exit(1);
+      int NullFD = open("/dev/null", O_WRONLY);
+      if (NullFD == -1 || dup2(NullFD, STDERR_FILENO) == -1) _exit(1);
+      execv(Path.c_str(), const_cast<char **>(ArgPtrs.data()));
+      _exit(127);
+    }
+
+    ::close(FDs[1]);
+    FD = FDs[0];
+    Pid = P;
+    if (Started)
+      ++Restarts;
+    Started = true;
+    return std::error_code();
+  }
+
+  void stop(bool Kill) {
+    if (FD != -1) {
+      // the solver exits when it reads EOF
+      ::close(FD);
+      FD = -1;
+    }
+    if (Pid != -1) {
+      if (Kill)
+        ::kill(Pid, SIGKILL);
+      while (::waitpid(Pid, nullptr, 0) == -1 && errno == EINTR)
+        ;
+      Pid = -1;
+    }
+  }
+
+  // Feed Script to the solver, restarting it first if needed, and collect
+  // everything it prints in response. On timeout or crash the process is
+  // killed; the next call starts a fresh one.
+  std::error_code run(StringRef Script, std::string &Out, unsigned Timeout) {
+    if (!isRunning())
+      if (std::error_code EC = start())
+        return EC;
+
+    std::string Msg = Script.str();
+    Msg += "\n(echo \"";
+    Msg += Marker;
+    Msg += "\")\n";
+
+#ifdef MSG_NOSIGNAL
+    const int SendFlags = MSG_NOSIGNAL;
+#else
+    const int SendFlags = 0;
+#endif
+    const char *Data = Msg.data();
+    size_t Left = Msg.size();
+    while (Left) {
+      ssize_t N = ::send(FD, Data, Left, SendFlags);
+      if (N == -1) {
+        if (errno == EINTR)
+          continue;
+        stop(/*Kill=*/true);
+        return std::make_error_code(std::errc::executable_format_error);
+      }
+      Data += N;
+      Left -= N;
+    }
+
+    std::string MarkerLine = std::string(Marker) + "\n";
+    auto Deadline = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(Timeout);
+    Out.clear();
+    char Buf[4096];
+    while (!StringRef(Out).endswith(MarkerLine)) {
+      int WaitMS = -1;
+      if (Timeout) {
+        auto Left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Deadline - std::chrono::steady_clock::now()).count();
+        if (Left <= 0) {
+          stop(/*Kill=*/true);
+          return std::make_error_code(std::errc::timed_out);
         }
-        if (!ErrStr.empty())
-          return std::make_error_code(std::errc::protocol_error);
-        return std::error_code();
-      } else if ((*MB)->getBuffer().startswith("unsat\n")) {
-        ::remove(OutputPath.c_str());
-        Result = false;
-        ++Unsats;
-        return std::error_code();
-      } else {
-        ::remove(OutputPath.c_str());
+        WaitMS = Left;
+      }
+      pollfd PFD = {FD, POLLIN, 0};
+      int Ready = ::poll(&PFD, 1, WaitMS);
+      if (Ready == -1 && errno == EINTR)
+        continue;
+      if (Ready == 0)
+        continue;
+      ssize_t N = Ready == -1 ? -1 : ::read(FD, Buf, sizeof(Buf));
+      if (N == -1 && errno == EINTR)
+        continue;
+      if (N <= 0) {
+        // the solver went away in the middle of a query
+        stop(/*Kill=*/true);
+        return std::make_error_code(std::errc::executable_format_error);
+      }
+      Out.append(Buf, N);
+    }
+    Out.resize(Out.size() - MarkerLine.size());
+    return std::error_code();
+  }
+};
+
+// The sessions of the threads that have sent queries to one persistent
+// solver. They all go away with the solver.
+struct ThreadSessionTable {
+  std::mutex Lock;
+  std::map<std::thread::id, std::unique_ptr<SolverSession>> Sessions;
+};
+
+// Ends the sessions of a thread when the thread exits, in the tables of
+// the solvers it used that are still around.
+struct ThreadSessionOwner {
+  std::vector<std::weak_ptr<ThreadSessionTable>> Tables;
+
+  ~ThreadSessionOwner() {
+    for (auto &W : Tables) {
+      auto Table = W.lock();
+      if (!Table)
+        continue;
+      std::unique_ptr<SolverSession> S;
+      {
+        std::lock_guard<std::mutex> Guard(Table->Lock);
+        auto It = Table->Sessions.find(std::this_thread::get_id());
+        if (It == Table->Sessions.end())
+          continue;
+        S = std::move(It->second);
+        Table->Sessions.erase(It);
+      }
+    }
+  }
+};
+
+static thread_local ThreadSessionOwner ThreadSessions;
+
+// Talks to one long-lived solver process per thread instead of launching a
+// process, and going through two temporary files, for every query. Batches
+// are spread over up to Jobs processes, taken from a separate pool.
+class PersistentSMTLIBSolver : public SMTLIBSolver {
+  std::string Name;
+  bool Keep;
+  std::string Path;
+  std::vector<std::string> Args;
+  unsigned Jobs;
+  std::shared_ptr<ThreadSessionTable> Sessions =
+    std::make_shared<ThreadSessionTable>();
+  std::mutex SessionsLock;
+  std::vector<std::unique_ptr<SolverSession>> BatchSessions;
+
+  SolverSession &getSession() {
+    std::lock_guard<std::mutex> Guard(Sessions->Lock);
+    auto &S = Sessions->Sessions[std::this_thread::get_id()];
+    if (!S) {
+      S.reset(new SolverSession(Path, Args));
+      ThreadSessions.Tables.push_back(Sessions);
+    }
+    return *S;
+  }
+
+  std::unique_ptr<SolverSession> takeBatchSession() {
+    std::lock_guard<std::mutex> Guard(SessionsLock);
+    if (BatchSessions.empty())
+      return std::unique_ptr<SolverSession>(new SolverSession(Path, Args));
+    std::unique_ptr<SolverSession> S = std::move(BatchSessions.back());
+    BatchSessions.pop_back();
+    return S;
+  }
+
+  void returnBatchSession(std::unique_ptr<SolverSession> S) {
+    std::lock_guard<std::mutex> Guard(SessionsLock);
+    BatchSessions.push_back(std::move(S));
+  }
+
+  void saveInput(StringRef Query) {
+    int InputFD;
+    SmallString<64> InputPath;
+    if (!sys::fs::createTemporaryFile("input", "smt2", InputFD, InputPath)) {
+      raw_fd_ostream InputFile(InputFD, true, /*unbuffered=*/true);
+      InputFile << Query;
+      llvm::errs() << "Solver input saved to " << InputPath << '\n';
+    }
+  }
+
+  static bool isSharedCommand(StringRef Cmd) {
+    return Cmd.startswith("(set-") || Cmd.startswith("(declare-") ||
+           Cmd.startswith("(define-") || Cmd.startswith("(assert");
+  }
+
+public:
+  PersistentSMTLIBSolver(std::string Name, bool Keep, StringRef Path,
+                         const std::vector<std::string> &Args, unsigned Jobs)
+      : Name(Name), Keep(Keep), Path(Path.str()), Args(Args),
+        Jobs(std::max(Jobs, 1u)) {}
+
+  std::string getName() const override {
+    return Name;
+  }
+
+  std::error_code isSatisfiable(StringRef Query, bool &Result,
+                                unsigned NumModels, std::vector<APInt> *Models,
+                                unsigned Timeout) override {
+    std::vector<StringRef> Cmds;
+    if (!splitCommands(Query, Cmds)) {
+      ++Errors;
+      return std::make_error_code(std::errc::protocol_error);
+    }
+
+    if (Keep)
+      saveInput(Query);
+
+    // every query starts from a clean solver state; (exit) would end the
+    // session
+    std::string Script = "(reset)\n";
+    for (StringRef Cmd : Cmds) {
+      if (Cmd == "(exit)")
+        continue;
+      Script += Cmd;
+      Script += '\n';
+    }
+
+    std::string Out;
+    if (std::error_code EC = getSession().run(Script, Out, Timeout)) {
+      if (EC == std::errc::timed_out)
+        ++Timeouts;
+      else
+        ++Errors;
+      return EC;
+    }
+    return parseSolverResponse(Out, Result, NumModels, Models);
+  }
+
+  // The leading commands that all queries agree on (logic, declarations and
+  // any common assertions) are sent once per process; each query then runs
+  // between a push and a pop on top of them. Workers pull queries in order
+  // from a shared index, so with StopAtFirstUnsat nothing past the first
+  // UNSAT is started once it has been seen.
+  std::error_code isSatisfiableBatch(ArrayRef<std::string> Queries,
+                                     std::vector<Optional<bool>> &IsSat,
+                                     bool StopAtFirstUnsat,
+                                     unsigned Timeout) override {
+    IsSat.assign(Queries.size(), None);
+    if (Queries.empty())
+      return std::error_code();
+
+    std::vector<std::vector<StringRef>> Cmds(Queries.size());
+    for (unsigned I = 0; I != Queries.size(); ++I) {
+      if (Keep)
+        saveInput(Queries[I]);
+      std::vector<StringRef> All;
+      if (!splitCommands(Queries[I], All)) {
         ++Errors;
         return std::make_error_code(std::errc::protocol_error);
       }
+      // models are not wanted and (exit) would end the session
+      for (StringRef Cmd : All)
+        if (Cmd != "(exit)" && !Cmd.startswith("(get-value"))
+          Cmds[I].push_back(Cmd);
     }
+
+    unsigned Shared = 0;
+    while (Shared < Cmds[0].size() && isSharedCommand(Cmds[0][Shared]) &&
+           std::all_of(Cmds.begin(), Cmds.end(),
+                       [&](const std::vector<StringRef> &C) {
+                         return Shared < C.size() &&
+                                C[Shared] == Cmds[0][Shared];
+                       }))
+      ++Shared;
+    BatchSharedCommands += Shared;
+
+    std::string Prefix = "(reset)\n";
+    for (unsigned I = 0; I != Shared; ++I) {
+      Prefix += Cmds[0][I];
+      Prefix += '\n';
     }
+
+    std::atomic<unsigned> Next(0);
+    std::atomic<bool> Done(false);
+    std::mutex ErrorLock;
+    std::error_code FirstError;
+
+    auto Work = [&]() {
+      std::unique_ptr<SolverSession> S = takeBatchSession();
+      bool Primed = false;
+      while (!Done) {
+        unsigned I = Next++;
+        if (I >= Queries.size())
+          break;
+        std::string Script;
+        if (!Primed || !Shared)
+          Script = Prefix;
+        if (Shared)
+          Script += "(push 1)\n";
+        for (unsigned J = Shared; J != Cmds[I].size(); ++J) {
+          Script += Cmds[I][J];
+          Script += '\n';
+        }
+        if (Shared)
+          Script += "(pop 1)\n";
+
+        std::string Out;
+        bool Result;
+        std::error_code EC = S->run(Script, Out, Timeout);
+        if (EC) {
+          if (EC == std::errc::timed_out)
+            ++Timeouts;
+          else
+            ++Errors;
+        } else {
+          EC = parseSolverResponse(Out, Result, 0, nullptr);
+        }
+        if (EC) {
+          std::lock_guard<std::mutex> Guard(ErrorLock);
+          if (!FirstError)
+            FirstError = EC;
+          Done = true;
+          break;
+        }
+        Primed = true;
+        ++BatchQueries;
+        IsSat[I] = Result;
+        if (!Result && StopAtFirstUnsat)
+          Done = true;
+      }
+      returnBatchSession(std::move(S));
+    };
+
+    unsigned Workers = std::min<size_t>(Jobs, Queries.size());
+    std::vector<std::thread> Threads;
+    for (unsigned I = 1; I < Workers; ++I)
+      Threads.emplace_back(Work);
+    Work();
+    for (auto &T : Threads)
+      T.join();
+    return FirstError;
   }
 
 };
 
 }
 
+std::error_code souper::parseSolverResponse(StringRef Out, bool &Result,
+                                            unsigned NumModels,
+                                            std::vector<APInt> *Models) {
+  if (Out.startswith("sat\n")) {
+    Result = true;
+    ++Sats;
+    std::string ErrStr;
+    if (Models)
+      *Models = ParseModels(Out.slice(4, StringRef::npos), NumModels, ErrStr);
+    if (!ErrStr.empty())
+      return std::make_error_code(std::errc::protocol_error);
+    return std::error_code();
+  } else if (Out.startswith("unsat\n")) {
+    Result = false;
+    ++Unsats;
+    return std::error_code();
+  } else {
+    ++Errors;
+    return std::make_error_code(std::errc::protocol_error);
+  }
+}
+
 SolverProgram souper::makeExternalSolverProgram(StringRef Path) {
   std::string PathStr = Path.str();
   return [PathStr](const std::vector<std::string> &Args, StringRef RedirectIn,
@@ -370,3 +839,10 @@ std::unique_ptr<SMTLIBSolver> souper::createZ3Solver(SolverProgram Prog,
   return std::unique_ptr<SMTLIBSolver>(
       new ProcessSMTLIBSolver("Z3", Keep, Prog, {"-smt2", "-in"}));
 }
+
+std::unique_ptr<SMTLIBSolver> souper::createPersistentZ3Solver(StringRef Path,
+                                                               bool Keep,
+                                                               unsigned Jobs) {
+  return std::unique_ptr<SMTLIBSolver>(
+      new PersistentSMTLIBSolver("Z3", Keep, Path, {"-smt2", "-in"}, Jobs));
+}
@@ -19,12 +19,17 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/KnownBits.h"
 #include "llvm/Support/raw_ostream.h"
+#include "souper/Infer/EnumerativeSynthesis.h"
 #include "souper/KVStore/KVStore.h"
 #include "souper/SMTLIB2/Solver.h"
 
+#include <atomic>
+#include <thread>
+
 
 void souper::AddToCandidateMap(CandidateMap &M,
                                const CandidateReplacement &CR) {
@@ -45,6 +50,159 @@ void souper::AddModuleToCandidateMap(InstContext &IC, ExprBuilderContext &EBC,
 
 namespace souper {
 
+unsigned SolverJobs;
+
+static llvm::cl::opt<unsigned, /*ExternalStorage=*/true> SolverJobsFlag(
+    "souper-jobs",
+    llvm::cl::desc("Number of candidates to solve concurrently; the output "
+                   "is the same as with one (default=1)"),
+    llvm::cl::location(SolverJobs), llvm::cl::init(1));
+
+static bool SolveCandidate(llvm::raw_ostream &OS, CandidateReplacement &Cand,
+                           int Profile, Solver *S, InstContext &IC) {
+  if (isInferDFA()) {
+    OS << '\n';
+    Cand.printFunction(OS);
+    ReplacementContext Context;
+    Cand.printLHS(OS, Context);
+
+    if (InferNeg) {
+      bool Negative;
+      if (std::error_code EC = S->negative(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                           Negative, IC)) {
+        llvm::errs() << "Error: " << EC.message() << '\n';
+        return false;
+      } else {
+        OS << "; negative from souper: "
+           << convertToStr(Negative) << "\n";
+      }
+    }
+    if (InferNonNeg) {
+      bool NonNegative;
+      if (std::error_code EC = S->nonNegative(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                              NonNegative, IC)) {
+        llvm::errs() << "Error: " << EC.message() << '\n';
+        return false;
+      } else {
+        OS << "; nonNegative from souper: "
+           << convertToStr(NonNegative) << "\n";
+      }
+    }
+    if (InferKnownBits) {
+      unsigned W = Cand.Mapping.LHS->Width;
+      KnownBits Known(W);
+      if (std::error_code EC = S->knownBits(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                            Known, IC)) {
+        llvm::errs() << "Error: " << EC.message() << '\n';
+        return false;
+      } else {
+        OS << "; knownBits from souper: "
+           << Inst::getKnownBitsString(Known.Zero, Known.One) << "\n";
+      }
+    }
+    if (InferPowerTwo) {
+      bool PowTwo;
+      if (std::error_code EC = S->powerTwo(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                           PowTwo, IC)) {
+        llvm::errs() << "Error: " << EC.message() << '\n';
+        return false;
+      } else {
+        OS << "; powerOfTwo from souper: "
+           << convertToStr(PowTwo) << "\n";
+      }
+    }
+    if (InferNonZero) {
+      bool NonZero;
+      if (std::error_code EC = S->nonZero(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                          NonZero, IC)) {
+        llvm::errs() << "Error: " << EC.message() << '\n';
+        return false;
+      } else {
+        OS << "; nonZero from souper: "
+           << convertToStr(NonZero) << "\n";
+      }
+    }
+    if (InferSignBits) {
+      unsigned SignBits;
+      if (std::error_code EC = S->signBits(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                                           SignBits, IC)) {
+        llvm::errs() << "Error: " << EC.message() << '\n';
+        return false;
+      } else {
+        OS << "; signBits from souper: "
+           << std::to_string(SignBits) << "\n";
+      }
+    }
+    if (InferRange) {
+      unsigned W = Cand.Mapping.LHS->Width;
+      llvm::ConstantRange Range = S->constantRange(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS, IC);
+
+      OS << "; range from souper: " << "[" << Range.getLower()
+         << "," << Range.getUpper() << ")" << "\n";
+    }
+    if (InferDemandedBits) {
+      llvm::errs() << "Error: Not Implemented\n";
+      return false;
+    }
+  } else {
+    std::vector<Inst *> RHSs;
+    if (std::error_code EC =
+        S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
+                 RHSs, /*AllowMultipleRHSs=*/false, IC)) {
+      llvm::errs() << "Unable to query solver: " << EC.message() << '\n';
+      return false;
+    }
+
+    if (!RHSs.empty()) {
+      OS << '\n';
+      OS << "; Static profile " << Profile << '\n';
+      // use the first RHS in list if there are multiple valid RHSs
+      Cand.Mapping.RHS = RHSs.front();
+      Cand.printFunction(OS);
+      Cand.print(OS);
+    }
+  }
+  return true;
+}
+
+CandidateReplacement CloneCandidate(const CandidateReplacement &Cand,
+                                    InstContext &IC) {
+  std::map<Inst *, Inst *> InstCache;
+  std::map<Block *, Block *> BlockCache;
+  auto Copy = [&](Inst *I) {
+    return getInstCopy(I, IC, InstCache, BlockCache, /*ConstMap=*/nullptr,
+                       /*CloneVars=*/true);
+  };
+
+  CandidateReplacement Clone(Cand.Origin,
+                             InstMapping(Copy(Cand.Mapping.LHS), nullptr));
+  for (auto &PC : Cand.PCs)
+    Clone.PCs.emplace_back(Copy(PC.LHS), Copy(PC.RHS));
+  for (auto &BPC : Cand.BPCs) {
+    InstMapping PC(Copy(BPC.PC.LHS), Copy(BPC.PC.RHS));
+    Block *&B = BlockCache[BPC.B];
+    if (!B)
+      B = IC.createBlock(BPC.B->Preds);
+    Clone.BPCs.emplace_back(B, BPC.PredIdx, PC);
+  }
+
+  // getInstCopy() only keeps what the solver sees; cost() and the printers
+  // also look at where an Inst came from
+  for (auto &P : InstCache) {
+    Inst *I = P.first, *C = P.second;
+    if (I == C)
+      continue;
+    for (auto D : I->DepsWithExternalUses) {
+      auto It = InstCache.find(D);
+      C->DepsWithExternalUses.insert(It == InstCache.end() ? D : It->second);
+    }
+    C->Origins = I->Origins;
+    C->HarvestKind = I->HarvestKind;
+    C->HarvestFrom = I->HarvestFrom;
+  }
+  return Clone;
+}
+
 bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
                        Solver *S, InstContext &IC, KVStore *KVForStaticProfile) {
   if (S) {
@@ -67,9 +225,11 @@ bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
       }
     }
 
+    std::vector<int> Work;
     for (int I=0; I < M.size(); ++I) {
       if (Profile[I] == 0)
         continue;
+      Work.push_back(I);
       auto &Cand = M[I];
 
       if (KVForStaticProfile) {
@@ -82,109 +242,51 @@ bool SolveCandidateMap(llvm::raw_ostream &OS, CandidateMap &M,
         KVForStaticProfile->hIncrBy(GetReplacementLHSString(Cand.BPCs,
             Cand.PCs, Cand.Mapping.LHS, Context), HField, 1);
       }
+    }
+    if (KVForStaticProfile)
+      KVForStaticProfile->flush();
+    S->prefetch(M);
 
-      if (isInferDFA()) {
-        OS << '\n';
-        Cand.printFunction(OS);
-        ReplacementContext Context;
-        Cand.printLHS(OS, Context);
-
-        if (InferNeg) {
-          bool Negative;
-          if (std::error_code EC = S->negative(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                                               Negative, IC)) {
-            llvm::errs() << "Error: " << EC.message() << '\n';
-            return false;
-          } else {
-            OS << "; negative from souper: "
-               << convertToStr(Negative) << "\n";
-          }
-        }
-        if (InferNonNeg) {
-          bool NonNegative;
-          if (std::error_code EC = S->nonNegative(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                                                  NonNegative, IC)) {
-            llvm::errs() << "Error: " << EC.message() << '\n';
-            return false;
-          } else {
-            OS << "; nonNegative from souper: "
-               << convertToStr(NonNegative) << "\n";
-          }
-        }
-        if (InferKnownBits) {
-          unsigned W = Cand.Mapping.LHS->Width;
-          KnownBits Known(W);
-          if (std::error_code EC = S->knownBits(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                                                Known, IC)) {
-            llvm::errs() << "Error: " << EC.message() << '\n';
-            return false;
-          } else {
-            OS << "; knownBits from souper: "
-               << Inst::getKnownBitsString(Known.Zero, Known.One) << "\n";
-          }
-        }
-        if (InferPowerTwo) {
-          bool PowTwo;
-          if (std::error_code EC = S->powerTwo(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                                               PowTwo, IC)) {
-            llvm::errs() << "Error: " << EC.message() << '\n';
-            return false;
-          } else {
-            OS << "; powerOfTwo from souper: "
-               << convertToStr(PowTwo) << "\n";
-          }
-        }
-        if (InferNonZero) {
-          bool NonZero;
-          if (std::error_code EC = S->nonZero(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                                              NonZero, IC)) {
-            llvm::errs() << "Error: " << EC.message() << '\n';
-            return false;
-          } else {
-            OS << "; nonZero from souper: "
-               << convertToStr(NonZero) << "\n";
-          }
-        }
-        if (InferSignBits) {
-          unsigned SignBits;
-          if (std::error_code EC = S->signBits(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                                               SignBits, IC)) {
-            llvm::errs() << "Error: " << EC.message() << '\n';
-            return false;
-          } else {
-            OS << "; signBits from souper: "
-               << std::to_string(SignBits) << "\n";
-          }
-        }
-        if (InferRange) {
-          unsigned W = Cand.Mapping.LHS->Width;
-          llvm::ConstantRange Range = S->constantRange(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS, IC);
-
-          OS << "; range from souper: " << "[" << Range.getLower()
-             << "," << Range.getUpper() << ")" << "\n";
-        }
-        if (InferDemandedBits) {
-          llvm::errs() << "Error: Not Implemented\n";
-          return false;
-        }
-      } else {
-        std::vector<Inst *> RHSs;
-        if (std::error_code EC =
-            S->infer(Cand.BPCs, Cand.PCs, Cand.Mapping.LHS,
-                     RHSs, /*AllowMultipleRHSs=*/false, IC)) {
-          llvm::errs() << "Unable to query solver: " << EC.message() << '\n';
+    // Alive2 cannot be driven from several threads
+    if (SolverJobs <= 1 || UseAlive) {
+      for (int I : Work)
+        if (!SolveCandidate(OS, M[I], Profile[I], S, IC))
           return false;
-        }
+      return true;
+    }
 
-        if (!RHSs.empty()) {
-          OS << '\n';
-          OS << "; Static profile " << Profile[I] << '\n';
-          // use the first RHS in list if there are multiple valid RHSs
-          Cand.Mapping.RHS = RHSs.front();
-          Cand.printFunction(OS);
-          Cand.print(OS);
+    // Each candidate is solved in an InstContext of its own and printed to a
+    // buffer; the buffers are written out in the original order.
+    std::vector<std::string> Outputs(Work.size());
+    std::vector<char> Failed(Work.size(), false);
+    std::atomic<unsigned> Next(0);
+    std::atomic<bool> Stop(false);
+    auto Worker = [&]() {
+      while (!Stop) {
+        unsigned J = Next++;
+        if (J >= Work.size())
+          break;
+        InstContext LocalIC;
+        CandidateReplacement Cand = CloneCandidate(M[Work[J]], LocalIC);
+        llvm::raw_string_ostream Out(Outputs[J]);
+        if (!SolveCandidate(Out, Cand, Profile[Work[J]], S, LocalIC)) {
+          Failed[J] = true;
+          Stop = true;
         }
+        Out.flush();
       }
+    };
+    std::vector<std::thread> Threads;
+    for (unsigned I = 0; I < std::min<size_t>(SolverJobs, Work.size()); ++I)
+      Threads.emplace_back(Worker);
+    for (auto &T : Threads)
+      T.join();
+
+    // every candidate before a failed one has been solved
+    for (unsigned J = 0; J != Work.size(); ++J) {
+      OS << Outputs[J];
+      if (Failed[J])
+        return false;
     }
   } else {
     OS << "; No solver specified; listing all candidate replacements.\n";
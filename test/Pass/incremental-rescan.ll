@@ -0,0 +1,27 @@
+
+; RUN: %opt -load %pass -souper -souper-incremental-rescan -S -stats -o - %s 2>&1 | %FileCheck %s
+
+; Both replacements come out of the first harvest; the second one does not
+; need the function to be rescanned.
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+@p = common global i32 0, align 4
+@q = common global i32 0, align 4
+
+define void @func(i32 %x, i32 %y) local_unnamed_addr #0 {
+entry:
+  %a = xor i32 %x, %x
+  ; CHECK: store i32 0, i32* @p
+  store i32 %a, i32* @p, align 4
+  br label %next
+
+next:
+  %b = sub i32 %y, %y
+  ; CHECK: store i32 0, i32* @q
+  store i32 %b, i32* @q, align 4
+  ret void
+}
+
+; CHECK: 1 souper - Number of function rescans avoided
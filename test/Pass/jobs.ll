@@ -0,0 +1,33 @@
+
+; RUN: %opt -load %pass -souper -souper-jobs=4 -S -o - %s 2>&1 | %FileCheck %s
+; RUN: %opt -load %pass -souper -souper-jobs=4 -souper-incremental-rescan -S -o - %s 2>&1 | %FileCheck %s
+
+; The candidates of all functions are solved up front on several threads,
+; then the replacements are applied one function at a time.
+
+target datalayout = "e-m:e-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+@p = common global i32 0, align 4
+@q = common global i32 0, align 4
+
+; CHECK-LABEL: @f(
+define void @f(i32 %x) local_unnamed_addr #0 {
+entry:
+  %a = xor i32 %x, %x
+  ; CHECK: store i32 0, i32* @p
+  store i32 %a, i32* @p, align 4
+  ret void
+}
+
+; CHECK-LABEL: @g(
+define void @g(i32 %y) local_unnamed_addr #0 {
+entry:
+  %b = sub i32 %y, %y
+  ; CHECK: store i32 0, i32* @q
+  store i32 %b, i32* @q, align 4
+  %c = and i32 %y, 0
+  ; CHECK: store i32 0, i32* @p
+  store i32 %c, i32* @p, align 4
+  ret void
+}
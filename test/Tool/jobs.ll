@@ -0,0 +1,34 @@
+; RUN: %llvm-as -o %t %s
+; RUN: %souper -souper-jobs=1 %t > %t1
+; RUN: %souper -souper-jobs=4 %t > %t2
+; RUN: diff %t1 %t2
+; RUN: %FileCheck %s < %t2
+
+; CHECK: Listing valid replacements.
+; CHECK: ; Function: foo
+; CHECK: cand %{{[0-9]+}} 0:i1
+; CHECK: ; Function: bar
+; CHECK: cand %{{[0-9]+}} 1:i1
+; CHECK: ; Function: baz
+; CHECK: cand %{{[0-9]+}} 0:i1
+
+define i1 @foo(i32 %x) {
+entry:
+  %a = and i32 %x, 240
+  %c = icmp eq i32 %a, 7
+  ret i1 %c
+}
+
+define i1 @bar(i32 %x) {
+entry:
+  %a = or i32 %x, 1
+  %c = icmp ne i32 %a, 0
+  ret i1 %c
+}
+
+define i1 @baz(i8 %x) {
+entry:
+  %a = zext i8 %x to i32
+  %c = icmp ugt i32 %a, 300
+  ret i1 %c
+}
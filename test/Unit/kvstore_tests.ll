@@ -0,0 +1 @@
+; RUN: %builddir/kvstore_tests
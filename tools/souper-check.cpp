@@ -15,6 +15,7 @@
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/GraphWriter.h"
 #include "llvm/Support/KnownBits.h"
+#include "llvm/Support/ManagedStatic.h"
 
 #include "souper/Infer/ConstantSynthesis.h"
 #include "souper/Infer/Pruning.h"
@@ -368,6 +369,7 @@ int SolveInst(const MemoryBufferRef &MB, Solver *S) {
 }
 
 int main(int argc, char **argv) {
+  llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
   cl::ParseCommandLineOptions(argc, argv);
   KVStore *KV = 0;
 
@@ -18,6 +18,7 @@
 #include "llvm/Support/SourceMgr.h"
 #include "souper/Extractor/Candidates.h"
 #include "souper/Extractor/ExprBuilder.h"
+#include "souper/Util/ShardedLRUCache.h"
 #include <memory>
 #include "gtest/gtest.h"
 
@@ -310,3 +311,45 @@ cand %2 1:i1
 cand %3 1:i1
 )c"));
 }
+
+TEST(ShardedLRUCacheTest, HitsAndMisses) {
+  ShardedLRUCache<int> Cache(/*Budget=*/0);
+  int V = 0;
+  EXPECT_FALSE(Cache.lookup("a", V));
+  Cache.insert("a", 1, 0);
+  EXPECT_TRUE(Cache.lookup("a", V));
+  EXPECT_EQ(1, V);
+
+  // the first answer stays
+  Cache.insert("a", 2, 0);
+  EXPECT_TRUE(Cache.lookup("a", V));
+  EXPECT_EQ(1, V);
+
+  EXPECT_EQ(2u, Cache.hits());
+  EXPECT_EQ(1u, Cache.misses());
+  EXPECT_EQ(0u, Cache.evictions());
+}
+
+TEST(ShardedLRUCacheTest, EvictsLeastRecentlyUsed) {
+  typedef ShardedLRUCache<int> CacheT;
+  const size_t EntrySize = 1 + sizeof(int) + CacheT::EntryOverhead;
+  CacheT Cache(/*Budget=*/3 * EntrySize, /*NumShards=*/1);
+  Cache.insert("a", 1, 0);
+  Cache.insert("b", 2, 0);
+  Cache.insert("c", 3, 0);
+  EXPECT_EQ(3 * EntrySize, Cache.bytes());
+
+  int V;
+  EXPECT_TRUE(Cache.lookup("a", V));
+  EXPECT_EQ(1u, Cache.insert("d", 4, 0));
+  EXPECT_FALSE(Cache.lookup("b", V));
+  EXPECT_TRUE(Cache.lookup("a", V));
+  EXPECT_TRUE(Cache.lookup("c", V));
+  EXPECT_TRUE(Cache.lookup("d", V));
+  EXPECT_EQ(1u, Cache.evictions());
+  EXPECT_EQ(3 * EntrySize, Cache.bytes());
+
+  // too big to ever fit
+  EXPECT_EQ(0u, Cache.insert("e", 5, 4 * EntrySize));
+  EXPECT_FALSE(Cache.lookup("e", V));
+}
@@ -15,6 +15,7 @@
 #include "llvm/Support/raw_ostream.h"
 #include "souper/Infer/Interpreter.h"
 #include "souper/Inst/Inst.h"
+#include "souper/Inst/LinearDAG.h"
 #include "gtest/gtest.h"
 
 using namespace souper;
@@ -63,3 +64,134 @@ TEST(InstTest, Print) {
   EXPECT_EQ("%0:i64 = add 1:i64, 2:i64\n"
             "%1:i64 = mul 3:i64, %0\n", SS.str());
 }
+
+TEST(InstTest, StructuralHash) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *Z = IC.createVar(32, "z");
+
+  // variable names do not matter, the shape of the expression does
+  Inst *XAX = IC.getInst(Inst::Add, 32, {X, X});
+  Inst *YAY = IC.getInst(Inst::Add, 32, {Y, Y});
+  Inst *XAY = IC.getInst(Inst::Add, 32, {X, Y});
+  Inst *ZAY = IC.getInst(Inst::Add, 32, {Z, Y});
+  Inst *XSY = IC.getInst(Inst::Sub, 32, {X, Y});
+
+  EXPECT_EQ(GetReplacementLHSHash({}, {}, XAX),
+            GetReplacementLHSHash({}, {}, YAY));
+  EXPECT_EQ(GetReplacementLHSHash({}, {}, XAY),
+            GetReplacementLHSHash({}, {}, ZAY));
+  EXPECT_NE(GetReplacementLHSHash({}, {}, XAX),
+            GetReplacementLHSHash({}, {}, XAY));
+  EXPECT_NE(GetReplacementLHSHash({}, {}, XAY),
+            GetReplacementLHSHash({}, {}, XSY));
+  EXPECT_NE(GetReplacementLHSHash({}, {}, XAY, /*HashNames=*/true),
+            GetReplacementLHSHash({}, {}, ZAY, /*HashNames=*/true));
+
+  // a path condition is part of the query
+  Inst *True = IC.getConst(llvm::APInt(1, 1));
+  std::vector<InstMapping> PCs = {
+      InstMapping(IC.getInst(Inst::Eq, 1, {X, Y}), True)};
+  EXPECT_NE(GetReplacementLHSHash({}, {}, XAY),
+            GetReplacementLHSHash({}, PCs, XAY));
+
+  // the words that are hashed are equal for equal structures
+  std::vector<uint64_t> XAXWords, YAYWords, XAYWords;
+  GetReplacementLHSHash({}, {}, XAX, /*HashNames=*/false, &XAXWords);
+  GetReplacementLHSHash({}, {}, YAY, /*HashNames=*/false, &YAYWords);
+  GetReplacementLHSHash({}, {}, XAY, /*HashNames=*/false, &XAYWords);
+  EXPECT_EQ(XAXWords, YAYWords);
+  EXPECT_NE(XAXWords, XAYWords);
+
+  // the hash memoized in an LHS is not returned once its demanded bits change
+  StructuralHash Before = GetReplacementLHSHash({}, {}, XAY);
+  XAY->DemandedBits = llvm::APInt(32, 1);
+  EXPECT_NE(Before, GetReplacementLHSHash({}, {}, XAY));
+}
+
+TEST(InstTest, LinearDAG) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *XAY = IC.getInst(Inst::Add, 32, {X, Y});
+  Inst *XMY = IC.getInst(Inst::Mul, 32, {X, Y});
+  Inst *Root = IC.getInst(Inst::Sub, 32, {XAY, XMY});
+
+  // shared operands get one node each, and come before their users
+  LinearDAG DAG(Root);
+  ASSERT_EQ(5u, DAG.size());
+  EXPECT_EQ(Root, DAG.getNode(DAG.size() - 1));
+  for (unsigned ID = 0; ID != DAG.size(); ++ID) {
+    Inst *I = DAG.getNode(ID);
+    auto Ops = DAG.getOps(ID);
+    ASSERT_EQ(I->Ops.size(), Ops.size());
+    for (unsigned J = 0; J != Ops.size(); ++J) {
+      EXPECT_LT(Ops[J], ID);
+      EXPECT_EQ(I->Ops[J], DAG.getNode(Ops[J]));
+    }
+  }
+
+  unsigned ID;
+  ASSERT_TRUE(DAG.lookup(XMY, ID));
+  EXPECT_EQ(XMY, DAG.getNode(ID));
+  EXPECT_FALSE(DAG.lookup(IC.getInst(Inst::Xor, 32, {X, Y}), ID));
+
+  // adding another root only adds the nodes that are new
+  Inst *C = IC.getConst(llvm::APInt(32, 7));
+  Inst *Other = IC.getInst(Inst::And, 32, {XAY, C});
+  EXPECT_EQ(6u, DAG.add(Other));
+  EXPECT_EQ(7u, DAG.size());
+}
+
+TEST(InstTest, CopyWithWidth) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(32, "x");
+  Inst *C = IC.getConst(llvm::APInt(32, -3, true));
+  Inst *XAC = IC.getInst(Inst::Add, 32, {X, C});
+  Inst *Cmp = IC.getInst(Inst::Ult, 1, {XAC, X});
+
+  std::map<Inst *, Inst *> Narrowed;
+  Inst *N = getInstCopyWithWidth(Cmp, IC, 32, 8, Narrowed);
+  ASSERT_NE(nullptr, N);
+  EXPECT_EQ(1u, N->Width);
+  EXPECT_EQ(8u, N->Ops[0]->Width);
+  ASSERT_TRUE(Narrowed.count(X));
+  EXPECT_EQ(8u, Narrowed[X]->Width);
+
+  // mapping the narrow vars back gives the original
+  std::map<Inst *, Inst *> Widened;
+  for (auto &P : Narrowed)
+    Widened[P.second] = P.first;
+  EXPECT_EQ(Cmp, getInstCopyWithWidth(N, IC, 8, 32, Widened));
+
+  // constants that don't fit and values of other widths can't be copied
+  std::map<Inst *, Inst *> Cache;
+  Inst *Big = IC.getInst(Inst::Add, 32, {X, IC.getConst(llvm::APInt(32, 1000))});
+  EXPECT_EQ(nullptr, getInstCopyWithWidth(Big, IC, 32, 8, Cache));
+  Inst *Ext = IC.getInst(Inst::ZExt, 32, {IC.createVar(16, "y")});
+  EXPECT_EQ(nullptr, getInstCopyWithWidth(Ext, IC, 32, 8, Cache));
+}
+
+TEST(InstTest, Share) {
+  InstContext IC;
+
+  Inst *X = IC.createVar(32, "x");
+  Inst *Y = IC.createVar(32, "y");
+  Inst *XAY = IC.getInst(Inst::Add, 32, {X, Y});
+  Inst *XSY = IC.getInst(Inst::Sub, 32, {X, Y});
+
+  InstContext Scratch;
+  Scratch.share(IC, {X, Y, XAY});
+
+  // the shared insts are handed out, the others are made anew
+  EXPECT_EQ(XAY, Scratch.getInst(Inst::Add, 32, {Y, X}));
+  Inst *ScratchXSY = Scratch.getInst(Inst::Sub, 32, {X, Y});
+  EXPECT_NE(XSY, ScratchXSY);
+  EXPECT_EQ(ScratchXSY, Scratch.getInst(Inst::Sub, 32, {X, Y}));
+  Inst *Mul = Scratch.getInst(Inst::Mul, 32, {XAY, ScratchXSY});
+  EXPECT_EQ(Mul, Scratch.getInst(Inst::Mul, 32, {ScratchXSY, XAY}));
+}
@@ -20,6 +20,7 @@
 #include "InterpreterInfra.h"
 #include "souper/Infer/Interpreter.h"
 #include "souper/Infer/AbstractInterpreter.h"
+#include "souper/Infer/Counterexamples.h"
 #include "souper/Inst/Inst.h"
 #include "gtest/gtest.h"
 
@@ -213,3 +214,125 @@ TEST(InterpreterTests, ConcreteCache) {
   // We would have got 0xFF if evaluateInst had returned result from cache.
   ASSERT_EQ(Val.getValue(), APInt(8, 0x0F, true));
 }
+
+// Checks that values of at most 64 bits, which are evaluated natively,
+// evaluate as they do on APInts
+TEST(InterpreterTests, NativeMatchesAPInt) {
+  InstContext IC;
+
+  std::vector<Inst::Kind> Kinds = {
+    Inst::Add, Inst::AddNSW, Inst::AddNUW, Inst::AddNW,
+    Inst::Sub, Inst::SubNSW, Inst::SubNUW, Inst::SubNW,
+    Inst::Mul, Inst::MulNSW, Inst::MulNUW, Inst::MulNW,
+    Inst::UDiv, Inst::SDiv, Inst::URem, Inst::SRem,
+    Inst::And, Inst::Or, Inst::Xor, Inst::Shl, Inst::LShr, Inst::AShr,
+    Inst::Eq, Inst::Ne, Inst::Ult, Inst::Ule, Inst::Slt, Inst::Sle
+  };
+
+  for (unsigned W : {1, 3, 8, 33, 64}) {
+    std::vector<APInt> Vals = {
+      APInt(W, 0), APInt(W, 1), APInt(W, 2), APInt::getAllOnesValue(W),
+      APInt::getSignedMinValue(W), APInt::getSignedMaxValue(W),
+      APInt(W, 0x5A5A5A5A5A5A5A5AULL), APInt(W, 0x0123456789ABCDEFULL)
+    };
+    Inst *A = IC.createVar(W, "a");
+    Inst *B = IC.createVar(W, "b");
+    for (auto K : Kinds) {
+      Inst *I = IC.getInst(K, Inst::isCmp(K) ? 1 : W, {A, B});
+      for (auto &X : Vals) {
+        for (auto &Y : Vals) {
+          ValueCache InputValues = {{A, X}, {B, Y}};
+          souper::ConcreteInterpreter Native(InputValues);
+          souper::ConcreteInterpreter Wide(InputValues);
+          Wide.setAPIntOnly();
+          auto N = Native.evaluateInst(I);
+          auto R = Wide.evaluateInst(I);
+          ASSERT_EQ(N.K, R.K) << Inst::getKindName(K) << " i" << W;
+          if (N.hasValue())
+            ASSERT_EQ(N.getValue(), R.getValue()) << Inst::getKindName(K)
+                                                  << " i" << W;
+        }
+      }
+    }
+  }
+}
+
+// Checks that BatchInterpreter gives every input the value that
+// ConcreteInterpreter gives it, poison and UB included
+TEST(InterpreterTests, BatchMatchesConcrete) {
+  InstContext IC;
+
+  for (unsigned W : {8, 64, 65}) {
+    Inst *A = IC.createVar(W, "a");
+    Inst *B = IC.createVar(W, "b");
+    Inst *Shl = IC.getInst(Inst::Shl, W, {A, B});
+    Inst *Div = IC.getInst(Inst::UDiv, W, {A, B});
+    Inst *Add = IC.getInst(Inst::AddNSW, W, {Shl, A});
+    Inst *Cmp = IC.getInst(Inst::Slt, 1, {A, B});
+    Inst *Sel = IC.getInst(Inst::Select, W, {Cmp, Add, Div});
+    Inst *Root = IC.getInst(Inst::Xor, W, {Sel, IC.getConst(APInt(W, 3))});
+
+    std::vector<ValueCache> Inputs;
+    for (uint64_t X : {0, 1, 5, 0x7F, 0x80, 0xFF})
+      for (uint64_t Y : {0, 1, 2, 7, 8, 64, 0xFF})
+        Inputs.push_back({{A, APInt(W, X)}, {B, APInt(W, Y)}});
+
+    souper::BatchInterpreter BI(Inputs);
+    auto Vals = BI.evaluateInst(Root);
+    ASSERT_EQ(Vals.size(), Inputs.size());
+    for (unsigned I = 0; I != Inputs.size(); ++I) {
+      souper::ConcreteInterpreter CI(Inputs[I]);
+      auto V = CI.evaluateInst(Root);
+      ASSERT_EQ(Vals[I].K, V.K) << "input " << I << " i" << W;
+      if (V.hasValue())
+        ASSERT_EQ(Vals[I].getValue(), V.getValue()) << "input " << I
+                                                    << " i" << W;
+    }
+  }
+}
+
+TEST(InterpreterTests, CounterexampleStore) {
+  InstContext IC;
+  Inst *X = IC.createVar(13, "x");
+  Inst *Y = IC.createVar(13, "y");
+  Inst *LHS = IC.getInst(Inst::Add, 13, {X, IC.getConst(APInt(13, 77))});
+  std::vector<InstMapping> PCs = {
+    {IC.getInst(Inst::Ult, 1, {X, Y}), IC.getConst(APInt(1, 1))}};
+
+  CounterexampleStore Store(LHS, {}, PCs);
+  ASSERT_TRUE(Store.isEnabled());
+  // the PC does not hold
+  EXPECT_FALSE(Store.add({X, Y}, {APInt(13, 9), APInt(13, 2)}));
+  // y is missing
+  EXPECT_FALSE(Store.add({X}, {APInt(13, 1)}));
+  EXPECT_TRUE(Store.add({Y, X}, {APInt(13, 9), APInt(13, 2)}));
+  EXPECT_FALSE(Store.add({X, Y}, {APInt(13, 2), APInt(13, 9)}));
+  EXPECT_EQ(Store.getInputs().size(), 1u);
+
+  Inst *Wrong = IC.getInst(Inst::Add, 13, {X, IC.getConst(APInt(13, 78))});
+  const ValueCache *Refutation = Store.findRefutation(Wrong);
+  ASSERT_NE(Refutation, nullptr);
+  EXPECT_EQ(Refutation->at(X).Value, 2u);
+  Inst *Right = IC.getInst(Inst::Sub, 13, {X, IC.getConst(APInt(13, -77))});
+  EXPECT_EQ(Store.findRefutation(Right), nullptr);
+  Inst *C = IC.createSynthesisConstant(13, 1);
+  EXPECT_EQ(Store.findRefutation(IC.getInst(Inst::Add, 13, {X, C})), nullptr);
+  EXPECT_EQ(Store.Refuted, 1u);
+
+  // a structurally equal LHS starts out with the counterexample
+  InstContext OtherIC;
+  Inst *OtherX = OtherIC.createVar(13, "x");
+  Inst *OtherY = OtherIC.createVar(13, "y");
+  std::vector<InstMapping> OtherPCs = {
+    {OtherIC.getInst(Inst::Ult, 1, {OtherX, OtherY}),
+     OtherIC.getConst(APInt(1, 1))}};
+  CounterexampleStore Other(
+      OtherIC.getInst(Inst::Add, 13, {OtherX, OtherIC.getConst(APInt(13, 77))}),
+      {}, OtherPCs);
+  ASSERT_EQ(Other.getInputs().size(), 1u);
+  EXPECT_EQ(Other.getInputs()[0].at(OtherY).Value, 9u);
+
+  // the interpreter can't be trusted with freeze
+  Inst *Frozen = IC.getInst(Inst::Freeze, 13, {LHS});
+  EXPECT_FALSE(CounterexampleStore(Frozen, {}, PCs).isEnabled());
+}
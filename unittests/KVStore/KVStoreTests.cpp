@@ -0,0 +1,114 @@
+// Copyright 2014 The Souper Authors. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "souper/KVStore/KVStore.h"
+#include "gtest/gtest.h"
+
+using namespace souper;
+
+namespace {
+
+class FileKVStoreTest : public testing::Test {
+protected:
+  llvm::SmallString<128> Path;
+
+  void SetUp() override {
+    ASSERT_FALSE(llvm::sys::fs::createTemporaryFile("souper-kv", "log", Path));
+  }
+  void TearDown() override { llvm::sys::fs::remove(Path); }
+
+  std::unique_ptr<KVStore> open() {
+    return std::make_unique<KVStore>(createFileKVBackend(Path));
+  }
+};
+
+}
+
+TEST_F(FileKVStoreTest, SetGet) {
+  auto KV = open();
+  std::string V;
+  EXPECT_FALSE(KV->hGet("%0:i32 = var", "result", V));
+  KV->hSet("%0:i32 = var", "result", "0:i32");
+  KV->hSet("%0:i32 = var", "result", "1:i32");
+  KV->hSet("%0:i32 = var", "other", "");
+  ASSERT_TRUE(KV->hGet("%0:i32 = var", "result", V));
+  EXPECT_EQ("1:i32", V);
+  ASSERT_TRUE(KV->hGet("%0:i32 = var", "other", V));
+  EXPECT_EQ("", V);
+
+  // the contents survive reopening
+  KV = open();
+  ASSERT_TRUE(KV->hGet("%0:i32 = var", "result", V));
+  EXPECT_EQ("1:i32", V);
+}
+
+TEST_F(FileKVStoreTest, IncrBy) {
+  auto KV = open();
+  KV->hIncrBy("lhs", "sprofile foo", 1);
+  KV->hIncrBy("lhs", "sprofile foo", 1);
+  KV->hIncrBy("lhs", "sprofile foo", 3);
+  std::string V;
+  ASSERT_TRUE(KV->hGet("lhs", "sprofile foo", V));
+  EXPECT_EQ("5", V);
+}
+
+TEST_F(FileKVStoreTest, SharedFile) {
+  // two stores on one file behave like two processes sharing it
+  auto A = open(), B = open();
+  std::string V;
+  A->hSet("k", "result", "a");
+  ASSERT_TRUE(B->hGet("k", "result", V));
+  EXPECT_EQ("a", V);
+  B->hIncrBy("k", "count", 1);
+  A->hIncrBy("k", "count", 1);
+  ASSERT_TRUE(A->hGet("k", "count", V));
+  EXPECT_EQ("2", V);
+  ASSERT_TRUE(B->hGet("k", "count", V));
+  EXPECT_EQ("2", V);
+}
+
+TEST_F(FileKVStoreTest, TornRecord) {
+  open()->hSet("k", "result", "a");
+  {
+    // a record cut short by a crash
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Append);
+    ASSERT_FALSE(EC);
+    OS << "\x01\x02\x03\x04\x01\x01\x00";
+  }
+  auto KV = open();
+  std::string V;
+  ASSERT_TRUE(KV->hGet("k", "result", V));
+  EXPECT_EQ("a", V);
+  KV->hSet("k", "result", "b");
+
+  KV = open();
+  ASSERT_TRUE(KV->hGet("k", "result", V));
+  EXPECT_EQ("b", V);
+}
+
+TEST_F(FileKVStoreTest, MGet) {
+  auto KV = open();
+  KV->hSet("a", "result", "1");
+  KV->hSet("c", "result", "");
+  std::vector<llvm::Optional<std::string>> Values;
+  KV->hMGet({"a", "b", "c"}, "result", Values);
+  ASSERT_EQ(3u, Values.size());
+  EXPECT_EQ(std::string("1"), Values[0]);
+  EXPECT_FALSE(Values[1].hasValue());
+  EXPECT_EQ(std::string(""), Values[2]);
+}